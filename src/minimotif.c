@@ -17,23 +17,56 @@
  *
  */
 
+#define _GNU_SOURCE                      /* For CPU affinity */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <locale.h>
 #include <getopt.h>
 #include <math.h>
 #include <limits.h>
+#include <stdint.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <zlib.h>
 #include "kseq.h"
+#include "minimotif_shm.h"
+#ifdef MINIMOTIF_LIB
+#include <setjmp.h>
+#include "minimotif.h"
+#endif
 
 KSEQ_INIT(gzFile, gzread)
 
 #define MINIMOTIF_VERSION                  "1.0"
 #define MINIMOTIF_YEAR                      2022
 
+/* In the library, the state of a scan is thread-local, so that every thread
+ * can work on its own context (see the end of this file). The CLI shares it
+ * between all threads as usual.
+ */
+#ifdef MINIMOTIF_LIB
+#define IS_LIB                                 1
+#define LIB_LOCAL                         __thread
+#else
+#define IS_LIB                                 0
+#define LIB_LOCAL
+#endif
+
 /* These defaults can be safely changed. The only effects of doing so will be
  * on performance. Depending on whether your motifs are extremely large, or
  * you are working with extreme imbalances in your background, changing these
@@ -102,6 +135,10 @@ KSEQ_INIT(gzFile, gzread)
  */
 #define SEQ_REALLOC_SIZE                  524288
 
+/* Size of the blocks picked at random by --sample.
+ */
+#define SAMPLE_BLOCK_SIZE         ((size_t) 10000)
+
 #define VEC_ADD(VEC, X, VEC_LEN)                                \
   do {                                                          \
     for (size_t Xi = 0; Xi < VEC_LEN; Xi++) VEC[Xi] += X;       \
@@ -156,6 +193,10 @@ void usage(void) {
     "            other than ACGTU) will be read but are treated as gaps during     \n"
     "            scanning.                                                         \n"
     " -o <str>   Filename to output results. By default output goes to stdout.     \n"
+    " -B <str>   Filename of background sequences. Instead of reporting hits, the  \n"
+    "            number of sequences with at least one hit in -s and -B is compared\n"
+    "            for each motif using a one-sided Fisher's exact test, with        \n"
+    "            Q-values across motifs (Benjamini-Hochberg).                      \n"
     " -b <dbl,   Comma-separated background probabilities for A,C,G,T|U. By default\n"
     "     dbl,   the background probability values from the motif file (MEME only) \n"
     "     dbl,   are used, or a uniform background is assumed. Used in PWM         \n"
@@ -164,6 +205,95 @@ void usage(void) {
     " -t <dbl>   Threshold P-value. Default: %g.                         \n"
     " -0         Instead of using a threshold, simply report all hits with a score \n"
     "            of zero or greater. Useful for manual filtering.                  \n"
+    " -q         Add a column of Benjamini-Hochberg Q-values, calculated per motif.\n"
+    "            Every scanned window counts as a test. Hits are kept in a         \n"
+    "            temporary file until scanning is complete ($TMPDIR or /tmp).      \n"
+    " -Q         Same as -q, but Q-values are calculated across all motifs.        \n"
+    " --no-overlap[=strand]                                                        \n"
+    "            Greedily pick non-overlapping hits of every motif: from best to   \n"
+    "            worst (ties go to the leftmost hit), a hit is kept unless it      \n"
+    "            overlaps a hit already kept. Hits on both strands are compared,   \n"
+    "            unless 'strand' is given. Filtering is done while scanning and    \n"
+    "            only needs to remember the last few hits.                         \n"
+    " --best <int>                                                                 \n"
+    "            Only report the best <int> hits of each motif in every sequence   \n"
+    "            (from either strand), sorted by score. Hits must still pass the   \n"
+    "            threshold; use -t 1 to get <int> hits wherever possible. Windows  \n"
+    "            are abandoned early once they can't beat the hits found so far.   \n"
+    " --top <int>                                                                  \n"
+    "            Only report the best <int> hits of each motif across all          \n"
+    "            sequences, sorted by score and printed once scanning is done. The \n"
+    "            threshold rises as better hits are found, so scanning speeds up   \n"
+    "            as it goes.                                                       \n"
+    " --count[=strand]                                                             \n"
+    "            Instead of reporting hits, output a matrix with the number of     \n"
+    "            hits for every sequence (rows) and motif (columns). Use 'strand'  \n"
+    "            to get separate columns for each strand. Can be combined with     \n"
+    "            --no-overlap and --best.                                          \n"
+    " --binary   Write --count output as a NumPy .npy matrix (uint32), with rows   \n"
+    "            and columns in input order and no header. With --bins, write a    \n"
+    "            float32 matrix of motifs (rows) by bins (columns) instead.        \n"
+    "            With --occupancy, write a float64 matrix.                         \n"
+    " --occupancy                                                                  \n"
+    "            Instead of reporting hits, output a matrix with the sum of        \n"
+    "            2^score (i.e. the odds ratio) over every window of every sequence \n"
+    "            (rows) and motif (columns), from both strands.                    \n"
+    " --cooccur <int>                                                              \n"
+    "            Instead of reporting hits, count every pair of hits whose starts  \n"
+    "            are at most <int> bases apart, as a matrix of the left (rows) by  \n"
+    "            right (columns) motifs. Spacing histograms are also output for    \n"
+    "            every pair and relative orientation; these may use at most 4 GB   \n"
+    "            of memory (see --pairs).                                          \n"
+    " --pairs <str>                                                                \n"
+    "            Only output --cooccur histograms for these pairs of motifs, given \n"
+    "            as a comma-separated list of left:right motif names.              \n"
+    " --anchor <str>                                                               \n"
+    "            Comma-separated names of anchor motifs. These are scanned first,  \n"
+    "            and the other motifs are then only scanned near their hits (see   \n"
+    "            --anchor-window). Can be combined with --no-overlap and --count.  \n"
+    " --anchor-window <int>                                                        \n"
+    "            Hits of the other motifs must fall within <int> bases of an       \n"
+    "            anchor hit. Default: 200.                                         \n"
+    " --vcf <str>                                                                  \n"
+    "            Filename of a VCF file (can be gzipped) with variants in the -s   \n"
+    "            sequences. Instead of scanning whole sequences, only the windows  \n"
+    "            overlapping each variant are scored with the reference and the    \n"
+    "            alternative allele. The best score and P-value of each are        \n"
+    "            reported for every variant and motif where either one is a hit.   \n"
+    " --sample <dbl>                                                               \n"
+    "            Instead of reporting hits, only scan this fraction of the         \n"
+    "            sequences (in randomly picked blocks of 10 kb, see --seed) and    \n"
+    "            report the estimated number of hits per motif with 95%%            \n"
+    "            confidence intervals, as well as the throughput and the projected \n"
+    "            time and output size of a full run with the same options.         \n"
+    " --shuffle <int>                                                              \n"
+    "            Instead of reporting hits, scan <int> shuffled copies of every    \n"
+    "            sequence as well and output the hit rates and empirical FDR of    \n"
+    "            each motif. Shuffled sequences are never written to disk. Only    \n"
+    "            ACGTU stretches are shuffled; other letters stay in place.        \n"
+    " --kmer <int>                                                                 \n"
+    "            Size of k-mers to preserve when shuffling (1-8). Default: 2.      \n"
+    " --seed <int>                                                                 \n"
+    "            Seed for shuffling. The same seed always gives the same shuffles, \n"
+    "            no matter the number of threads. Default: 1.                      \n"
+    " --track <str>                                                                \n"
+    "            Instead of reporting hits, write the score of every position to   \n"
+    "            NumPy .npy files named <str><motif>.fwd.npy (and .rev.npy), as    \n"
+    "            float16 arrays with all sequences joined end to end. Positions    \n"
+    "            too close to the end of a sequence are NaN. The sequence offsets  \n"
+    "            are written to the normal output.                                 \n"
+    " --track-int                                                                  \n"
+    "            Write --track scores as int32 (scores x 1000) instead, with       \n"
+    "            missing positions set to the smallest int32.                      \n"
+    " --bins <int>                                                                 \n"
+    "            Instead of reporting hits, summarize every motif in bins of       \n"
+    "            <int> bases as bedGraph tracks (one per motif). Only needs memory \n"
+    "            for the bins of a single sequence per thread.                     \n"
+    " --bin-stat <str>                                                             \n"
+    "            What to put in every bin: 'count' (number of hits starting in     \n"
+    "            the bin; empty bins are left out), 'max' (best score of any       \n"
+    "            window starting in the bin) or 'occupancy' (sum of 2^score over   \n"
+    "            all windows starting in the bin). Default: count.                 \n"
     " -p <int>   Pseudocount for PWM generation. Default: %d. Must be a positive    \n"
     "            integer.                                                          \n"
     " -n <int>   Number of motif sites used in PWM generation. Default: %d.         \n"
@@ -181,6 +311,63 @@ void usage(void) {
     "            increasing this number will also increase memory usage slightly.  \n"
     "            The number of threads is limited by the number of motifs being    \n"
     "            scanned.                                                          \n"
+    " --auto     Pick the number of threads (up to -j, or all cores by default),   \n"
+    "            low-mem mode and the scanning kernel of every motif from a cost   \n"
+    "            model of the motif and sequence sizes, calibrated with a short    \n"
+    "            benchmark. Use -v to see the plan. If loading the sequences into  \n"
+    "            memory wins, they are read twice.                                 \n"
+    " --mem <str>                                                                  \n"
+    "            Keep memory use below this size (e.g. 500M or 8G): load as many   \n"
+    "            sequences as fit, scan them with all motifs, free them and move   \n"
+    "            on to the next batch. Can be combined with -q/-Q, --no-overlap,   \n"
+    "            --best, --top, --count and --occupancy. Use -v to see the peak.   \n"
+    " --checkpoint <str>                                                           \n"
+    "            Record finished work in this file while scanning (every minute    \n"
+    "            and after every motif), so that an interrupted run can be         \n"
+    "            continued with --resume. Needs -o. On SIGTERM, the work finished  \n"
+    "            so far is recorded before exiting. Can be combined with           \n"
+    "            --no-overlap, --best and --mem.                                   \n"
+    " --resume   Continue the run recorded in the --checkpoint file, which must    \n"
+    "            have been made with the same options and inputs. Finished work is \n"
+    "            skipped and new hits are appended to the -o file. Starts from     \n"
+    "            scratch if the --checkpoint file doesn't exist yet.               \n"
+    " --shard <int/int>                                                            \n"
+    "            Only do part i of N of the scan (e.g. 2/8), for spreading a scan  \n"
+    "            over several machines. Each motif is scanned in blocks of         \n"
+    "            sequences, which are shared out by their estimated cost the same  \n"
+    "            way by every shard. Can be combined with --no-overlap, --best,    \n"
+    "            --mem and --checkpoint.                                           \n"
+    " --merge    Instead of scanning, combine the outputs of every --shard run     \n"
+    "            (listed after all other options) into the output of a single      \n"
+    "            run, after checking that no part of the scan is missing.          \n"
+    " --manifest <str>                                                             \n"
+    "            Instead of -s and -o, scan every sequence file listed in this     \n"
+    "            file (one tab-separated pair of input and output filenames per    \n"
+    "            line) with the same motifs, which are only prepared once. With    \n"
+    "            fewer motifs than threads, several files are scanned at once. Can \n"
+    "            be combined with --no-overlap, --best, --count and --occupancy.   \n"
+    " --cache <str>                                                                \n"
+    "            Keep the hits of every motif and sequence in this directory, so   \n"
+    "            that later runs only scan the pairs not seen before. Motifs and   \n"
+    "            sequences are recognised by their contents, together with the     \n"
+    "            threshold and the options which change the hits. Can be combined  \n"
+    "            with --no-overlap, --best, --checkpoint and --shard.              \n"
+    " --serve <str>                                                                \n"
+    "            Load the -s sequences (and any -m motifs) once, then take scan    \n"
+    "            requests on this Unix socket (up to 4 at a time), each with its   \n"
+    "            own motifs, threshold and regions, and send the hits back. See    \n"
+    "            the README for the request format. Can be combined with           \n"
+    "            --no-overlap.                                                     \n"
+    " --shm <str>                                                                  \n"
+    "            Instead of printing hits, write them as binary records to a ring  \n"
+    "            buffer in this POSIX shared memory object (e.g. /minimotif), for  \n"
+    "            another process to read as they come. See src/minimotif_shm.h for \n"
+    "            the format. Can be combined with --no-overlap, --mem and --auto.  \n"
+    " --numa     Pin threads to the CPUs of the NUMA nodes, and place a copy of the\n"
+    "            sequences in the memory of every node (or, if there isn't enough  \n"
+    "            free memory, spread them over the nodes). The throughput of every \n"
+    "            node is printed with -v. Only used with -j. Can't be combined with\n"
+    "            --mem, --sample or --vcf.                                         \n"
     " -g         Print a progress bar during scanning. This turns off some of the  \n"
     "            messages printed by -w. Note that it's only useful if there is    \n"
     "            more than one input motif.                                        \n"
@@ -211,7 +398,7 @@ const unsigned char char2index[] = {
   4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4 
 };
 
-size_t char_counts[256];
+LIB_LOCAL size_t char_counts[256];
 
 const double consensus2probs[] = {
   1.0,   0.0,   0.0,   0.0,        /*  0. A */
@@ -258,9 +445,36 @@ enum MOTIF_FMT {
   FMT_UNKNOWN  = 5
 };
 
+enum BIN_STAT {
+  BIN_COUNT     = 1,
+  BIN_MAX       = 2,
+  BIN_OCCUPANCY = 3
+};
+
 typedef struct args_t {
   double   bkg[4];
   double   pvalue;
+  size_t   best;
+  size_t   top;
+  size_t   shuffle;
+  uint64_t seed;
+  int      kmer;
+  char    *track;
+  size_t   bin_size;
+  size_t   cooccur;
+  char    *pairs;
+  char    *anchors;
+  size_t   anchor_window;
+  double   sample;
+  size_t   mem;
+  char    *checkpoint;
+  size_t   shard_i;
+  size_t   shard_n;
+  char    *manifest;
+  char    *cache;
+  char    *serve;
+  char    *shm;
+  int      bin_stat;
   int      nsites;
   int      pseudocount; 
   int      nthreads;
@@ -270,14 +484,49 @@ typedef struct args_t {
   int      use_user_bkg : 1;
   int      low_mem : 1;
   int      thresh0 : 1;
+  int      qvalues : 1;
+  int      qvalues_global : 1;
+  int      no_overlap : 1;
+  int      overlap_strand : 1;
+  int      count : 1;
+  int      count_strand : 1;
+  int      binary : 1;
+  int      enrich : 1;
+  int      track_int : 1;
+  int      occupancy : 1;
+  int      auto_plan : 1;
+  int      resume : 1;
+  int      merge : 1;
+  int      numa : 1;
   int      progress : 1;
   int      v : 1;
   int      w : 1;
 } args_t;
 
-args_t args = {
+const args_t default_args = {
   .bkg             = {0.25, 0.25, 0.25, 0.25},
   .pvalue          = DEFAULT_PVALUE,
+  .best            = 0,
+  .top             = 0,
+  .shuffle         = 0,
+  .seed            = 1,
+  .kmer            = 2,
+  .track           = NULL,
+  .bin_size        = 0,
+  .cooccur         = 0,
+  .pairs           = NULL,
+  .anchors         = NULL,
+  .anchor_window   = 200,
+  .sample          = 0.0,
+  .mem             = 0,
+  .checkpoint      = NULL,
+  .shard_i         = 0,
+  .shard_n         = 0,
+  .manifest        = NULL,
+  .cache           = NULL,
+  .serve           = NULL,
+  .shm             = NULL,
+  .bin_stat        = BIN_COUNT,
   .nsites          = DEFAULT_NSITES,
   .pseudocount     = DEFAULT_PSEUDOCOUNT,
   .scan_rc         = 1,
@@ -287,14 +536,42 @@ args_t args = {
   .low_mem         = 1,
   .nthreads        = 1,
   .thresh0         = 0,
+  .qvalues         = 0,
+  .qvalues_global  = 0,
+  .no_overlap      = 0,
+  .overlap_strand  = 0,
+  .count           = 0,
+  .count_strand    = 0,
+  .binary          = 0,
+  .enrich          = 0,
+  .track_int       = 0,
+  .occupancy       = 0,
+  .auto_plan       = 0,
+  .resume          = 0,
+  .merge           = 0,
+  .numa            = 0,
   .progress        = 0,
   .v               = 0,
   .w               = 0
 };
 
+LIB_LOCAL args_t args;
+
+/* Q-values are calculated from the number of hits found for each possible score
+ * above the threshold. Since P-values are a function of the integer scores,
+ * this gives exact ranks without ever having to sort (or even keep) the hits.
+ */
+typedef struct score_bin_t {
+  size_t    count;
+  double    pvalue;
+  double    qvalue;
+} score_bin_t;
+
 typedef struct motif_t {
   int       pwm[MAX_MOTIF_SIZE];         /* Slight perf boost by putting the pwms first */
   int       pwm_rc[MAX_MOTIF_SIZE];
+  int       max_suffix[MAX_MOTIF_SIZE / 5 + 1];      /* Best possible score from */
+  int       max_suffix_rc[MAX_MOTIF_SIZE / 5 + 1];   /* each position onwards    */
   double   *cdf;
   int       threshold;
   size_t    size;
@@ -309,9 +586,13 @@ typedef struct motif_t {
   int       cdf_offset;
   char      name[MAX_NAME_SIZE];
   double   *tmp_pdf;
+  size_t    index;
+  score_bin_t *bins;                     /* Only used for Q-values */
+  int       anchor;                      /* Only used for --anchor */
+  int       bounded;                     /* Only used for --auto */
 } motif_t;
 
-motif_t **motifs;
+LIB_LOCAL motif_t **motifs;
 
 typedef struct motif_info_t {
   int     is_consensus : 1;
@@ -320,45 +601,74 @@ typedef struct motif_info_t {
   size_t  n_alloc;
 } motif_info_t;
 
-motif_info_t motif_info = {
+LIB_LOCAL motif_info_t motif_info = {
   .is_consensus = 0,
   .fmt          = 0,
   .n            = 0,
   .n_alloc      = 0
 };
 
-size_t   *cdf_real_size;
-double  **cdf;
-double  **tmp_pdf;
+#ifdef MINIMOTIF_LIB
+
+/* In the library, errors jump back to the API function which was called
+ * (see the end of this file) rather than exiting, and nothing is printed to
+ * stderr: the message is kept in lib_error for mm_error().
+ */
+__thread char    lib_error[1024];
+__thread char    lib_error_note[1024];
+__thread jmp_buf lib_jmp;
+
+#endif
+
+/* Functions which return 1 on failure say why with note_error(), and leave
+ * their caller to badexit(""). The CLI prints the message right away, while
+ * the library collects it for badexit().
+ */
+__attribute__((format(printf, 1, 2)))
+void note_error(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+#ifdef MINIMOTIF_LIB
+  const size_t used = strlen(lib_error_note);
+  vsnprintf(lib_error_note + used, sizeof(lib_error_note) - used, fmt, ap);
+#else
+  vfprintf(stderr, fmt, ap);
+#endif
+  va_end(ap);
+}
+
+LIB_LOCAL size_t   *cdf_real_size;
+LIB_LOCAL double  **cdf;
+LIB_LOCAL double  **tmp_pdf;
 
 int alloc_cdf(void) {
   cdf_real_size = malloc(sizeof(size_t) * args.nthreads);
   if (cdf_real_size == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for real CDF sizes.");
+    note_error("Error: Failed to allocate memory for real CDF sizes.");
     return 1;
   }
   for (size_t i = 0; i < args.nthreads; i++) {
     cdf_real_size[i] = 1;
   }
-  cdf = malloc(sizeof(double *) * args.nthreads);
+  cdf = calloc(args.nthreads, sizeof(double *));
   if (cdf == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for CDFs.");
+    note_error("Error: Failed to allocate memory for CDFs.");
     return 1;
   }
-  tmp_pdf = malloc(sizeof(double *) * args.nthreads);
+  tmp_pdf = calloc(args.nthreads, sizeof(double *));
   if (tmp_pdf == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for temporary PDFs.");
+    note_error("Error: Failed to allocate memory for temporary PDFs.");
     return 1;
   }
   for (size_t i = 0; i < args.nthreads; i++) {
     cdf[i] = malloc(sizeof(double));
     if (cdf[i] == NULL) {
-      fprintf(stderr, "Error: Failed to allocate memory for CDF (#%zu).", i);
+      note_error("Error: Failed to allocate memory for CDF (#%zu).", i);
       return 1;
     }
     tmp_pdf[i] = malloc(sizeof(double));
     if (tmp_pdf[i] == NULL) {
-      fprintf(stderr, "Error: Failed to allocate memory for temporary PDF (#%zu).", i);
+      note_error("Error: Failed to allocate memory for temporary PDF (#%zu).", i);
       return 1;
     }
   }
@@ -368,22 +678,26 @@ int alloc_cdf(void) {
 typedef struct seq_info_t {
   size_t     n_alloc;
   size_t     n;
+  size_t     n_target;                   /* With -B, the rest are background */
   size_t     total_bases;
   size_t     unknowns;
   double     gc_pct;
+  uint64_t   hash;                       /* Of the contents, see add_seq_hash() */
 } seq_info_t;
 
-seq_info_t seq_info = {
+LIB_LOCAL seq_info_t seq_info = {
   .n_alloc = 0,
   .n = 0,
+  .n_target = 0,
   .total_bases = 0,
   .unknowns = 0,
-  .gc_pct = 0.0
+  .gc_pct = 0.0,
+  .hash = 0
 };
 
-char            **seq_names;
-unsigned char   **seqs;
-size_t           *seq_sizes;
+LIB_LOCAL char            **seq_names;
+LIB_LOCAL unsigned char   **seqs;
+LIB_LOCAL size_t           *seq_sizes;
 
 void free_seqs(void) {
   for (size_t i = 0; i < seq_info.n; i++) {
@@ -397,19 +711,24 @@ void free_seqs(void) {
 
 void free_motifs(void) {
   for (size_t i = 0; i < motif_info.n; i++) {
+    free(motifs[i]->bins);
     free(motifs[i]);
   }
   free(motifs);
 }
 
+/* Also cleans up after a failed or partial alloc_cdf(). */
 void free_cdf(void) {
   for (size_t i = 0; i < args.nthreads; i++) {
-    free(cdf[i]);
-    free(tmp_pdf[i]);
+    if (cdf != NULL) free(cdf[i]);
+    if (tmp_pdf != NULL) free(tmp_pdf[i]);
   }
   free(cdf);
   free(tmp_pdf);
   free(cdf_real_size);
+  cdf = NULL;
+  tmp_pdf = NULL;
+  cdf_real_size = NULL;
 }
 
 pthread_t         *threads;
@@ -419,22 +738,54 @@ size_t             pb_counter = 0;
 typedef struct files_t {
   int       m_open : 1;
   int       s_open : 1;
+  int       b_open : 1;
+  int       v_open : 1;
   int       o_open : 1;
+  int       q_open : 1;
+  int       c_open : 1;
   FILE     *m;
   gzFile    s;
+  gzFile    b;
+  gzFile    v;
   FILE     *o;
+  FILE     *q;                           /* Spilled hits for Q-values */
+  FILE     *c;                           /* --checkpoint */
 } files_t;
 
-files_t files = {
+LIB_LOCAL files_t files = {
   .m_open = 0,
   .s_open = 0,
-  .o_open = 0
+  .b_open = 0,
+  .v_open = 0,
+  .o_open = 0,
+  .q_open = 0,
+  .c_open = 0
 };
 
 void close_files(void) {
   if (files.m_open) fclose(files.m);
   if (files.s_open) gzclose(files.s);
+  if (files.b_open) gzclose(files.b);
+  if (files.v_open) gzclose(files.v);
   if (files.o_open) fclose(files.o);
+  if (files.q_open) fclose(files.q);
+  if (files.c_open) fclose(files.c);
+}
+
+/* Temporary files are unlinked immediately, so they disappear on exit no
+ * matter how minimotif terminates. Uses $TMPDIR if set.
+ */
+FILE *open_tmp_file(void) {
+  char path[4096];
+  const char *tmp_dir = getenv("TMPDIR");
+  if (tmp_dir == NULL || tmp_dir[0] == '\0') tmp_dir = "/tmp";
+  snprintf(path, sizeof(path), "%s/minimotif.XXXXXX", tmp_dir);
+  int fd = mkstemp(path);
+  if (fd == -1) return NULL;
+  unlink(path);
+  FILE *tmp = fdopen(fd, "w+b");
+  if (tmp == NULL) close(fd);
+  return tmp;
 }
 
 void init_motif(motif_t *motif) {
@@ -455,6 +806,10 @@ void init_motif(motif_t *motif) {
   motif->min_score = 0;
   motif->cdf_max = 0;
   motif->thread = 0;
+  motif->index = 0;
+  motif->bins = NULL;
+  motif->anchor = 0;
+  motif->bounded = 0;
   for (size_t i = 0; i < MAX_MOTIF_SIZE; i++) {
     motif->pwm[i] = 0;
     motif->pwm_rc[i] = 0;
@@ -486,6 +841,11 @@ static inline int get_score_rc(const motif_t *motif, const unsigned char let, co
 }
 
 void badexit(const char *msg) {
+#ifdef MINIMOTIF_LIB
+  snprintf(lib_error, sizeof(lib_error), "%s", msg[0] ? msg : lib_error_note);
+  lib_error_note[0] = '\0';
+  longjmp(lib_jmp, 1);
+#endif
   fprintf(stderr, "%s\nRun minimotif -h to see usage.\n", msg);
   free(threads);
   free_motifs();
@@ -494,6 +854,16 @@ void badexit(const char *msg) {
   exit(EXIT_FAILURE);
 }
 
+__attribute__((format(printf, 1, 2)))
+void badexitf(const char *fmt, ...) {
+  char msg[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  badexit(msg);
+}
+
 /* For the motif half of minimotif, this function is (by far) where it spends
  * most of its time.
  */
@@ -509,12 +879,10 @@ void fill_cdf(motif_t *motif) {
   }
   if (motif->cdf_size > MAX_CDF_SIZE) {
     if (args.w&& args.nthreads == 1 && !args.progress) fprintf(stderr, "\n");
-    fprintf(stderr,
-        "Internal error: Requested CDF size for [%s] is too large (%'zu>%'zu).\n",
-        motif->name, motif->cdf_size, MAX_CDF_SIZE);
-    fprintf(stderr, "    Make sure no background values are below %f.",
-        MIN_BKG_VALUE);
-    badexit("");
+    badexitf(
+        "Internal error: Requested CDF size for [%s] is too large (%'zu>%'zu).\n"
+        "    Make sure no background values are below %f.",
+        motif->name, motif->cdf_size, MAX_CDF_SIZE, MIN_BKG_VALUE);
   }
   /* Instead of allocating and freeing a CDF for every motif, share a
    * single one for all motifs -- just reset it every time and realloc to a
@@ -612,7 +980,7 @@ void set_threshold(motif_t *motif) {
 
 int check_and_load_bkg(double *bkg) {
   if (bkg[0] == -1.0 || bkg[1] == -1.0 || bkg[2] == -1.0 || bkg[3] == -1.0) {
-    fprintf(stderr, "Error: Too few background values found (need 4)."); return 1;
+    note_error("Error: Too few background values found (need 4)."); return 1;
   }
   double min = 0; VEC_MIN(bkg, min, 4);
   if (min < MIN_BKG_VALUE) {
@@ -728,6 +1096,7 @@ int detect_motif_fmt(void) {
         if (line[0] == 'A'|| 
             check_char_is_one_of('[', line) ||
             check_char_is_one_of(']', line)) {
+          free(line);
           badexit("Error: Detected malformed JASPAR format.");
         }
         if (has_tabs) {
@@ -736,6 +1105,7 @@ int detect_motif_fmt(void) {
           break;
         } else {
           if (check_char_is_one_of('-', line)) {
+            free(line);
             badexit("Error: minimotif cannot read HOCOMOCO PWMs.");
           }
           file_fmt = FMT_HOCOMOCO;
@@ -763,7 +1133,7 @@ int add_motif(void) {
     motif_t **tmp_ptr = realloc(motifs,
       sizeof(*motifs) * motif_info.n_alloc + sizeof(*motifs) * ALLOC_CHUNK_SIZE);
     if (tmp_ptr == NULL) {
-      fprintf(stderr, "Error: Failed to allocate memory for motifs.");
+      note_error("Error: Failed to allocate memory for motifs.");
       return 1;
     } else {
       motifs = tmp_ptr;
@@ -772,10 +1142,11 @@ int add_motif(void) {
   }
   motifs[last_i] = malloc(sizeof(motif_t));
   if (motifs[last_i] == NULL) {
-    fprintf(stderr, "Error: Failed to allocate memory for motif.");
+    note_error("Error: Failed to allocate memory for motif.");
     return 1;
   }
   init_motif(motifs[last_i]);
+  motifs[last_i]->index = last_i;
   return 0;
 }
 
@@ -791,7 +1162,7 @@ int normalize_probs(double *probs, const char *name) {
   double sum = probs[0] + probs[1] + probs[2] + probs[3];
   if (fabs(sum - 1.0) > 0.1) {
     if (args.w) fprintf(stderr, "\n");
-    fprintf(stderr,
+    note_error(
       "Error: Position for [%s] does not add up to 1 (sum=%.3g)",
       name, sum);
     return 1;
@@ -826,7 +1197,7 @@ int get_line_probs(const motif_t *motif, const char *line, double *probs, const
         which_i++; 
         if (which_i > n - 1) {
           if (args.w) fprintf(stderr, "\n");
-          fprintf(stderr,
+          note_error(
             "Error: Motif [%s] has too many columns (need %zu).",
             motif->name, n); return 1;
         }
@@ -843,7 +1214,7 @@ int get_line_probs(const motif_t *motif, const char *line, double *probs, const
     which_i++; 
     if (which_i > n - 1) {
       if (args.w) fprintf(stderr, "\n");
-      fprintf(stderr,
+      note_error(
         "Error: Motif [%s] has too many columns (need %zu).",
         motif->name, n); return 1;
     }
@@ -852,13 +1223,13 @@ int get_line_probs(const motif_t *motif, const char *line, double *probs, const
 
   if (which_i == -1) {
     if (args.w) fprintf(stderr, "\n");
-    fprintf(stderr, "Error: Motif [%s] has an empty row.",
+    note_error("Error: Motif [%s] has an empty row.",
       motif->name); return 1;
   }
 
   if (which_i < n - 1) {
     if (args.w) fprintf(stderr, "\n");
-    fprintf(stderr, "Error: Motif [%s] has too few columns (need %zu).",
+    note_error("Error: Motif [%s] has too few columns (need %zu).",
       motif->name, n); return 1;
   }
 
@@ -878,7 +1249,7 @@ int add_motif_ppm_column(motif_t *motif, const char *line, const size_t pos) {
 
 int check_meme_alph(const char *line, const size_t line_num) {
   if (check_line_contains(line, "ALPHABET= ACDEFGHIKLMNPQRSTVWY\0")) {
-    fprintf(stderr, "Error: Detected protein alphabet (L%zu).", line_num);
+    note_error("Error: Detected protein alphabet (L%zu).", line_num);
     return 1;
   }
   return 0;
@@ -917,22 +1288,22 @@ int get_meme_bkg(const char *line, const size_t line_num) {
   char bkg_char[MEME_BKG_MAX_SIZE];
   ERASE_ARRAY(bkg_char, MEME_BKG_MAX_SIZE);
   if (line[0] != 'A') {
-    fprintf(stderr, "Error: Expected first character of background line to be 'A' (L%zu).",
+    note_error("Error: Expected first character of background line to be 'A' (L%zu).",
       line_num); return 1;
   }
   while (line[i] != '\0' && line[i] != '\n' && line[i] != '\r') {
     if (let_i > 3) {
-      fprintf(stderr, "Error: Parsed too many background values in MEME file (L%zu).",
+      note_error("Error: Parsed too many background values in MEME file (L%zu).",
         line_num); return 1;
     }
     if (line[i] != ' ' && line[i] != '\t') {
       if (line[i] == 'C') {
         if (!empty) {
-          fprintf(stderr, "Error: Expected whitespace before 'C' character (L%zu).",
+          note_error("Error: Expected whitespace before 'C' character (L%zu).",
             line_num); return 1;
         }
         if (let_i != 0) {
-          fprintf(stderr,
+          note_error(
             "Error: Expected 'C' to be second letter in MEME background (L%zu).",
             line_num); return 1;
         }
@@ -941,11 +1312,11 @@ int get_meme_bkg(const char *line, const size_t line_num) {
         let_i = 1; j = 0;
       } else if (line[i] == 'G') {
         if (!empty) {
-          fprintf(stderr, "Error: Expected whitespace before 'C' character (L%zu).",
+          note_error("Error: Expected whitespace before 'C' character (L%zu).",
             line_num); return 1;
         }
         if (let_i != 1) {
-          fprintf(stderr,
+          note_error(
             "Error: Expected 'G' to be third letter in MEME background (L%zu).",
             line_num); return 1;
         }
@@ -954,11 +1325,11 @@ int get_meme_bkg(const char *line, const size_t line_num) {
         let_i = 2; j = 0;
       } else if (line[i] == 'T' || line[i] == 'U') {
         if (!empty) {
-          fprintf(stderr, "Error: Expected whitespace before 'C' character (L%zu).",
+          note_error("Error: Expected whitespace before 'C' character (L%zu).",
             line_num); return 1;
         }
         if (let_i != 2) {
-          fprintf(stderr,
+          note_error(
             "Error: Expected 'T/U' to be fourth letter in MEME background (L%zu).",
             line_num); return 1;
         }
@@ -969,7 +1340,7 @@ int get_meme_bkg(const char *line, const size_t line_num) {
         bkg_char[j] = line[i]; 
         j++;
       } else {
-        fprintf(stderr,
+        note_error(
           "Error: Encountered unexpected character (%c) in MEME background (L%zu).",
           line[i], line_num); return 1;
       }
@@ -1019,15 +1390,14 @@ void read_meme(void) {
     if (check_line_contains(line, "Background letter frequencies\0")) {
       if (bkg_let_freqs_L) {
         free(line);
-        fprintf(stderr,
+        note_error(
           "Error: Detected multiple background definition lines in MEME file (L%zu).",
           line_num);
       } else {
         if (motif_i < -1) {
           free(line);
-          fprintf(stderr, "Error: Found background definition line after motifs (L%zu).",
+          badexitf("Error: Found background definition line after motifs (L%zu).",
             line_num);
-          badexit("");
         }
         bkg_let_freqs_L = line_num;
       }
@@ -1039,16 +1409,14 @@ void read_meme(void) {
     } else if (check_line_contains(line, "ALPHABET\0")) {
       if (alph_detected) {
         free(line);
-        fprintf(stderr,
+        badexitf(
           "Error: Detected multiple alphabet definition lines in MEME file (L%zu).",
           line_num);
-        badexit("");
       }
       if (motif_i < -1) {
         free(line);
-        fprintf(stderr, "Error: Found alphabet definition line after motifs (L%zu).",
+        badexitf("Error: Found alphabet definition line after motifs (L%zu).",
           line_num);
-        badexit("");
       }
       if (check_meme_alph(line, line_num)) {
         free(line);
@@ -1058,16 +1426,14 @@ void read_meme(void) {
     } else if (check_line_contains(line, "strands:\0")) {
       if (strand_detected) {
         free(line);
-        fprintf(stderr,
+        badexitf(
           "Error: Detected multiple strand information lines in MEME file (L%zu).",
           line_num);
-        badexit("");
       }
       if (motif_i < -1) {
         free(line);
-        fprintf(stderr, "Error: Found strand information line after motifs (L%zu).",
+        badexitf("Error: Found strand information line after motifs (L%zu).",
           line_num);
-        badexit("");
       }
       if (check_meme_strand(line, line_num)) {
         free(line);
@@ -1089,9 +1455,8 @@ void read_meme(void) {
     } else if (check_line_contains(line, "letter-probability matrix\0")) {
       if (pos_i != 0) {
         free(line);
-        fprintf(stderr, "Error: Possible malformed MEME motif (L%zu).",
+        badexitf("Error: Possible malformed MEME motif (L%zu).",
           line_num);
-        badexit("");
       }
       l_p_m_L = line_num;
       live_motif = 1;
@@ -1104,9 +1469,8 @@ void read_meme(void) {
 
         if (pos_i >= MAX_MOTIF_SIZE / 5 && pos_i < -1) {
           free(line);
-          fprintf(stderr, "Error: Motif [%s] is too large (max=%zu)",
+          badexitf("Error: Motif [%s] is too large (max=%zu)",
             motifs[motif_i]->name, MAX_MOTIF_SIZE / 5);
-          badexit("");
         }
         if (add_motif_ppm_column(motifs[motif_i], line, pos_i)) {
           free(line);
@@ -1189,7 +1553,7 @@ void read_homer(void) {
       pos_i = 0;
     } else if (count_nonempty_chars(line) && ready_to_start) {
       if (pos_i > MAX_MOTIF_SIZE / 5 && pos_i < -1) {
-        fprintf(stderr, "Error: Motif [%s] is too large (max=%'zu).\n",
+        note_error("Error: Motif [%s] is too large (max=%'zu).\n",
           motifs[motif_i]->name, MAX_MOTIF_SIZE / 5);
       }
       if (add_motif_ppm_column(motifs[motif_i], line, pos_i)) {
@@ -1249,12 +1613,28 @@ void trim_motif_name(motif_t *motif) {
   }
 }
 
+void fill_max_suffix(motif_t *motif) {
+  motif->max_suffix[motif->size] = 0;
+  motif->max_suffix_rc[motif->size] = 0;
+  for (size_t pos = motif->size - 1; pos < motif->size; pos--) {
+    int max_pos = get_score_i(motif, 0, pos);
+    int max_pos_rc = motif->pwm_rc[pos * 5];
+    for (int let = 1; let < 4; let++) {
+      max_pos = MAX(max_pos, get_score_i(motif, let, pos));
+      max_pos_rc = MAX(max_pos_rc, motif->pwm_rc[let + pos * 5]);
+    }
+    motif->max_suffix[pos] = motif->max_suffix[pos + 1] + max_pos;
+    motif->max_suffix_rc[pos] = motif->max_suffix_rc[pos + 1] + max_pos_rc;
+  }
+}
+
 void complete_motifs(void) {
   for (size_t i = 0; i < motif_info.n; i++) {
     motifs[i]->min = get_pwm_min(motifs[i]);
     motifs[i]->max = get_pwm_max(motifs[i]);
     motifs[i]->cdf_offset = motifs[i]->min * motifs[i]->size;
     fill_pwm_rc(motifs[i]);
+    fill_max_suffix(motifs[i]);
     motifs[i]->cdf_max = motifs[i]->max - motifs[i]->min;
     motifs[i]->cdf_size = motifs[i]->size * motifs[i]->cdf_max + 1;
     if (args.trim_names) trim_motif_name(motifs[i]);
@@ -1345,11 +1725,11 @@ int add_jaspar_row(motif_t *motif, const char *line) {
     i++;
   }
   if (row_i == -1) {
-    fprintf(stderr, "Error: Couldn't find ACGTU in motif [%s] row names.", motif->name);
+    note_error("Error: Couldn't find ACGTU in motif [%s] row names.", motif->name);
     return 1;
   }
   if (left_bracket == -1 || right_bracket == -1) {
-    fprintf(stderr, "Error: Couldn't find '[]' in motif [%s] row (%zu).",
+    note_error("Error: Couldn't find '[]' in motif [%s] row (%zu).",
         motif->name, row_i + 1);
     return 1;
   }
@@ -1370,7 +1750,7 @@ int add_jaspar_row(motif_t *motif, const char *line) {
       if (!prev_line_was_space) {
         pos_i++;
         if (pos_i + 1 > MAX_MOTIF_SIZE && pos_i < -1) {
-          fprintf(stderr, "Error: Motif [%s] has too many columns (need %zu).",
+          note_error("Error: Motif [%s] has too many columns (need %zu).",
             motif->name, MAX_MOTIF_SIZE); return 1;
         }
         set_score(motif, let, pos_i, atoi(prob_c));
@@ -1383,18 +1763,18 @@ int add_jaspar_row(motif_t *motif, const char *line) {
   if (!prev_line_was_space) {
     pos_i++;
     if (pos_i > MAX_NAME_SIZE && pos_i < -1) {
-      fprintf(stderr, "Error: Motif [%s] has too many columns (need %zu).",
+      note_error("Error: Motif [%s] has too many columns (need %zu).",
         motif->name, MAX_MOTIF_SIZE); return 1;
     }
     set_score(motif, let, pos_i, atoi(prob_c));
   }
   if (pos_i == -1) {
-    fprintf(stderr, "Error: Motif [%s] has an empty row.", motif->name); return 1;
+    note_error("Error: Motif [%s] has an empty row.", motif->name); return 1;
   }
   pos_i++;
   if (motif->size) {
     if (motif->size != pos_i) {
-      fprintf(stderr, "Error: Motif [%s] has rows with differing numbers of counts.",
+      note_error("Error: Motif [%s] has rows with differing numbers of counts.",
         motif->name); return 1;
     }
   } else {
@@ -1414,8 +1794,7 @@ void pcm_to_pwm(motif_t *motif) {
       nsites2 += get_score_i(motif, i, j);
     }
     if (abs(nsites2 - nsites) > 1) {
-      fprintf(stderr, "Error: Column sums for motif [%s] are not equal.", motif->name);
-      badexit("");
+      badexitf("Error: Column sums for motif [%s] are not equal.", motif->name);
     } else if (abs(nsites2 - nsites) == 1 && args.w) {
       fprintf(stderr, "Warning: Found difference of 1 between column sums for motif [%s].",
         motif->name);
@@ -1447,14 +1826,10 @@ void read_jaspar(void) {
         fprintf(stderr, "%zu)\n", motifs[motif_i]->size);
       }
       if (motif_i < -1 && row_i != 4) {
-        if (row_i < 4) {
-          if (args.w) fprintf(stderr, "\n");
-          fprintf(stderr, "Error: Motif [%s] has too few rows", motifs[motif_i]->name);
-        } else {
-          if (args.w) fprintf(stderr, "\n");
-          fprintf(stderr, "Error: Motif [%s] has too many rows", motifs[motif_i]->name);
-        }
-        badexit("");
+        if (args.w) fprintf(stderr, "\n");
+        free(line);
+        badexitf("Error: Motif [%s] has too %s rows", motifs[motif_i]->name,
+          row_i < 4 ? "few" : "many");
       }
       motif_i++;
       if (add_motif()) {
@@ -1474,14 +1849,9 @@ void read_jaspar(void) {
   }
   free(line);
   if (motif_i < -1 && row_i != 4) {
-    if (row_i < 4) {
-      if (args.w) fprintf(stderr, "\n");
-      fprintf(stderr, "Error: Motif [%s] has too few rows", motifs[motif_i]->name);
-    } else {
-      if (args.w) fprintf(stderr, "\n");
-      fprintf(stderr, "Error: Motif [%s] has too many rows", motifs[motif_i]->name);
-    }
-    badexit("");
+    if (args.w) fprintf(stderr, "\n");
+    badexitf("Error: Motif [%s] has too %s rows", motifs[motif_i]->name,
+      row_i < 4 ? "few" : "many");
   }
   if (motif_i < -1 && args.w) fprintf(stderr, "%zu)\n", motifs[motif_i]->size);
   for (size_t i = 0; i < motif_info.n; i++) {
@@ -1497,7 +1867,7 @@ int add_motif_pcm_column(motif_t *motif, const char *line, const size_t pos) {
   if (get_line_probs(motif, line, probs, 4)) return 1;
   double pcm_sum = probs[0] + probs[1] + probs[2] + probs[3];
   if (pcm_sum < 0.99) {
-    fprintf(stderr, "Error: Motif [%s] PCM row adds up to less than 1", motif->name);
+    note_error("Error: Motif [%s] PCM row adds up to less than 1", motif->name);
     return 1;
   }
   VEC_ADD(probs, args.pseudocount / 4.0, 4);
@@ -1540,7 +1910,7 @@ void read_hocomoco(void) {
       pos_i = 0;
     } else if (count_nonempty_chars(line) && ready_to_start) {
       if (pos_i > MAX_MOTIF_SIZE / 5 && pos_i < -1) {
-        fprintf(stderr, "Error: Motif [%s] is too large (max=%'zu).\n",
+        note_error("Error: Motif [%s] is too large (max=%'zu).\n",
           motifs[motif_i]->name, MAX_MOTIF_SIZE / 5);
       }
       if (add_motif_pcm_column(motifs[motif_i], line, pos_i)) {
@@ -1583,11 +1953,34 @@ void load_motifs(void) {
   for (size_t i = 0; i < motif_info.n; i++) if (!motifs[i]->size) empty_motifs++;
   if (empty_motifs == motif_info.n) {
     badexit("Error: All parsed motifs are empty.");
-  } else if (empty_motifs) {
+  } else if (empty_motifs && !IS_LIB) {
     fprintf(stderr, "Warning: Found %'zu empty motifs.\n", empty_motifs);
   }
 }
 
+/* Much faster than fnv_add() for whole sequences. */
+static inline uint64_t hash_seq(const unsigned char *seq, const size_t size) {
+  uint64_t hash = 0x9E3779B97F4A7C15ULL ^ size, word;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    memcpy(&word, seq + i, 8);
+    hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 32;
+  }
+  word = 0;
+  memcpy(&word, seq + i, size - i);
+  hash = (hash ^ word) * 0xC4CEB9FE1A85EC53ULL;
+  hash ^= hash >> 29;
+  return hash ? hash : 1;
+}
+
+/* Combined in file order, so that --checkpoint and --shard can tell when the
+ * sequences themselves changed.
+ */
+static inline void add_seq_hash(const unsigned char *seq, const size_t size) {
+  seq_info.hash = (seq_info.hash ^ hash_seq(seq, size)) * 1099511628211ULL;
+}
+
 void count_bases(void) {
   for (size_t i = 0; i < seq_info.n; i++) {
     for (size_t j = 0; j < seq_sizes[i]; j++) {
@@ -1622,18 +2015,14 @@ void add_seq_name(char *name, kseq_t *kseq) {
   }
   if (args.trim_names || !kseq->comment.l) {
     if (kseq->name.l > SEQ_NAME_MAX_CHAR) {
-      kseq_destroy(kseq);
-      fprintf(stderr, "Error: Sequence name is too large (%zu>%zu).",
+      badexitf("Error: Sequence name is too large (%zu>%zu).",
         kseq->name.l, SEQ_NAME_MAX_CHAR);
-      badexit("");
     }
     name[kseq->name.l] = '\0';
   } else if (kseq->comment.l) {
     if (kseq->name.l + kseq->comment.l + 1 > SEQ_NAME_MAX_CHAR) {
-      kseq_destroy(kseq);
-      fprintf(stderr, "Error: Sequence name is too large (%zu>%zu).",
+      badexitf("Error: Sequence name is too large (%zu>%zu).",
         kseq->name.l + kseq->comment.l + 1, SEQ_NAME_MAX_CHAR);
-      badexit("");
     }
     name[kseq->name.l] = ' ';
     for (size_t j = 0, i = kseq->name.l + 1; i < kseq->name.l + kseq->comment.l + 1; i++, j++) {
@@ -1680,6 +2069,7 @@ size_t peak_through_seqs(kseq_t *kseq) {
     for (size_t i = 0; i < kseq->seq.l; i++) {
       char_counts[seq_tmp[i]]++;
     }
+    add_seq_hash(seq_tmp, kseq->seq.l);
   }
   if (ret_val == -2) {
     kseq_destroy(kseq);
@@ -1772,6 +2162,7 @@ void load_seqs(kseq_t *kseq) {
     seqs[seq_info.n - 1] = (unsigned char *) kseq->seq.s;
     kseq->seq.s = NULL;
     seq_sizes[seq_info.n - 1] = kseq->seq.l;
+    add_seq_hash(seqs[seq_info.n - 1], kseq->seq.l);
     seq_names[seq_info.n - 1] = malloc(sizeof(char) * kseq->name.l + sizeof(char) * kseq->comment.l + 2);
     name_sizes += kseq->name.l + kseq->comment.l + 2;
     if (seq_names[seq_info.n - 1] == NULL) {
@@ -1902,29 +2293,28 @@ void find_motif_dupes(void) {
         if (is_dup[i]) {
           int success = dedup_char_array(motifs[i]->name, MAX_NAME_SIZE, i + 1);
           if (!success) {
-            fprintf(stderr,
-              "Error: Failed to deduplicate motif #%zu, name is too large.", i + 1);
             free(is_dup);
-            badexit("");
+            badexitf(
+              "Error: Failed to deduplicate motif #%zu, name is too large.", i + 1);
           }
         }
       }
     } else {
-      fprintf(stderr,
+      note_error(
         "Error: Encountered duplicate motif name (use -d to deduplicate).");
       size_t to_print = 5;
       if (to_print > dup_count) to_print = dup_count;
       for (size_t i = 0; i < motif_info.n; i++) {
         if (is_dup[i]) {
-          fprintf(stderr, "\n    L%zu #%zu: %s", motifs[i]->file_line_num, i + 1,
+          note_error("\n    L%zu #%zu: %s", motifs[i]->file_line_num, i + 1,
             motifs[i]->name);
           to_print--;
           if (!to_print) break;
         }
       }
       if (dup_count > 5) {
-        fprintf(stderr, "\n    ...");
-        fprintf(stderr, "\n    Found %'zu total non-unique names.", dup_count);
+        note_error("\n    ...");
+        note_error("\n    Found %'zu total non-unique names.", dup_count);
       }
       free(is_dup);
       badexit("");
@@ -1954,28 +2344,27 @@ void find_seq_dupes(void) {
         if (is_dup[i]) {
           int success = dedup_char_array(seq_names[i], SEQ_NAME_MAX_CHAR, i + 1);
           if (!success) {
-            fprintf(stderr,
-              "Error: Failed to deduplicate sequence #%zu, name is too large.", i + 1);
             free(is_dup);
-            badexit("");
+            badexitf(
+              "Error: Failed to deduplicate sequence #%zu, name is too large.", i + 1);
           }
         }
       }
     } else {
-      fprintf(stderr,
+      note_error(
         "Error: Encountered duplicate sequence name (use -d to deduplicate).");
       size_t to_print = 5;
       if (to_print > dup_count) to_print = dup_count;
       for (size_t i = 0; i < seq_info.n; i++) {
         if (is_dup[i]) {
-          fprintf(stderr, "\n    #%zu: %s", i + 1, seq_names[i]);
+          note_error("\n    #%zu: %s", i + 1, seq_names[i]);
           to_print--;
           if (!to_print) break;
         }
       }
       if (dup_count > 5) {
-        fprintf(stderr, "\n    ...");
-        fprintf(stderr, "\n    Found %'zu total non-unique names.", dup_count);
+        note_error("\n    ...");
+        note_error("\n    Found %'zu total non-unique names.", dup_count);
       }
       free(is_dup);
       badexit("");
@@ -1999,177 +2388,5028 @@ static inline void score_subseq_rc(const motif_t *motif, const unsigned char *se
   }
 }
 
-void score_seq(const motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+static inline void print_hit(FILE *whereto, const motif_t *motif, const char *seq_name, const size_t start, const char strand, const int score, const double pvalue, const unsigned char *match) {
+  fprintf(whereto, "%s\t%zu\t%zu\t%c\t%s\t%.9g\t%.3f\t%.1f\t%.*s\n",
+    seq_name,
+    start + 1,
+    start + motif->size,
+    strand,
+    motif->name,
+    pvalue,
+    score / PWM_INT_MULTIPLIER,
+    100.0 * score / motif->max_score,
+    (int) motif->size,
+    match);
+}
+
+static inline void print_hit_q(const motif_t *motif, const char *seq_name, const size_t start, const char strand, const int score, const double pvalue, const double qvalue, const unsigned char *match) {
+  fprintf(files.o, "%s\t%zu\t%zu\t%c\t%s\t%.9g\t%.3f\t%.1f\t%.*s\t%.9g\n",
+    seq_name,
+    start + 1,
+    start + motif->size,
+    strand,
+    motif->name,
+    pvalue,
+    score / PWM_INT_MULTIPLIER,
+    100.0 * score / motif->max_score,
+    (int) motif->size,
+    match,
+    qvalue);
+}
+
+/* When calculating Q-values, hits are first written to a temporary file in
+ * this form (followed by the match itself) and only printed once all motifs
+ * have been scanned. Records are written with a single fwrite call so that
+ * threads can safely share the same file.
+ */
+typedef struct spill_hit_t {
+  size_t          start;
+  unsigned int    seq_i;
+  unsigned int    motif_i;
+  int             score;
+  char            strand;
+} spill_hit_t;
+
+static inline void spill_hit(motif_t *motif, const size_t seq_i, const unsigned char *seq, const size_t start, const int score, const char strand) {
+  unsigned char record[sizeof(spill_hit_t) + MAX_MOTIF_SIZE / 5];
+  spill_hit_t hit = {
+    .start   = start,
+    .seq_i   = seq_i,
+    .motif_i = motif->index,
+    .score   = score,
+    .strand  = strand
+  };
+  memcpy(record, &hit, sizeof(spill_hit_t));
+  memcpy(record + sizeof(spill_hit_t), seq + start, motif->size);
+  fwrite(record, sizeof(spill_hit_t) + motif->size, 1, files.q);
+  motif->bins[score - motif->threshold].count++;
+}
+
+/* Minimal writer for NumPy .npy headers (format version 1.0), so binary
+ * output can be loaded with numpy.load() or memory-mapped as is.
+ */
+int write_npy_header(FILE *whereto, const char *dtype, const size_t *shape, const size_t ndim) {
+  char header[256];
+  const char endian = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? '<' : '>';
+  int len = snprintf(header, sizeof(header),
+    "{'descr': '%c%s', 'fortran_order': False, 'shape': (", endian, dtype);
+  for (size_t i = 0; i < ndim; i++) {
+    len += snprintf(header + len, sizeof(header) - len, "%zu,%s", shape[i],
+      i < ndim - 1 ? " " : "");
+  }
+  len += snprintf(header + len, sizeof(header) - len, "), }");
+  while ((10 + len + 1) % 64) header[len++] = ' ';
+  header[len++] = '\n';
+  const unsigned char preamble[] = {
+    0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0, len & 0xFF, (len >> 8) & 0xFF
+  };
+  if (fwrite(preamble, sizeof(preamble), 1, whereto) != 1) return 1;
+  if (fwrite(header, len, 1, whereto) != 1) return 1;
+  return 0;
+}
+
+/* For --count, a dense sequence x motif matrix (with two columns per motif if
+ * splitting by strand). Each motif is only ever scanned by a single thread, so
+ * all threads can share the one matrix without needing to merge anything.
+ */
+unsigned int *hit_counts;
+
+static inline size_t hit_count_cols(void) {
+  return args.count_strand ? motif_info.n * 2 : motif_info.n;
+}
+
+int alloc_hit_counts(void) {
+  hit_counts = calloc(seq_info.n * hit_count_cols(), sizeof(unsigned int));
+  if (hit_counts == NULL) {
+    note_error("Error: Failed to allocate memory for hit counts (%'.2f MB).",
+      b2mb(sizeof(unsigned int) * seq_info.n * hit_count_cols()));
+    return 1;
+  }
+  return 0;
+}
+
+static inline void count_hit(const motif_t *motif, const size_t seq_i, const char strand) {
+  size_t col = motif->index;
+  if (args.count_strand) col = col * 2 + (strand == '-');
+  hit_counts[seq_i * hit_count_cols() + col]++;
+}
+
+void print_hit_counts(void) {
+  const size_t n_cols = hit_count_cols();
+  if (args.binary) {
+    const size_t shape[] = { seq_info.n, n_cols };
+    if (write_npy_header(files.o, "u4", shape, 2) ||
+        fwrite(hit_counts, sizeof(unsigned int), seq_info.n * n_cols, files.o) !=
+          seq_info.n * n_cols) {
+      badexit("Error: Failed to write hit counts.");
+    }
+    return;
+  }
+  fprintf(files.o, "##seqname");
+  for (size_t i = 0; i < motif_info.n; i++) {
+    if (args.count_strand) {
+      fprintf(files.o, "\t%s:+\t%s:-", motifs[i]->name, motifs[i]->name);
+    } else {
+      fprintf(files.o, "\t%s", motifs[i]->name);
+    }
+  }
+  fprintf(files.o, "\n");
+  for (size_t i = 0; i < seq_info.n; i++) {
+    fprintf(files.o, "%s", seq_names[i]);
+    for (size_t j = 0; j < n_cols; j++) {
+      fprintf(files.o, "\t%u", hit_counts[i * n_cols + j]);
+    }
+    fprintf(files.o, "\n");
+  }
+}
+
+/* Scores are fixed-point log2 odds, so 2^score can be looked up one
+ * fraction at a time and shifted into place by the integer part.
+ */
+#define ODDS_LUT_SIZE            ((int) PWM_INT_MULTIPLIER)
+
+double odds_lut[ODDS_LUT_SIZE];
+
+void fill_odds_lut(void) {
+  for (int i = 0; i < ODDS_LUT_SIZE; i++) {
+    odds_lut[i] = exp2(i / PWM_INT_MULTIPLIER);
+  }
+}
+
+static inline double score2odds(const int score) {
+  int whole = score / ODDS_LUT_SIZE, frac = score % ODDS_LUT_SIZE;
+  if (frac < 0) {
+    frac += ODDS_LUT_SIZE;
+    whole--;
+  }
+  return ldexp(odds_lut[frac], whole);
+}
+
+/* For --occupancy, a dense sequence x motif matrix like --count. */
+double *occupancy;
+
+int alloc_occupancy(void) {
+  occupancy = calloc(seq_info.n * motif_info.n, sizeof(double));
+  if (occupancy == NULL) {
+    note_error("Error: Failed to allocate memory for occupancy (%'.2f MB).",
+      b2mb(sizeof(double) * seq_info.n * motif_info.n));
+    return 1;
+  }
+  return 0;
+}
+
+void print_occupancy(void) {
+  if (args.binary) {
+    const size_t shape[] = { seq_info.n, motif_info.n };
+    if (write_npy_header(files.o, "f8", shape, 2) ||
+        fwrite(occupancy, sizeof(double), seq_info.n * motif_info.n, files.o) !=
+          seq_info.n * motif_info.n) {
+      badexit("Error: Failed to write occupancy.");
+    }
+    return;
+  }
+  fprintf(files.o, "##seqname");
+  for (size_t i = 0; i < motif_info.n; i++) {
+    fprintf(files.o, "\t%s", motifs[i]->name);
+  }
+  fprintf(files.o, "\n");
+  for (size_t i = 0; i < seq_info.n; i++) {
+    fprintf(files.o, "%s", seq_names[i]);
+    for (size_t j = 0; j < motif_info.n; j++) {
+      fprintf(files.o, "\t%.6g", occupancy[i * motif_info.n + j]);
+    }
+    fprintf(files.o, "\n");
+  }
+}
+
+void score_seq_occupancy(const motif_t *motif, const size_t seq_i, const size_t seq_loc) {
   const unsigned char *seq = seqs[seq_loc];
-  const char *seq_name = seq_names[seq_i];
   const size_t seq_size = seq_sizes[seq_i];
-  const int mot_size = motif->size;
-  if (seq_size < motif->size || motif->threshold == INT_MAX) return;
-  const int threshold = motif->threshold - 1;
-  int score = INT_MIN, score_rc = INT_MIN;
+  if (seq_size < motif->size) return;
+  int score, score_rc;
+  double sum = 0.0;
   if (args.scan_rc) {
     for (size_t i = 0; i <= seq_size - motif->size; i++) {
       score_subseq_rc(motif, seq, i, &score, &score_rc);
-      if (__builtin_expect(score > threshold, 0)) {
-        fprintf(files.o, "%s\t%zu\t%zu\t+\t%s\t%.9g\t%.3f\t%.1f\t%.*s\n",
-          seq_name,
-          i + 1,
-          i + motif->size,
-          motif->name,
-          score2pval(motif, score),
-          score / PWM_INT_MULTIPLIER,
-          100.0 * score / motif->max_score,
-          mot_size,
-          seq + i);
-      }
-      if (__builtin_expect(score_rc > threshold, 0)) {
-        fprintf(files.o, "%s\t%zu\t%zu\t-\t%s\t%.9g\t%.3f\t%.1f\t%.*s\n",
-          seq_name,
-          i + 1,
-          i + motif->size,
-          motif->name,
-          score2pval(motif, score_rc),
-          score_rc / PWM_INT_MULTIPLIER,
-          100.0 * score_rc / motif->max_score,
-          mot_size,
-          seq + i);
-      }
+      sum += score2odds(score) + score2odds(score_rc);
     }
   } else {
     for (size_t i = 0; i <= seq_size - motif->size; i++) {
       score_subseq(motif, seq, i, &score);
-      if (__builtin_expect(score > threshold, 0)) {
-        fprintf(files.o, "%s\t%zu\t%zu\t+\t%s\t%.9g\t%.3f\t%.1f\t%.*s\n",
-          seq_name,
-          i + 1,
-          i + motif->size,
-          motif->name,
-          score2pval(motif, score),
-          score / PWM_INT_MULTIPLIER,
-          100.0 * score / motif->max_score,
-          mot_size,
-          seq + i);
-      }
+      sum += score2odds(score);
     }
   }
+  occupancy[seq_i * motif_info.n + motif->index] = sum;
 }
 
-void print_seq_stats_single(FILE *whereto, const size_t seq_i, const size_t seq_j) {
-  ERASE_ARRAY(char_counts, 256);
-  count_bases_single(seqs[seq_i], seq_sizes[seq_j]);
-  fprintf(whereto, "%zu\t%s\t", seq_j + 1, seq_names[seq_j]);
-  fprintf(whereto, "%zu\t", seq_sizes[seq_j]);
-  if (!seq_sizes[seq_j]) {
-    fprintf(whereto, "nan\t");
-  } else {
-    fprintf(whereto, "%.2f\t", calc_gc() * 100.0);
+/* For --sample, every sequence is split into blocks which are picked at
+ * random (based only on the seed, sequence and block number). Hits are
+ * counted per block, so that the total number of hits can be estimated as a
+ * ratio to the number of windows scanned, with the variance between blocks
+ * giving the confidence interval.
+ */
+typedef struct sample_stats_t {
+  size_t hits;
+  double bytes;                          /* Output size of the sampled hits */
+  double windows;
+  double est_hits;
+  double ci;
+  double cdf_time;
+  double scan_time;
+} sample_stats_t;
+
+typedef struct sample_blocks_t {
+  size_t *starts;
+  size_t  n;
+  size_t  first;                         /* Overall index of the first block */
+} sample_blocks_t;
+
+sample_blocks_t *sample_blocks;          /* Per sequence */
+size_t           n_sample_blocks;
+size_t           n_total_blocks;
+size_t         **sample_block_hits;      /* Per thread */
+size_t          *sample_block_i;         /* Per thread */
+sample_stats_t  *sample_stats;           /* Per motif */
+
+static inline void sample_hit(const motif_t *motif, const size_t seq_i, const size_t start, const int score, const char strand) {
+  sample_block_hits[motif->thread][sample_block_i[motif->thread]]++;
+  sample_stats[motif->index].bytes += snprintf(NULL, 0, "%s\t%zu\t%zu\t%c\t%s\t%.9g\t%.3f\t%.1f\t",
+    seq_names[seq_i], start + 1, start + motif->size, strand, motif->name,
+    score2pval(motif, score), score / PWM_INT_MULTIPLIER,
+    100.0 * score / motif->max_score) + motif->size + 1;
+}
+
+/* For --anchor, the hits of the anchor motifs (which are scanned first) are
+ * turned into windows, which are then sorted. A hit of the other motifs has to
+ * fit within a single window, so every motif scans the union of the starts
+ * that do, which means each base is still only scanned once.
+ */
+typedef struct region_t {
+  size_t start;
+  size_t end;                            /* Not inclusive */
+} region_t;
+
+typedef struct regions_t {
+  region_t *regions;
+  size_t    n;
+  size_t    n_alloc;
+} regions_t;
+
+regions_t      *anchor_regions;
+pthread_mutex_t anchor_lock = PTHREAD_MUTEX_INITIALIZER;
+int             scan_round = 0;
+
+static inline int in_scan_round(const motif_t *motif) {
+  return args.anchors == NULL || motif->anchor == !scan_round;
+}
+
+int set_anchors(void) {
+  char *anchors = strdup(args.anchors), *save = NULL;
+  for (char *name = strtok_r(anchors, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+    size_t i = 0;
+    while (i < motif_info.n && strcmp(motifs[i]->name, name)) i++;
+    if (i == motif_info.n) {
+      note_error("Error: Failed to find anchor motif: %s", name);
+      free(anchors);
+      return 1;
+    }
+    motifs[i]->anchor = 1;
   }
-  fprintf(whereto, "%zu\n", seq_sizes[seq_j] - standard_base_count());
+  free(anchors);
+  anchor_regions = calloc(seq_info.n, sizeof(regions_t));
+  if (anchor_regions == NULL) {
+    note_error("Error: Failed to allocate memory for anchor regions.");
+    return 1;
+  }
+  return 0;
 }
 
-void print_seq_stats(FILE *whereto) {
-  for (size_t i = 0; i < seq_info.n; i++) {
-    ERASE_ARRAY(char_counts, 256);
-    count_bases_single(seqs[i], seq_sizes[i]);
-    fprintf(whereto, "%zu\t%s\t", i + 1, seq_names[i]);
-    fprintf(whereto, "%zu\t", seq_sizes[i]);
-    if (!seq_sizes[i]) {
-      fprintf(whereto, "nan\t");
+void free_anchor_regions(void) {
+  for (size_t i = 0; i < seq_info.n; i++) free(anchor_regions[i].regions);
+  free(anchor_regions);
+}
+
+void add_anchor_region(const motif_t *motif, const size_t seq_i, const size_t start) {
+  regions_t *regions = &anchor_regions[seq_i];
+  pthread_mutex_lock(&anchor_lock);
+  if (regions->n == regions->n_alloc) {
+    regions->n_alloc += ALLOC_CHUNK_SIZE;
+    region_t *tmp = realloc(regions->regions, sizeof(region_t) * regions->n_alloc);
+    if (tmp == NULL) badexit("Error: Failed to allocate memory for anchor regions.");
+    regions->regions = tmp;
+  }
+  regions->regions[regions->n].start = start > args.anchor_window ? start - args.anchor_window : 0;
+  regions->regions[regions->n].end = MIN(start + motif->size + args.anchor_window, seq_sizes[seq_i]);
+  regions->n++;
+  pthread_mutex_unlock(&anchor_lock);
+}
+
+int cmp_regions(const void *a, const void *b) {
+  const region_t *ra = (const region_t *) a, *rb = (const region_t *) b;
+  return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+void merge_regions(regions_t *regions) {
+  if (!regions->n) return;
+  qsort(regions->regions, regions->n, sizeof(region_t), cmp_regions);
+  size_t n = 0;
+  for (size_t j = 1; j < regions->n; j++) {
+    if (regions->regions[j].start <= regions->regions[n].end) {
+      regions->regions[n].end = MAX(regions->regions[n].end, regions->regions[j].end);
     } else {
-      fprintf(whereto, "%.2f\t", calc_gc() * 100.0);
+      regions->regions[++n] = regions->regions[j];
     }
-    fprintf(whereto, "%zu\n", seq_sizes[i] - standard_base_count());
   }
+  regions->n = n + 1;
 }
 
-void add_consensus_motif(const char *consensus) {
-  if (add_motif()) badexit("");
-  ERASE_ARRAY(motifs[0]->name, MAX_NAME_SIZE);
-  size_t i = 0;
-  for (;;) {
-    motifs[0]->name[i] = consensus[i];
-    if (consensus[i] == '\0') {
-      motifs[0]->size = i;
-      break;
+void sort_anchor_regions(void) {
+  size_t covered = 0;
+  for (size_t i = 0; i < seq_info.n; i++) {
+    regions_t *regions = &anchor_regions[i];
+    qsort(regions->regions, regions->n, sizeof(region_t), cmp_regions);
+    size_t covered_to = 0;
+    for (size_t j = 0; j < regions->n; j++) {
+      const region_t *region = &regions->regions[j];
+      if (region->end <= covered_to) continue;
+      covered += region->end - MAX(region->start, covered_to);
+      covered_to = region->end;
     }
-    i++;
   }
-  motifs[0]->name[i] = '\0';
-  if (motifs[0]->size > MAX_MOTIF_SIZE / 5) {
-    fprintf(stderr, "Error: Consensus sequence is too large (%zu>max=%zu).",
-      motifs[0]->size, MAX_MOTIF_SIZE / 5);
-  }
-  size_t let_i;
-  for (size_t pos = 0; pos < motifs[0]->size; pos++) {
-    let_i = consensus2index[(unsigned char) consensus[pos]];
-    if (let_i == -1) {
-      fprintf(stderr, "Error: Encountered unknown letter in consensus (%c).",
-        consensus[pos]);
-      badexit("");
-    }
-    set_score(motifs[0], 'A', pos,
-      calc_score(consensus2probs[let_i * 4 + 0], args.bkg[0]));
-    set_score(motifs[0], 'C', pos,
-      calc_score(consensus2probs[let_i * 4 + 1], args.bkg[1]));
-    set_score(motifs[0], 'G', pos,
-      calc_score(consensus2probs[let_i * 4 + 2], args.bkg[2]));
-    set_score(motifs[0], 'T', pos,
-      calc_score(consensus2probs[let_i * 4 + 3], args.bkg[3]));
+  if (args.v) {
+    fprintf(stderr, "Anchor regions cover %'zu bases (%.2f%%).\n", covered,
+      100.0 * covered / MAX(seq_info.total_bases, 1));
   }
-  complete_motifs();
 }
 
-void print_pb(const double prog) {
-  const int left = prog * PROGRESS_BAR_WIDTH;
-  const int right = PROGRESS_BAR_WIDTH - left;
-  fprintf(stderr, "\r[%.*s%*s] %3d%%", left, PROGRESS_BAR_STRING, right, "",
-      (int) (prog * 100.0));
-  fflush(stderr);
+/* For --checkpoint, the work is split into tasks: a motif and a range of
+ * sequences. Each thread writes the hits of its current task to a temporary
+ * file, which is only appended to the output once the task is done, right
+ * before the task and the new output size are added to the checkpoint. An
+ * interrupted run can then cut the output back to the last recorded size and
+ * skip the sequences done for every motif. Tasks end with the motif, after
+ * CHECKPOINT_INTERVAL seconds, or on SIGTERM.
+ */
+#define CHECKPOINT_INTERVAL                    60    /* Seconds */
+
+FILE               **task_files;         /* Per thread */
+size_t              *task_first;         /* First sequence of the current task */
+time_t              *task_time;          /* When the current task was started  */
+regions_t           *done_tasks;         /* Per motif, in sequences */
+size_t               output_offset;
+pthread_mutex_t      checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile sig_atomic_t stop_requested;
+
+void request_stop(int sig) {
+  (void) sig;
+  stop_requested = 1;
 }
 
-void *scan_sub_process(void *thread_i) {
-  for (size_t i = 0; i < motif_info.n; i++) {
-    motif_t *motif = motifs[i];
-    if (*((int *) thread_i) == motif->thread) {
-      if (args.w && !args.progress) {
-        fprintf(stderr, "    Scanning motif: %s\n", motif->name);
-      }
-      fill_cdf(motif);
-      set_threshold(motif);
-      for (size_t j = 0; j < seq_info.n; j++) {
-        score_seq(motif, j, j);
-      }
-      if (args.progress) {
-        pthread_mutex_lock(&pb_lock);
-        pb_counter++;
-        print_pb((double) pb_counter / motif_info.n);
-        pthread_mutex_unlock(&pb_lock);
-      }
+static inline FILE *hit_file(const motif_t *motif) {
+  return task_files != NULL ? task_files[motif->thread] : files.o;
+}
+
+static inline int seq_is_done(const motif_t *motif, const size_t seq_i) {
+  if (done_tasks == NULL) return 0;
+  const regions_t *done = &done_tasks[motif->index];
+  size_t lo = 0, hi = done->n;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (done->regions[mid].end <= seq_i) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
   }
-  free(thread_i);
-  return NULL;
+  return lo < done->n && done->regions[lo].start <= seq_i;
 }
 
-int main(int argc, char **argv) {
-
-  if (setlocale(LC_NUMERIC, "en_US") == NULL && args.v) {
-    fprintf(stderr, "Warning: setlocale(LC_NUMERIC, \"en_US\") failed.\n");
+void add_region(regions_t *regions, const size_t start, const size_t end) {
+  if (regions->n == regions->n_alloc) {
+    regions->n_alloc += ALLOC_CHUNK_SIZE;
+    region_t *tmp = realloc(regions->regions, sizeof(region_t) * regions->n_alloc);
+    if (tmp == NULL) badexit("Error: Failed to allocate memory for regions.");
+    regions->regions = tmp;
   }
+  regions->regions[regions->n].start = start;
+  regions->regions[regions->n].end = end;
+  regions->n++;
+}
 
-  motifs = malloc(sizeof(*motifs) * ALLOC_CHUNK_SIZE);
-  if (motifs == NULL) {
-    badexit("Error: Failed to allocate memory for motifs.");
-  } else {
-    motif_info.n_alloc = ALLOC_CHUNK_SIZE;
+void add_done_task(const size_t motif_i, const size_t first, const size_t last) {
+  add_region(&done_tasks[motif_i], first, last);
+}
+
+/* Returns how many arguments --shard takes up at argv[i], if any. */
+int shard_arg(char **argv, const int i) {
+  if (!strcmp(argv[i], "--shard")) return 2;
+  return !strncmp(argv[i], "--shard=", 8);
+}
+
+/* Options which can change between an interrupted run and its resumption,
+ * since they don't change the output, as well as those which differ between
+ * shards. Returns how many arguments to skip.
+ */
+int skip_fingerprint_arg(char **argv, const int i, const int all_shards) {
+  const char *arg = argv[i];
+  if (all_shards) {
+    if (!strcmp(arg, "-o") || !strcmp(arg, "--checkpoint")) return 2;
+    if (!strncmp(arg, "-o", 2) || !strncmp(arg, "--checkpoint=", 13)) return 1;
+    if (shard_arg(argv, i)) return shard_arg(argv, i);
+  }
+  if (!strcmp(arg, "--resume") || !strcmp(arg, "--auto") ||
+      !strncmp(arg, "--mem=", 6)) {
+    return 1;
   }
-  seq_names = malloc(sizeof(*seq_names) * ALLOC_CHUNK_SIZE);
-  if (seq_names == NULL) {
-    badexit("Error: Failed to allocate memory for sequence names.");
+  if (!strcmp(arg, "--mem")) return 2;
+  if (!strncmp(arg, "-j", 2)) return arg[2] ? 1 : 2;
+  if (arg[0] == '-' && arg[1] && strspn(arg + 1, "vwg") == strlen(arg + 1)) {
+    return 1;
   }
-  seqs = malloc(sizeof(*seqs) * ALLOC_CHUNK_SIZE);
-  if (seqs == NULL) {
-    badexit("Error: Failed to allocate memory for sequences.");
+  return 0;
+}
+
+#define FNV_OFFSET_BASIS        14695981039346656037ULL
+
+/* FNV-1a, for small inputs. */
+static inline uint64_t fnv_add(uint64_t hash, const void *ptr, const size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash ^= ((const unsigned char *) ptr)[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* Makes sure the same motifs, sequences and options are used when resuming,
+ * or by every shard when merging.
+ */
+uint64_t run_fingerprint(const int argc, char **argv, const int all_shards) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (int i = 1; i < argc; i++) {
+    const int skip = skip_fingerprint_arg(argv, i, all_shards);
+    if (skip) {
+      i += skip - 1;
+      continue;
+    }
+    hash = fnv_add(hash, argv[i], strlen(argv[i]) + 1);
+  }
+  for (size_t i = 0; i < motif_info.n; i++) {
+    hash = fnv_add(hash, motifs[i]->name, strlen(motifs[i]->name) + 1);
+    hash = fnv_add(hash, motifs[i]->pwm, sizeof(int) * motifs[i]->size * 5);
+  }
+  for (size_t i = 0; i < seq_info.n; i++) {
+    hash = fnv_add(hash, seq_names[i], strlen(seq_names[i]) + 1);
+    hash = fnv_add(hash, &seq_sizes[i], sizeof(size_t));
+  }
+  return fnv_add(hash, &seq_info.hash, sizeof(uint64_t));
+}
+
+/* Reads the tasks done so far. A line cut short by an earlier interruption
+ * ends the checkpoint; the file is truncated there before adding to it.
+ */
+int read_checkpoint(FILE *in, const uint64_t fingerprint, long *good_end, size_t *done) {
+  char line[256];
+  unsigned long long hash;
+  size_t motif_i, first, last, offset;
+  if (fgets(line, sizeof(line), in) == NULL || line[strlen(line) - 1] != '\n' ||
+      sscanf(line, "#minimotif-checkpoint\t%llx\t%zu", &hash, &offset) != 2) {
+    note_error("Error: Not a minimotif checkpoint: %s", args.checkpoint);
+    return 1;
+  }
+  if (hash != fingerprint) {
+    note_error("Error: Checkpoint %s was made with different inputs or options.",
+      args.checkpoint);
+    return 1;
+  }
+  output_offset = offset;
+  *good_end = ftell(in);
+  while (fgets(line, sizeof(line), in) != NULL && line[strlen(line) - 1] == '\n') {
+    if (line[0] != '#') {
+      if (sscanf(line, "%zu\t%zu\t%zu\t%zu", &motif_i, &first, &last, &offset) != 4 ||
+          motif_i >= motif_info.n || first >= last || last > seq_info.n) {
+        break;
+      }
+      add_done_task(motif_i, first, last);
+      *done += last - first;
+      output_offset = offset;
+    }
+    *good_end = ftell(in);
+  }
+  return 0;
+}
+
+void alloc_tasks(void) {
+  if (task_files != NULL) return;
+  task_files = malloc(sizeof(FILE *) * args.nthreads);
+  task_first = calloc(args.nthreads, sizeof(size_t));
+  task_time = calloc(args.nthreads, sizeof(time_t));
+  done_tasks = calloc(motif_info.n, sizeof(regions_t));
+  if (task_files == NULL || task_first == NULL || task_time == NULL || done_tasks == NULL) {
+    badexit("Error: Failed to allocate memory for tasks.");
+  }
+  for (size_t i = 0; i < args.nthreads; i++) {
+    task_files[i] = open_tmp_file();
+    if (task_files[i] == NULL) {
+      badexit("Error: Failed to create temporary file for tasks.");
+    }
+  }
+}
+
+/* Returns 1 if resuming, in which case the output header is already there. */
+int open_checkpoint(const uint64_t fingerprint) {
+  int resumed = 0;
+  long good_end = 0;
+  size_t done = 0;
+  alloc_tasks();
+  if (args.resume) {
+    FILE *in = fopen(args.checkpoint, "r");
+    if (in != NULL) {
+      if (read_checkpoint(in, fingerprint, &good_end, &done)) {
+        fclose(in);
+        badexit("");
+      }
+      fclose(in);
+      resumed = 1;
+    } else if (args.v) {
+      fprintf(stderr, "No checkpoint found, starting from scratch.\n");
+    }
+  }
+  fflush(files.o);
+  struct stat st;
+  if (resumed && fstat(fileno(files.o), &st)) {
+    badexit("Error: Failed to check output file size for --resume.");
+  } else if (resumed && (size_t) st.st_size < output_offset) {
+    badexitf("Error: Output file is shorter than its checkpoint says (%'zu<%'zu bytes).",
+      (size_t) st.st_size, output_offset);
+  }
+  if (ftruncate(fileno(files.o), resumed ? output_offset : 0)) {
+    badexit("Error: Failed to truncate output file for --resume.");
+  }
+  if (resumed) {
+    for (size_t i = 0; i < motif_info.n; i++) merge_regions(&done_tasks[i]);
+    if (truncate(args.checkpoint, good_end)) {
+      badexit("Error: Failed to truncate checkpoint file.");
+    }
+    if (args.v) {
+      fprintf(stderr, "Resuming: %.2f%% of motif/sequence pairs already done.\n",
+        100.0 * done / (motif_info.n * seq_info.n));
+    }
+  }
+  files.c = fopen(args.checkpoint, resumed ? "a" : "w");
+  if (files.c == NULL) {
+    badexitf("Error: Failed to create checkpoint file: %s", args.checkpoint);
+  }
+  files.c_open = 1;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_stop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, NULL);
+  return resumed;
+}
+
+/* Called once the output header has been written. */
+void start_checkpoint(const uint64_t fingerprint) {
+  fflush(files.o);
+  output_offset = ftell(files.o);
+  fprintf(files.c, "#minimotif-checkpoint\t%llx\t%zu\n",
+    (unsigned long long) fingerprint, output_offset);
+  fflush(files.c);
+}
+
+static inline void start_task(const motif_t *motif, const size_t first) {
+  if (task_files == NULL) return;
+  task_first[motif->thread] = first;
+  task_time[motif->thread] = time(NULL);
+}
+
+/* Moves the hits of sequences [task_first, last) to the output, then records
+ * them as done.
+ */
+void commit_task(const motif_t *motif, const size_t last) {
+  char buf[65536];
+  if (task_files == NULL) return;
+  const size_t t = motif->thread;
+  FILE *tmp = task_files[t];
+  long left = ftell(tmp);
+  rewind(tmp);
+  pthread_mutex_lock(&checkpoint_lock);
+  if (args.shard_n && last > task_first[t]) {
+    output_offset += fprintf(files.o, "##task\t%zu\t%zu\t%zu\t%ld\n", motif->index,
+      task_first[t], last, left);
+  }
+  while (left > 0) {
+    const size_t n = fread(buf, 1, MIN(left, (long) sizeof(buf)), tmp);
+    if (!n) badexit("Error: Failed to read temporary hit file.");
+    fwrite(buf, 1, n, files.o);
+    output_offset += n;
+    left -= n;
+  }
+  fflush(files.o);
+  if (files.c_open && last > task_first[t]) {
+    fprintf(files.c, "%zu\t%zu\t%zu\t%zu\n", motif->index, task_first[t], last,
+      output_offset);
+    fflush(files.c);
+  }
+  pthread_mutex_unlock(&checkpoint_lock);
+  rewind(tmp);
+  if (ftruncate(fileno(tmp), 0)) badexit("Error: Failed to truncate temporary hit file.");
+  task_first[t] = last;
+  task_time[t] = time(NULL);
+}
+
+static inline void task_seq_done(const motif_t *motif, const size_t seq_i) {
+  if (files.c_open && time(NULL) - task_time[motif->thread] >= CHECKPOINT_INTERVAL) {
+    commit_task(motif, seq_i + 1);
+  }
+}
+
+/* Ends the current task early, so the next one can start after seq_i. */
+static inline void skip_done_seq(const motif_t *motif, const size_t seq_i) {
+  if (task_first[motif->thread] < seq_i) commit_task(motif, seq_i);
+  task_first[motif->thread] = seq_i + 1;
+}
+
+/* A motif with every sequence done (or left to other shards) can be skipped
+ * without even computing its CDF.
+ */
+static inline int motif_is_done(motif_t *motif) {
+  if (done_tasks == NULL) return 0;
+  const regions_t *done = &done_tasks[motif->index];
+  if (done->n != 1 || done->regions[0].start || done->regions[0].end < seq_info.n) {
+    return 0;
+  }
+  motif->threshold = INT_MAX;            /* Nothing to report */
+  return 1;
+}
+
+void finish_tasks(void) {
+  if (files.c_open) {
+    fprintf(files.c, stop_requested ? "#stopped\n" : "#finished\n");
+    fflush(files.c);
+  }
+  for (size_t i = 0; i < args.nthreads; i++) fclose(task_files[i]);
+  for (size_t i = 0; i < motif_info.n; i++) free(done_tasks[i].regions);
+  free(task_files);
+  free(task_first);
+  free(task_time);
+  free(done_tasks);
+  task_files = NULL;
+  done_tasks = NULL;
+  if (stop_requested) {
+    fprintf(stderr, "Stopped, finished work was saved to %s (use --resume).\n",
+      args.checkpoint);
+    free(threads);
+    free_motifs();
+    free_seqs();
+    close_files();
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* For --shard, the scan is cut into tasks of one motif and one block of
+ * sequences, and every shard takes the tasks assigned to it by the same
+ * greedy balancing of their estimated cost (motif width times block size),
+ * so shards never need to talk to each other. Tasks of the other shards are
+ * treated as already done. Blocks are only made small enough to give about
+ * SHARD_TASKS_PER_SHARD tasks per shard, since a shard needs to compute the
+ * CDF of every motif it has a task for. The hits of each task are preceded by
+ * a ##task line, which lets --merge put them back in the order of a single
+ * run.
+ */
+#define SHARD_TASKS_PER_SHARD                   4
+
+typedef struct shard_task_t {
+  size_t    motif_i;
+  size_t    block_i;
+  size_t    cost;
+} shard_task_t;
+
+size_t   shard_tasks, shard_tasks_total;
+double   shard_cost_pct;
+
+int parse_shard(const char *str) {
+  char *end;
+  args.shard_i = strtoul(str, &end, 10);
+  if (end == str || *end != '/') return 1;
+  str = end + 1;
+  args.shard_n = strtoul(str, &end, 10);
+  return end == str || *end != '\0' || !args.shard_i || args.shard_i > args.shard_n;
+}
+
+/* Largest cost first, ties broken by position so every shard agrees. */
+int cmp_shard_tasks(const void *a, const void *b) {
+  const shard_task_t *x = (const shard_task_t *) a;
+  const shard_task_t *y = (const shard_task_t *) b;
+  if (x->cost != y->cost) return x->cost < y->cost ? 1 : -1;
+  if (x->motif_i != y->motif_i) return x->motif_i < y->motif_i ? -1 : 1;
+  return (x->block_i > y->block_i) - (x->block_i < y->block_i);
+}
+
+void plan_shard(void) {
+  size_t n_blocks = (SHARD_TASKS_PER_SHARD * args.shard_n + motif_info.n - 1) / motif_info.n;
+  n_blocks = MIN(n_blocks, seq_info.n);
+  size_t *block_ends = malloc(sizeof(size_t) * n_blocks);
+  size_t *block_sizes = calloc(n_blocks, sizeof(size_t));
+  size_t *loads = calloc(args.shard_n, sizeof(size_t));
+  shard_task_t *tasks = malloc(sizeof(shard_task_t) * n_blocks * motif_info.n);
+  if (block_ends == NULL || block_sizes == NULL || loads == NULL || tasks == NULL) {
+    badexit("Error: Failed to allocate memory for shard tasks.");
+  }
+  alloc_tasks();
+
+  /* Blocks of about equal size, with at least one sequence each. */
+  size_t total = 0, bases = 0, b = 0;
+  for (size_t i = 0; i < seq_info.n; i++) total += seq_sizes[i];
+  for (size_t i = 0; i < seq_info.n; i++) {
+    bases += seq_sizes[i];
+    block_sizes[b] += seq_sizes[i];
+    if (b < n_blocks - 1 && ((double) bases * n_blocks >= (double) (b + 1) * total ||
+          seq_info.n - i - 1 == n_blocks - b - 1)) {
+      block_ends[b++] = i + 1;
+    }
+  }
+  block_ends[n_blocks - 1] = seq_info.n;
+
+  shard_tasks_total = n_blocks * motif_info.n;
+  for (size_t i = 0; i < motif_info.n; i++) {
+    for (size_t j = 0; j < n_blocks; j++) {
+      shard_task_t *task = &tasks[i * n_blocks + j];
+      task->motif_i = i;
+      task->block_i = j;
+      task->cost = motifs[i]->size * block_sizes[j];
+    }
+  }
+  qsort(tasks, shard_tasks_total, sizeof(shard_task_t), cmp_shard_tasks);
+  size_t own_cost = 0, total_cost = 0;
+  for (size_t i = 0; i < shard_tasks_total; i++) {
+    size_t owner = 0;
+    for (size_t j = 1; j < args.shard_n; j++) {
+      if (loads[j] < loads[owner]) owner = j;
+    }
+    loads[owner] += tasks[i].cost;
+    total_cost += tasks[i].cost;
+    const size_t first = tasks[i].block_i ? block_ends[tasks[i].block_i - 1] : 0;
+    if (owner == args.shard_i - 1) {
+      shard_tasks++;
+      own_cost += tasks[i].cost;
+    } else {
+      add_done_task(tasks[i].motif_i, first, block_ends[tasks[i].block_i]);
+    }
+  }
+  for (size_t i = 0; i < motif_info.n; i++) merge_regions(&done_tasks[i]);
+  shard_cost_pct = total_cost ? 100.0 * own_cost / total_cost : 0.0;
+  if (args.v) {
+    fprintf(stderr, "Shard %zu/%zu: %'zu of %'zu tasks (%.2f%% of the estimated cost).\n",
+      args.shard_i, args.shard_n, shard_tasks, shard_tasks_total, shard_cost_pct);
+  }
+  free(block_ends);
+  free(block_sizes);
+  free(loads);
+  free(tasks);
+}
+
+void print_shard_header(const uint64_t fingerprint) {
+  fprintf(files.o, "##Shard=%zu/%zu Tasks=%zu/%zu Cost=%.2f%% Fingerprint=%016llx\n",
+    args.shard_i, args.shard_n, shard_tasks, shard_tasks_total, shard_cost_pct,
+    (unsigned long long) fingerprint);
+}
+
+/* For --merge, the ##task lines of all shards are gathered and sorted, and
+ * only once every sequence of every motif is found exactly once are the hits
+ * copied over.
+ */
+typedef struct shard_piece_t {
+  size_t    motif_i;
+  size_t    first;
+  size_t    last;
+  size_t    size;
+  long      offset;
+  FILE     *file;
+} shard_piece_t;
+
+int cmp_shard_pieces(const void *a, const void *b) {
+  const shard_piece_t *x = (const shard_piece_t *) a;
+  const shard_piece_t *y = (const shard_piece_t *) b;
+  if (x->motif_i != y->motif_i) return x->motif_i < y->motif_i ? -1 : 1;
+  return (x->first > y->first) - (x->first < y->first);
+}
+
+void merge_shards(char **names, const size_t n_files) {
+  char *line = NULL, *header[3] = {NULL, NULL, NULL};
+  size_t len = 0, n_shards = 0, n_motifs = 0, n_seqs = 0;
+  size_t n_pieces = 0, n_pieces_alloc = 0;
+  unsigned long long fingerprint = 0;
+  shard_piece_t *pieces = NULL;
+  FILE **shard_files = calloc(n_files, sizeof(FILE *));
+  char *seen = NULL;
+  if (!n_files) {
+    badexit("Error: --merge needs the outputs of --shard after the options.");
+  }
+  if (shard_files == NULL) {
+    badexit("Error: Failed to allocate memory for shard outputs.");
+  }
+  for (size_t i = 0; i < n_files; i++) {
+    FILE *in = shard_files[i] = fopen(names[i], "r");
+    if (in == NULL) {
+      badexitf("Error: Failed to open shard output: %s", names[i]);
+    }
+    fseek(in, 0, SEEK_END);
+    const long file_size = ftell(in);
+    rewind(in);
+
+    /* ##minimotif, ##MotifCount, ##Shard and column lines */
+    size_t shard_i, shard_n, tasks, tasks_total;
+    unsigned long long hash;
+    for (int j = 0; j < 4; j++) {
+      if (getline(&line, &len, in) == -1) {
+        badexitf("Error: Not the output of a --shard run: %s", names[i]);
+      }
+      if (j == 2) {
+        if (sscanf(line, "##Shard=%zu/%zu Tasks=%zu/%zu Cost=%*f%% Fingerprint=%llx",
+              &shard_i, &shard_n, &tasks, &tasks_total, &hash) != 5 ||
+            !shard_i || shard_i > shard_n) {
+          badexitf("Error: Not the output of a --shard run: %s", names[i]);
+        }
+        continue;
+      }
+      const int h = j < 2 ? j : 2;
+      if (i == 0) {
+        header[h] = strdup(line);
+        if (header[h] == NULL) {
+          badexit("Error: Failed to allocate memory for shard outputs.");
+        }
+      } else if (strcmp(header[h], line)) {
+        badexitf("Error: Shard outputs %s and %s are from different scans.",
+          names[0], names[i]);
+      }
+    }
+    if (i == 0) {
+      n_shards = shard_n;
+      fingerprint = hash;
+      seen = calloc(n_shards, 1);
+      if (seen == NULL ||
+          sscanf(header[1], "##MotifCount=%zu MotifSize=%*u SeqCount=%zu",
+            &n_motifs, &n_seqs) != 2) {
+        badexitf("Error: Not the output of a --shard run: %s", names[i]);
+      }
+    } else if (shard_n != n_shards || hash != fingerprint) {
+      badexitf("Error: Shard outputs %s and %s are from different scans.",
+        names[0], names[i]);
+    }
+    if (seen[shard_i - 1]) {
+      badexitf("Error: Shard %zu/%zu was given more than once (%s).",
+        shard_i, shard_n, names[i]);
+    }
+    seen[shard_i - 1] = 1;
+
+    while (getline(&line, &len, in) != -1) {
+      shard_piece_t piece;
+      if (sscanf(line, "##task\t%zu\t%zu\t%zu\t%zu", &piece.motif_i, &piece.first,
+            &piece.last, &piece.size) != 4 || piece.motif_i >= n_motifs ||
+          piece.first >= piece.last || piece.last > n_seqs) {
+        badexitf("Error: Unexpected line in shard output %s:\n%s", names[i], line);
+      }
+      piece.offset = ftell(in);
+      piece.file = in;
+      if (piece.offset + (long) piece.size > file_size) {
+        badexitf("Error: Shard output %s is cut short.", names[i]);
+      }
+      fseek(in, piece.size, SEEK_CUR);
+      if (n_pieces == n_pieces_alloc) {
+        n_pieces_alloc += ALLOC_CHUNK_SIZE;
+        shard_piece_t *tmp = realloc(pieces, sizeof(shard_piece_t) * n_pieces_alloc);
+        if (tmp == NULL) {
+          badexit("Error: Failed to allocate memory for shard outputs.");
+        }
+        pieces = tmp;
+      }
+      pieces[n_pieces++] = piece;
+    }
+  }
+  for (size_t i = 0; i < n_shards; i++) {
+    if (!seen[i]) {
+      badexitf("Error: Missing the output of shard %zu/%zu.", i + 1, n_shards);
+    }
+  }
+
+  qsort(pieces, n_pieces, sizeof(shard_piece_t), cmp_shard_pieces);
+  for (size_t i = 0, p = 0; i < n_motifs; i++) {
+    size_t next = 0;
+    for (; p < n_pieces && pieces[p].motif_i == i; p++) {
+      if (pieces[p].first != next) {
+        badexitf("Error: Sequences %zu-%zu of motif %zu are %s the shard outputs.",
+          MIN(next, pieces[p].first) + 1, MAX(next, pieces[p].first), i + 1,
+          pieces[p].first > next ? "missing from" : "repeated in");
+      }
+      next = pieces[p].last;
+    }
+    if (next != n_seqs) {
+      badexitf("Error: Sequences %zu-%zu of motif %zu are missing from the shard outputs.",
+        next + 1, n_seqs, i + 1);
+    }
+  }
+
+  fprintf(files.o, "%s%s%s", header[0], header[1], header[2]);
+  for (size_t i = 0; i < n_pieces; i++) {
+    char buf[65536];
+    size_t left = pieces[i].size;
+    fseek(pieces[i].file, pieces[i].offset, SEEK_SET);
+    while (left) {
+      const size_t n = fread(buf, 1, MIN(left, sizeof(buf)), pieces[i].file);
+      if (!n) {
+        badexit("Error: Failed to read shard output.");
+      }
+      fwrite(buf, 1, n, files.o);
+      left -= n;
+    }
+  }
+  if (args.v) {
+    fprintf(stderr, "Merged %'zu task(s) from %'zu shard(s).\n", n_pieces, n_shards);
+  }
+  for (size_t i = 0; i < n_files; i++) fclose(shard_files[i]);
+  for (int i = 0; i < 3; i++) free(header[i]);
+  free(shard_files);
+  free(pieces);
+  free(seen);
+  free(line);
+}
+
+/* For --cache, every motif has a file in the cache directory named after a
+ * hash of everything which decides its hits: the PWM, the threshold and the
+ * options changing which hits are reported. The file holds a record for each
+ * sequence scanned so far, keyed by a hash of the sequence contents and its
+ * size, followed by the hits found. Names and P-values aren't stored, so they
+ * always come from the current run. Records are only ever appended, and one
+ * cut short by an interrupted run is dropped the next time the file is
+ * opened. Each file is locked while a motif is being scanned with it; a
+ * motif whose file is already locked, by another motif with the same PWM or
+ * by another run sharing the directory, is scanned without the cache.
+ */
+#define CACHE_MAGIC                    "MMCACHE1"
+
+typedef struct cache_header_t {
+  char      magic[8];
+  uint64_t  key;
+} cache_header_t;
+
+typedef struct cache_record_t {
+  uint64_t  seq_hash;
+  uint64_t  seq_size;
+  uint64_t  n_hits;
+} cache_record_t;
+
+typedef struct cached_hit_t {
+  uint64_t  start;
+  int32_t   score;
+  char      strand;
+  char      pad[3];
+} cached_hit_t;
+
+typedef struct cache_entry_t {
+  uint64_t  seq_hash;                    /* 0 if empty */
+  uint64_t  seq_size;
+  uint64_t  n_hits;
+  long      offset;                      /* Of the hits in the file */
+} cache_entry_t;
+
+/* Per thread, for the motif being scanned. */
+typedef struct cache_t {
+  FILE          *file;
+  cache_entry_t *table;                  /* Open addressing */
+  size_t         table_size;
+  size_t         n_entries;
+  cached_hit_t  *hits;                   /* Being recorded or replayed */
+  size_t         n_hits;
+  size_t         n_hits_alloc;
+  int            recording;
+} cache_t;
+
+cache_t   *caches;
+uint64_t  *seq_hashes;                   /* 0 until needed */
+size_t     cache_reused, cache_scanned;
+size_t     cache_locked;                 /* Motifs scanned without the cache */
+
+void alloc_caches(void) {
+  if (mkdir(args.cache, 0777) && errno != EEXIST) {
+    badexitf("Error: Failed to create cache directory: %s", args.cache);
+  }
+  caches = calloc(args.nthreads, sizeof(cache_t));
+  seq_hashes = calloc(seq_info.n, sizeof(uint64_t));
+  if (caches == NULL || seq_hashes == NULL) {
+    badexit("Error: Failed to allocate memory for cache.");
+  }
+}
+
+void free_caches(void) {
+  if (args.v) {
+    fprintf(stderr, "Reused cached hits for %'zu of %'zu motif/sequence pairs.\n",
+      cache_reused, cache_reused + cache_scanned);
+  }
+  if (args.v && cache_locked) {
+    fprintf(stderr, "Scanned %'zu motif(s) without the cache, as their file was in use.\n",
+      cache_locked);
+  }
+  for (size_t i = 0; i < args.nthreads; i++) free(caches[i].hits);
+  free(caches);
+  free(seq_hashes);
+  caches = NULL;
+}
+
+uint64_t motif_cache_key(const motif_t *motif) {
+  const int64_t opts[6] = {
+    motif->size, motif->threshold, args.scan_rc, args.no_overlap,
+    args.overlap_strand, args.best
+  };
+  uint64_t hash = fnv_add(FNV_OFFSET_BASIS, CACHE_MAGIC, 8);
+  hash = fnv_add(hash, opts, sizeof(opts));
+  return fnv_add(hash, motif->pwm, sizeof(int) * motif->size * 5);
+}
+
+static inline cache_entry_t *find_cache_slot(const cache_t *cache, const uint64_t seq_hash, const uint64_t seq_size) {
+  size_t i = seq_hash & (cache->table_size - 1);
+  while (cache->table[i].seq_hash &&
+      (cache->table[i].seq_hash != seq_hash || cache->table[i].seq_size != seq_size)) {
+    i = (i + 1) & (cache->table_size - 1);
+  }
+  return &cache->table[i];
+}
+
+static inline const cache_entry_t *find_cache_entry(const cache_t *cache, const uint64_t seq_hash, const uint64_t seq_size) {
+  if (!cache->table_size) return NULL;
+  const cache_entry_t *entry = find_cache_slot(cache, seq_hash, seq_size);
+  return entry->seq_hash ? entry : NULL;
+}
+
+void add_cache_entry(cache_t *cache, const cache_entry_t *entry) {
+  if ((cache->n_entries + 1) * 2 > cache->table_size) {
+    cache_entry_t *old = cache->table;
+    const size_t old_size = cache->table_size;
+    cache->table_size = old_size ? old_size * 2 : 64;
+    cache->table = calloc(cache->table_size, sizeof(cache_entry_t));
+    if (cache->table == NULL) badexit("Error: Failed to allocate memory for cache.");
+    for (size_t i = 0; i < old_size; i++) {
+      if (old[i].seq_hash) {
+        *find_cache_slot(cache, old[i].seq_hash, old[i].seq_size) = old[i];
+      }
+    }
+    free(old);
+  }
+  cache_entry_t *slot = find_cache_slot(cache, entry->seq_hash, entry->seq_size);
+  if (!slot->seq_hash) cache->n_entries++;
+  *slot = *entry;
+}
+
+static inline void reserve_cached_hits(cache_t *cache, const size_t n) {
+  if (n <= cache->n_hits_alloc) return;
+  cache->n_hits_alloc = MAX(n, cache->n_hits_alloc * 2);
+  cached_hit_t *tmp = realloc(cache->hits, sizeof(cached_hit_t) * cache->n_hits_alloc);
+  if (tmp == NULL) badexit("Error: Failed to allocate memory for cached hits.");
+  cache->hits = tmp;
+}
+
+void open_motif_cache(const motif_t *motif) {
+  cache_t *cache = &caches[motif->thread];
+  const uint64_t key = motif_cache_key(motif);
+  char path[4096];
+  cache_header_t header;
+  snprintf(path, sizeof(path), "%s/%016llx.mmc", args.cache, (unsigned long long) key);
+  const int fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (fd == -1) {
+    badexitf("Error: Failed to create cache file: %s", path);
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB)) {
+    close(fd);
+    __atomic_fetch_add(&cache_locked, 1, __ATOMIC_RELAXED);
+    if (args.w && !args.progress) {
+      fprintf(stderr, "    Cache file in use, scanning [%s] without it\n", motif->name);
+    }
+    return;
+  }
+  cache->file = fdopen(fd, "r+b");
+  if (cache->file == NULL) {
+    close(fd);
+    badexitf("Error: Failed to open cache file: %s", path);
+  }
+  if (fread(&header, sizeof(header), 1, cache->file) != 1 ||
+      memcmp(header.magic, CACHE_MAGIC, 8) || header.key != key) {
+    rewind(cache->file);                 /* New or not usable, start over */
+    if (ftruncate(fd, 0)) {
+      badexitf("Error: Failed to truncate cache file: %s", path);
+    }
+    memcpy(header.magic, CACHE_MAGIC, 8);
+    header.key = key;
+    fwrite(&header, sizeof(header), 1, cache->file);
+    return;
+  }
+  fseek(cache->file, 0, SEEK_END);
+  const long file_size = ftell(cache->file);
+  long good_end = sizeof(header);
+  cache_record_t record;
+  fseek(cache->file, good_end, SEEK_SET);
+  while (fread(&record, sizeof(record), 1, cache->file) == 1) {
+    const long hits_at = good_end + sizeof(record);
+    if (record.n_hits > (file_size - hits_at) / sizeof(cached_hit_t)) break;
+    const cache_entry_t entry = {
+      .seq_hash = record.seq_hash,
+      .seq_size = record.seq_size,
+      .n_hits   = record.n_hits,
+      .offset   = hits_at
+    };
+    add_cache_entry(cache, &entry);
+    good_end = hits_at + record.n_hits * sizeof(cached_hit_t);
+    fseek(cache->file, good_end, SEEK_SET);
+  }
+  if (good_end < file_size) {
+    fflush(cache->file);
+    if (ftruncate(fileno(cache->file), good_end)) {
+      badexitf("Error: Failed to truncate cache file: %s", path);
+    }
+  }
+}
+
+void close_motif_cache(const motif_t *motif) {
+  cache_t *cache = &caches[motif->thread];
+  if (fclose(cache->file)) badexit("Error: Failed to write to cache file.");
+  free(cache->table);
+  cache->file = NULL;
+  cache->table = NULL;
+  cache->table_size = 0;
+  cache->n_entries = 0;
+}
+
+static inline void record_hit(const motif_t *motif, const size_t start, const int score, const char strand) {
+  cache_t *cache = &caches[motif->thread];
+  if (!cache->recording) return;
+  reserve_cached_hits(cache, cache->n_hits + 1);
+  cached_hit_t *hit = &cache->hits[cache->n_hits++];
+  memset(hit, 0, sizeof(cached_hit_t));
+  hit->start = start;
+  hit->score = score;
+  hit->strand = strand;
+}
+
+void save_recorded_hits(const motif_t *motif, const uint64_t seq_hash, const uint64_t seq_size) {
+  cache_t *cache = &caches[motif->thread];
+  const cache_record_t record = {
+    .seq_hash = seq_hash,
+    .seq_size = seq_size,
+    .n_hits   = cache->n_hits
+  };
+  cache->recording = 0;
+  fseek(cache->file, 0, SEEK_END);
+  const cache_entry_t entry = {
+    .seq_hash = seq_hash,
+    .seq_size = seq_size,
+    .n_hits   = cache->n_hits,
+    .offset   = ftell(cache->file) + sizeof(record)
+  };
+  if (fwrite(&record, sizeof(record), 1, cache->file) != 1 ||
+      fwrite(cache->hits, sizeof(cached_hit_t), cache->n_hits, cache->file) != cache->n_hits) {
+    badexit("Error: Failed to write to cache file.");
+  }
+  add_cache_entry(cache, &entry);
+}
+
+/* For --shm, hits are written as binary records to a ring buffer in a POSIX
+ * shared memory object instead of being printed, for a consumer process to
+ * read as they come (see minimotif_shm.h for the layout and protocol). The
+ * threads collect their hits in batches, which are copied into the ring one
+ * at a time, so that minimotif acts as a single producer. When the ring is
+ * full, the scan waits for the consumer.
+ */
+#define SHM_RING_SIZE            ((size_t) 262144)    /* Records, a power of 2 */
+#define SHM_BATCH_SIZE           ((size_t) 1024)
+#define SHM_WAIT_NS                         50000
+
+typedef struct shm_batch_t {
+  mm_shm_hit_t hits[SHM_BATCH_SIZE];
+  size_t       n;
+} shm_batch_t;
+
+mm_shm_header_t *shm_ring;
+mm_shm_hit_t    *shm_records;
+size_t           shm_size;
+shm_batch_t     *shm_batches;            /* Per thread */
+pthread_mutex_t  shm_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t           shm_waits;
+
+static inline size_t shm_align(const size_t offset) {
+  return (offset + 63) & ~((size_t) 63);
+}
+
+void open_shm(void) {
+  size_t names_size = 0;
+  for (size_t i = 0; i < seq_info.n; i++) names_size += strlen(seq_names[i]) + 1;
+  for (size_t i = 0; i < motif_info.n; i++) names_size += strlen(motifs[i]->name) + 1;
+  const size_t seqs_offset = shm_align(sizeof(mm_shm_header_t));
+  const size_t motifs_offset = shm_align(seqs_offset + sizeof(mm_shm_seq_t) * seq_info.n);
+  const size_t names_offset = shm_align(motifs_offset + sizeof(mm_shm_motif_t) * motif_info.n);
+  const size_t ring_offset = shm_align(names_offset + names_size);
+  shm_size = ring_offset + sizeof(mm_shm_hit_t) * SHM_RING_SIZE;
+
+  shm_unlink(args.shm);                  /* Left behind by an earlier run */
+  const int fd = shm_open(args.shm, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1 || ftruncate(fd, shm_size)) {
+    badexitf("Error: Failed to create shared memory object: %s", args.shm);
+  }
+  void *mem = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    badexitf("Error: Failed to map shared memory object: %s", args.shm);
+  }
+  shm_batches = calloc(args.nthreads, sizeof(shm_batch_t));
+  if (shm_batches == NULL) badexit("Error: Failed to allocate memory for --shm batches.");
+
+  shm_ring = (mm_shm_header_t *) mem;
+  shm_ring->record_size = sizeof(mm_shm_hit_t);
+  shm_ring->capacity = SHM_RING_SIZE;
+  shm_ring->n_seqs = seq_info.n;
+  shm_ring->n_motifs = motif_info.n;
+  shm_ring->seqs_offset = seqs_offset;
+  shm_ring->motifs_offset = motifs_offset;
+  shm_ring->names_offset = names_offset;
+  shm_ring->ring_offset = ring_offset;
+  shm_ring->producer_pid = getpid();
+  mm_shm_seq_t *seq_table = (mm_shm_seq_t *) ((char *) mem + seqs_offset);
+  mm_shm_motif_t *motif_table = (mm_shm_motif_t *) ((char *) mem + motifs_offset);
+  char *names = (char *) mem + names_offset;
+  size_t name = 0;
+  for (size_t i = 0; i < seq_info.n; i++) {
+    seq_table[i].size = seq_sizes[i];
+    seq_table[i].name = name;
+    strcpy(names + name, seq_names[i]);
+    name += strlen(seq_names[i]) + 1;
+  }
+  for (size_t i = 0; i < motif_info.n; i++) {
+    motif_table[i].size = motifs[i]->size;
+    motif_table[i].name = name;
+    strcpy(names + name, motifs[i]->name);
+    name += strlen(motifs[i]->name) + 1;
+  }
+  shm_records = (mm_shm_hit_t *) ((char *) mem + ring_offset);
+  memcpy(shm_ring->magic, MM_SHM_MAGIC, 8);
+  __atomic_store_n(&shm_ring->state, MM_SHM_SCANNING, __ATOMIC_RELEASE);
+  if (args.v) {
+    fprintf(stderr, "Writing hits to shared memory object %s (%'.2f MB).\n", args.shm,
+      b2mb(shm_size));
+  }
+}
+
+static inline void shm_wait_for_consumer(void) {
+  const pid_t consumer = __atomic_load_n(&shm_ring->consumer_pid, __ATOMIC_ACQUIRE);
+  if (consumer && kill(consumer, 0) && errno == ESRCH) {
+    shm_unlink(args.shm);
+    badexit("Error: The --shm consumer exited before reading all hits.");
+  }
+  const struct timespec wait = { 0, SHM_WAIT_NS };
+  nanosleep(&wait, NULL);
+  shm_waits++;
+}
+
+void shm_flush(const int thread_i) {
+  shm_batch_t *batch = &shm_batches[thread_i];
+  if (!batch->n) return;
+  pthread_mutex_lock(&shm_lock);
+  uint64_t head = shm_ring->head;
+  for (size_t i = 0; i < batch->n; i++) {
+    while (head - __atomic_load_n(&shm_ring->tail, __ATOMIC_ACQUIRE) == SHM_RING_SIZE) {
+      __atomic_store_n(&shm_ring->head, head, __ATOMIC_RELEASE);
+      shm_wait_for_consumer();
+    }
+    shm_records[head & (SHM_RING_SIZE - 1)] = batch->hits[i];
+    head++;
+  }
+  __atomic_store_n(&shm_ring->head, head, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&shm_lock);
+  batch->n = 0;
+}
+
+static inline void shm_hit(const motif_t *motif, const size_t seq_i, const size_t start, const int score, const char strand) {
+  shm_batch_t *batch = &shm_batches[motif->thread];
+  mm_shm_hit_t *hit = &batch->hits[batch->n];
+  hit->start = start;
+  hit->pvalue = score2pval(motif, score);
+  hit->seq_i = seq_i;
+  hit->motif_i = motif->index;
+  hit->score = score;
+  hit->score_pct = 100.0 * score / motif->max_score;
+  hit->strand = strand;
+  if (++batch->n == SHM_BATCH_SIZE) shm_flush(motif->thread);
+}
+
+void close_shm(void) {
+  __atomic_store_n(&shm_ring->state, MM_SHM_DONE, __ATOMIC_RELEASE);
+  if (args.v) {
+    fprintf(stderr, "Wrote %'llu hits to %s, waiting for the consumer %'zu times.\n",
+      (unsigned long long) shm_ring->head, args.shm, shm_waits);
+  }
+  munmap(shm_ring, shm_size);
+  shm_ring = NULL;
+  free(shm_batches);
+}
+
+#ifdef MINIMOTIF_LIB
+
+__thread mm_hit_fn lib_hit_fn;
+__thread void     *lib_hit_data;
+
+void lib_report_hit(const motif_t *motif, const size_t seq_i, const unsigned char *seq, const size_t start, const int score, const char strand) {
+  const mm_hit_t hit = {
+    .seq_name  = seq_names[seq_i],
+    .motif     = motif->name,
+    .motif_i   = motif->index,
+    .start     = start + 1,
+    .end       = start + motif->size,
+    .strand    = strand,
+    .pvalue    = score2pval(motif, score),
+    .score     = score / PWM_INT_MULTIPLIER,
+    .score_pct = 100.0 * score / motif->max_score,
+    .match     = (const char *) seq + start
+  };
+  lib_hit_fn(&hit, lib_hit_data);
+}
+
+#endif
+
+static inline void report_hit(motif_t *motif, const size_t seq_i, const unsigned char *seq, const size_t start, const int score, const char strand) {
+  if (caches != NULL) record_hit(motif, start, score, strand);
+  if (motif->anchor) add_anchor_region(motif, seq_i, start);
+  if (args.qvalues) {
+    spill_hit(motif, seq_i, seq, start, score, strand);
+  } else if (args.count) {
+    count_hit(motif, seq_i, strand);
+  } else if (args.sample > 0.0) {
+    sample_hit(motif, seq_i, start, score, strand);
+  } else if (shm_ring != NULL) {
+    shm_hit(motif, seq_i, start, score, strand);
+  } else {
+#ifdef MINIMOTIF_LIB
+    lib_report_hit(motif, seq_i, seq, start, score, strand);
+#else
+    print_hit(hit_file(motif), motif, seq_names[seq_i], start, strand, score,
+      score2pval(motif, score), seq + start);
+#endif
+  }
+}
+
+/* For --no-overlap, hits are kept greedily: from best to worst, a hit is kept
+ * unless it overlaps a better hit which was kept. A hit can only be decided
+ * once no better hit can start next to it anymore and all the better hits it
+ * overlaps have been decided, which can depend on a chain of ever better
+ * hits further along. So the buffer grows as needed, though it rarely holds
+ * more than a few motif widths of hits. Hits are reported in order of their
+ * start once they and all hits before them are decided.
+ */
+#define OVERLAP_BUF_SIZE                      256    /* A power of 2 */
+
+/* Hits which need to be held on to before being reported.
+ */
+typedef struct hit_t {
+  size_t    start;
+  int       score;
+  char      strand;
+  char      decided;                     /* Only used by --no-overlap */
+  char      kept;                        /* Only used by --no-overlap */
+  size_t    wait_until;                  /* Only used by --no-overlap */
+} hit_t;
+
+/* Higher scores win, then the leftmost hit, then the forward strand.
+ */
+static inline int hit_is_better(const hit_t *a, const hit_t *b) {
+  if (a->score != b->score) return a->score > b->score;
+  if (a->start != b->start) return a->start < b->start;
+  return a->strand == '+' && b->strand == '-';
+}
+
+typedef struct overlap_buf_t {
+  hit_t  *hits;
+  size_t  size;
+  size_t  first;
+  size_t  n;
+  size_t  n_decided;                     /* All hits before this one are decided */
+} overlap_buf_t;
+
+static inline hit_t *overlap_buf_get(overlap_buf_t *buf, const size_t i) {
+  return &buf->hits[(buf->first + i) & (buf->size - 1)];
+}
+
+/* One per thread, emptied for every sequence. */
+LIB_LOCAL overlap_buf_t *overlap_bufs;
+
+int alloc_overlap_bufs(void) {
+  overlap_bufs = calloc(args.nthreads, sizeof(overlap_buf_t));
+  if (overlap_bufs == NULL) {
+    note_error("Error: Failed to allocate memory for --no-overlap.");
+    return 1;
+  }
+  for (size_t i = 0; i < args.nthreads; i++) {
+    overlap_bufs[i].hits = malloc(sizeof(hit_t) * OVERLAP_BUF_SIZE);
+    if (overlap_bufs[i].hits == NULL) {
+      note_error("Error: Failed to allocate memory for --no-overlap (#%zu).", i);
+      return 1;
+    }
+    overlap_bufs[i].size = OVERLAP_BUF_SIZE;
+  }
+  return 0;
+}
+
+void free_overlap_bufs(void) {
+  if (overlap_bufs == NULL) return;
+  for (size_t i = 0; i < args.nthreads; i++) free(overlap_bufs[i].hits);
+  free(overlap_bufs);
+  overlap_bufs = NULL;
+}
+
+/* Threads which share out sequences instead of motifs (--serve) set this. */
+__thread int seq_thread_i = -1;
+
+static inline overlap_buf_t *get_overlap_buf(const motif_t *motif) {
+  if (!args.no_overlap) return NULL;
+  overlap_buf_t *buf = &overlap_bufs[seq_thread_i != -1 ? (size_t) seq_thread_i : motif->thread];
+  buf->first = 0;
+  buf->n = 0;
+  buf->n_decided = 0;
+  return buf;
+}
+
+void overlap_buf_grow(overlap_buf_t *buf) {
+  hit_t *hits = malloc(sizeof(hit_t) * buf->size * 2);
+  if (hits == NULL) badexit("Error: Failed to allocate memory for --no-overlap.");
+  for (size_t i = 0; i < buf->n; i++) hits[i] = *overlap_buf_get(buf, i);
+  free(buf->hits);
+  buf->hits = hits;
+  buf->size *= 2;
+  buf->first = 0;
+}
+
+static inline int hits_overlap(const hit_t *a, const hit_t *b, const size_t width) {
+  if (args.overlap_strand && a->strand != b->strand) return 0;
+  return a->start < b->start + width && b->start < a->start + width;
+}
+
+/* Decide all hits which can be decided before seeing any hits starting at
+ * 'next_start' or later, then report and forget those which no undecided
+ * hits depend on anymore.
+ */
+void overlap_buf_flush(motif_t *motif, overlap_buf_t *buf, const size_t seq_i, const unsigned char *seq, const size_t next_start) {
+  const size_t width = motif->size;
+  int changed = 1;
+  while (changed) {
+    changed = 0;
+    while (buf->n_decided < buf->n && overlap_buf_get(buf, buf->n_decided)->decided) {
+      buf->n_decided++;
+    }
+    for (size_t i = buf->n_decided; i < buf->n; i++) {
+      hit_t *hit = overlap_buf_get(buf, i);
+      if (hit->decided || hit->wait_until > next_start) continue;
+      if (hit->start + width > next_start) break;
+      int blocked = 0, waiting = 0;
+      for (size_t j = i > 2 * width ? i - 2 * width : 0; j < buf->n; j++) {
+        const hit_t *other = overlap_buf_get(buf, j);
+        if (other->start >= hit->start + width) break;
+        if (i == j || !hits_overlap(hit, other, width) || !hit_is_better(other, hit)) continue;
+        if (!other->decided) {
+          if (!waiting) hit->wait_until = other->start + width;
+          waiting = 1;
+        } else if (other->kept) {
+          blocked = 1;
+          break;
+        }
+      }
+      if (blocked || !waiting) {
+        hit->decided = 1;
+        hit->kept = !blocked;
+        changed = 1;
+      }
+    }
+  }
+  while (buf->n) {
+    const hit_t *hit = overlap_buf_get(buf, 0);
+    if (!hit->decided) break;
+    int needed = 0;
+    for (size_t j = 1; j < buf->n; j++) {
+      const hit_t *other = overlap_buf_get(buf, j);
+      if (other->start >= hit->start + width) break;
+      if (!other->decided) {
+        needed = 1;
+        break;
+      }
+    }
+    if (needed) break;
+    if (hit->kept) report_hit(motif, seq_i, seq, hit->start, hit->score, hit->strand);
+    buf->first = (buf->first + 1) & (buf->size - 1);
+    buf->n--;
+    if (buf->n_decided) buf->n_decided--;
+  }
+}
+
+static inline void overlap_buf_add(motif_t *motif, overlap_buf_t *buf, const size_t seq_i, const unsigned char *seq, const size_t start, const int score, const char strand) {
+  overlap_buf_flush(motif, buf, seq_i, seq, start);
+  if (buf->n == buf->size) overlap_buf_grow(buf);
+  hit_t *hit = overlap_buf_get(buf, buf->n);
+  hit->start = start;
+  hit->score = score;
+  hit->strand = strand;
+  hit->decided = 0;
+  hit->kept = 0;
+  hit->wait_until = 0;
+  buf->n++;
+}
+
+static inline void found_hit(motif_t *motif, overlap_buf_t *buf, const size_t seq_i, const unsigned char *seq, const size_t start, const int score, const char strand) {
+  if (args.no_overlap) {
+    overlap_buf_add(motif, buf, seq_i, seq, start, score, strand);
+  } else {
+    report_hit(motif, seq_i, seq, start, score, strand);
+  }
+}
+
+/* Same as score_subseq(_rc), but gives up as soon as the rest of the motif
+ * can't bring the score past the threshold (in which case the score is set to
+ * INT_MIN). Only worth it when the threshold is high relative to the max
+ * score, as for --best.
+ */
+static inline void score_subseq_bound(const motif_t *motif, const unsigned char *seq, const size_t offset, const int threshold, int *score) {
+  int s = 0;
+  for (size_t i = 0; i < motif->size; i++) {
+    if (s + motif->max_suffix[i] <= threshold) {
+      *score = INT_MIN;
+      return;
+    }
+    s += get_score(motif, seq[i + offset], i);
+  }
+  *score = s;
+}
+
+static inline void score_subseq_rc_bound(const motif_t *motif, const unsigned char *seq, const size_t offset, const int threshold, int *score, int *score_rc) {
+  int s = 0, s_rc = 0;
+  for (size_t i = 0; i < motif->size; i++) {
+    if (s + motif->max_suffix[i] <= threshold &&
+        s_rc + motif->max_suffix_rc[i] <= threshold) {
+      *score = INT_MIN; *score_rc = INT_MIN;
+      return;
+    }
+    s += get_score(motif, seq[i + offset], i);
+    s_rc += get_score_rc(motif, seq[i + offset], i);
+  }
+  *score = s; *score_rc = s_rc;
+}
+
+/* For --best, each thread keeps a min-heap of the best hits found so far in
+ * the current sequence, with the worst of them at the root.
+ */
+hit_t **best_hits;
+
+int alloc_best_hits(void) {
+  best_hits = malloc(sizeof(hit_t *) * args.nthreads);
+  if (best_hits == NULL) {
+    note_error("Error: Failed to allocate memory for best hits.");
+    return 1;
+  }
+  for (size_t i = 0; i < args.nthreads; i++) {
+    best_hits[i] = malloc(sizeof(hit_t) * args.best);
+    if (best_hits[i] == NULL) {
+      note_error("Error: Failed to allocate memory for best hits (#%zu).", i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void free_best_hits(void) {
+  for (size_t i = 0; i < args.nthreads; i++) free(best_hits[i]);
+  free(best_hits);
+}
+
+static inline void hit_heap_push(hit_t *heap, size_t *n, const size_t max_n, const hit_t *hit) {
+  size_t i;
+  if (*n < max_n) {
+    i = (*n)++;
+    while (i && hit_is_better(&heap[(i - 1) / 2], hit)) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = *hit;
+  } else if (hit_is_better(hit, &heap[0])) {
+    i = 0;
+    for (;;) {
+      size_t child = 2 * i + 1;
+      if (child >= max_n) break;
+      if (child + 1 < max_n && hit_is_better(&heap[child], &heap[child + 1])) child++;
+      if (!hit_is_better(hit, &heap[child])) break;
+      heap[i] = heap[child];
+      i = child;
+    }
+    heap[i] = *hit;
+  }
+}
+
+int cmp_hits(const void *a, const void *b) {
+  return hit_is_better((const hit_t *) b, (const hit_t *) a) -
+    hit_is_better((const hit_t *) a, (const hit_t *) b);
+}
+
+/* Once the heap is full, new hits have to beat the worst hit in it. Hits
+ * which merely tie it can't be better, since they come later in the sequence.
+ */
+void score_seq_best(motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+  const unsigned char *seq = seqs[seq_loc];
+  const size_t seq_size = seq_sizes[seq_i];
+  if (seq_size < motif->size || motif->threshold == INT_MAX) return;
+  hit_t *heap = best_hits[motif->thread];
+  hit_t hit = { .decided = 0 };
+  size_t n = 0;
+  int threshold = motif->threshold - 1;
+  int score = INT_MIN, score_rc = INT_MIN;
+  if (args.scan_rc) {
+    for (size_t i = 0; i <= seq_size - motif->size; i++) {
+      score_subseq_rc_bound(motif, seq, i, threshold, &score, &score_rc);
+      if (__builtin_expect(score > threshold, 0)) {
+        hit.start = i; hit.score = score; hit.strand = '+';
+        hit_heap_push(heap, &n, args.best, &hit);
+        if (n == args.best) threshold = MAX(threshold, heap[0].score);
+      }
+      if (__builtin_expect(score_rc > threshold, 0)) {
+        hit.start = i; hit.score = score_rc; hit.strand = '-';
+        hit_heap_push(heap, &n, args.best, &hit);
+        if (n == args.best) threshold = MAX(threshold, heap[0].score);
+      }
+    }
+  } else {
+    for (size_t i = 0; i <= seq_size - motif->size; i++) {
+      score_subseq_bound(motif, seq, i, threshold, &score);
+      if (__builtin_expect(score > threshold, 0)) {
+        hit.start = i; hit.score = score; hit.strand = '+';
+        hit_heap_push(heap, &n, args.best, &hit);
+        if (n == args.best) threshold = MAX(threshold, heap[0].score);
+      }
+    }
+  }
+  qsort(heap, n, sizeof(hit_t), cmp_hits);
+  for (size_t i = 0; i < n; i++) {
+    report_hit(motif, seq_i, seq, heap[i].start, heap[i].score, heap[i].strand);
+  }
+}
+
+/* For --top, every motif has a min-heap of the best hits found so far in all
+ * sequences. Since the hits are only printed after scanning is done, the
+ * P-value and match need to be stored as well. The heaps are locked so that
+ * threads can safely share motifs, and the score of the worst hit in a full
+ * heap (the floor) is used to raise the scanning threshold.
+ */
+typedef struct top_hit_t {
+  hit_t           hit;
+  size_t          seq_i;
+  double          pvalue;
+  unsigned char   match[MAX_MOTIF_SIZE / 5];
+} top_hit_t;
+
+typedef struct top_hits_t {
+  top_hit_t        *hits;
+  size_t            n;
+  int               floor;
+  pthread_mutex_t   lock;
+} top_hits_t;
+
+top_hits_t *top_hits;
+
+int alloc_top_hits(void) {
+  top_hits = malloc(sizeof(top_hits_t) * motif_info.n);
+  if (top_hits == NULL) {
+    note_error("Error: Failed to allocate memory for top hits.");
+    return 1;
+  }
+  for (size_t i = 0; i < motif_info.n; i++) {
+    top_hits[i].hits = malloc(sizeof(top_hit_t) * args.top);
+    if (top_hits[i].hits == NULL) {
+      note_error("Error: Failed to allocate memory for top hits (#%zu).", i);
+      return 1;
+    }
+    top_hits[i].n = 0;
+    top_hits[i].floor = INT_MIN;
+    pthread_mutex_init(&top_hits[i].lock, NULL);
+  }
+  return 0;
+}
+
+void free_top_hits(void) {
+  for (size_t i = 0; i < motif_info.n; i++) {
+    free(top_hits[i].hits);
+    pthread_mutex_destroy(&top_hits[i].lock);
+  }
+  free(top_hits);
+}
+
+/* Same as hit_is_better, with ties between sequences going to the first.
+ */
+static inline int top_hit_is_better(const top_hit_t *a, const top_hit_t *b) {
+  if (a->hit.score != b->hit.score) return a->hit.score > b->hit.score;
+  if (a->seq_i != b->seq_i) return a->seq_i < b->seq_i;
+  return hit_is_better(&a->hit, &b->hit);
+}
+
+int cmp_top_hits(const void *a, const void *b) {
+  return top_hit_is_better((const top_hit_t *) b, (const top_hit_t *) a) -
+    top_hit_is_better((const top_hit_t *) a, (const top_hit_t *) b);
+}
+
+static inline int get_top_floor(const top_hits_t *top) {
+  return __atomic_load_n(&top->floor, __ATOMIC_RELAXED);
+}
+
+void top_hits_push(top_hits_t *top, const motif_t *motif, const size_t seq_i, const unsigned char *seq, const size_t start, const int score, const char strand) {
+  top_hit_t new_hit = {
+    .hit    = { .start = start, .score = score, .strand = strand, .decided = 0 },
+    .seq_i  = seq_i,
+    .pvalue = score2pval(motif, score)
+  };
+  memcpy(new_hit.match, seq + start, motif->size);
+  pthread_mutex_lock(&top->lock);
+  top_hit_t *heap = top->hits;
+  size_t i;
+  if (top->n < args.top) {
+    i = top->n++;
+    while (i && top_hit_is_better(&heap[(i - 1) / 2], &new_hit)) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = new_hit;
+  } else if (top_hit_is_better(&new_hit, &heap[0])) {
+    i = 0;
+    for (;;) {
+      size_t child = 2 * i + 1;
+      if (child >= args.top) break;
+      if (child + 1 < args.top && top_hit_is_better(&heap[child], &heap[child + 1])) {
+        child++;
+      }
+      if (!top_hit_is_better(&new_hit, &heap[child])) break;
+      heap[i] = heap[child];
+      i = child;
+    }
+    heap[i] = new_hit;
+  }
+  if (top->n == args.top) {
+    __atomic_store_n(&top->floor, heap[0].hit.score, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&top->lock);
+}
+
+/* Hits tying the floor can still make it in if they come from an earlier
+ * sequence, hence the floor being one less than the threshold.
+ */
+void score_seq_top(motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+  const unsigned char *seq = seqs[seq_loc];
+  const size_t seq_size = seq_sizes[seq_i];
+  if (seq_size < motif->size || motif->threshold == INT_MAX) return;
+  top_hits_t *top = &top_hits[motif->index];
+  int threshold = MAX(motif->threshold, get_top_floor(top)) - 1;
+  int score = INT_MIN, score_rc = INT_MIN;
+  if (args.scan_rc) {
+    for (size_t i = 0; i <= seq_size - motif->size; i++) {
+      score_subseq_rc_bound(motif, seq, i, threshold, &score, &score_rc);
+      if (__builtin_expect(score > threshold, 0)) {
+        top_hits_push(top, motif, seq_i, seq, i, score, '+');
+        threshold = MAX(motif->threshold, get_top_floor(top)) - 1;
+      }
+      if (__builtin_expect(score_rc > threshold, 0)) {
+        top_hits_push(top, motif, seq_i, seq, i, score_rc, '-');
+        threshold = MAX(motif->threshold, get_top_floor(top)) - 1;
+      }
+    }
+  } else {
+    for (size_t i = 0; i <= seq_size - motif->size; i++) {
+      score_subseq_bound(motif, seq, i, threshold, &score);
+      if (__builtin_expect(score > threshold, 0)) {
+        top_hits_push(top, motif, seq_i, seq, i, score, '+');
+        threshold = MAX(motif->threshold, get_top_floor(top)) - 1;
+      }
+    }
+  }
+}
+
+void print_top_hits(void) {
+  for (size_t i = 0; i < motif_info.n; i++) {
+    top_hits_t *top = &top_hits[i];
+    qsort(top->hits, top->n, sizeof(top_hit_t), cmp_top_hits);
+    for (size_t j = 0; j < top->n; j++) {
+      const top_hit_t *h = &top->hits[j];
+      print_hit(files.o, motifs[i], seq_names[h->seq_i], h->hit.start, h->hit.strand,
+        h->hit.score, h->pvalue, h->match);
+    }
+  }
+}
+
+/* For -B, all that matters is whether a sequence has at least one hit, so
+ * stop at the first one.
+ */
+size_t *enrich_hits;                     /* Target and background per motif */
+
+int seq_has_hit(const motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+  const unsigned char *seq = seqs[seq_loc];
+  const size_t seq_size = seq_sizes[seq_i];
+  if (seq_size < motif->size || motif->threshold == INT_MAX) return 0;
+  const int threshold = motif->threshold - 1;
+  int score = INT_MIN, score_rc = INT_MIN;
+  if (args.scan_rc) {
+    for (size_t i = 0; i <= seq_size - motif->size; i++) {
+      score_subseq_rc_bound(motif, seq, i, threshold, &score, &score_rc);
+      if (__builtin_expect(score > threshold || score_rc > threshold, 0)) return 1;
+    }
+  } else {
+    for (size_t i = 0; i <= seq_size - motif->size; i++) {
+      score_subseq_bound(motif, seq, i, threshold, &score);
+      if (__builtin_expect(score > threshold, 0)) return 1;
+    }
+  }
+  return 0;
+}
+
+static inline double log_choose(const double n, const double k) {
+  return lgamma(n + 1.0) - lgamma(k + 1.0) - lgamma(n - k + 1.0);
+}
+
+static inline double hyper_log_p(const size_t x, const size_t target_n, const size_t bkg_n, const size_t all_hits, const double log_total) {
+  return log_choose(target_n, x) + log_choose(bkg_n, all_hits - x) - log_total;
+}
+
+/* One-sided Fisher's exact test: the probability of the targets having at
+ * least as many sequences with hits, given the total number of sequences with
+ * hits (i.e. the upper tail of the hypergeometric distribution). Terms are
+ * summed away from the mode, relative to the largest one, so that they can't
+ * overflow: below the mode, this is 1 minus the lower tail.
+ */
+double fisher_greater(const size_t target_hits, const size_t target_n, const size_t bkg_hits, const size_t bkg_n) {
+  const size_t all_hits = target_hits + bkg_hits, all_n = target_n + bkg_n;
+  const size_t min_hits = all_hits > bkg_n ? all_hits - bkg_n : 0;
+  const size_t max_hits = MIN(all_hits, target_n);
+  const size_t mode = (size_t) (((double) all_hits + 1.0) * ((double) target_n + 1.0) /
+    ((double) all_n + 2.0));
+  const double log_total = log_choose(all_n, all_hits);
+  if (target_hits <= min_hits) return 1.0;
+  double log_first, sum = 0.0;
+  if (target_hits >= mode) {
+    log_first = hyper_log_p(target_hits, target_n, bkg_n, all_hits, log_total);
+    for (size_t x = target_hits; x <= max_hits; x++) {
+      const double log_p = hyper_log_p(x, target_n, bkg_n, all_hits, log_total);
+      sum += exp(log_p - log_first);
+      if (log_p - log_first < -40.0) break;
+    }
+    return MIN(1.0, exp(log_first) * sum);
+  }
+  log_first = hyper_log_p(target_hits - 1, target_n, bkg_n, all_hits, log_total);
+  for (size_t x = target_hits; x-- > min_hits;) {
+    const double log_p = hyper_log_p(x, target_n, bkg_n, all_hits, log_total);
+    sum += exp(log_p - log_first);
+    if (log_p - log_first < -40.0) break;
+  }
+  return MAX(0.0, 1.0 - exp(log_first) * sum);
+}
+
+int cmp_pvalues_desc(const void *a, const void *b) {
+  const double pa = **((const double **) a), pb = **((const double **) b);
+  return (pa < pb) - (pa > pb);
+}
+
+void print_enrichment(void) {
+  const size_t target_n = seq_info.n_target, bkg_n = seq_info.n - seq_info.n_target;
+  double *pvalues = malloc(sizeof(double) * motif_info.n);
+  double *qvalues = malloc(sizeof(double) * motif_info.n);
+  double **order = malloc(sizeof(double *) * motif_info.n);
+  if (pvalues == NULL || qvalues == NULL || order == NULL) {
+    badexit("Error: Failed to allocate memory for enrichment results.");
+  }
+  for (size_t i = 0; i < motif_info.n; i++) {
+    pvalues[i] = fisher_greater(enrich_hits[i * 2], target_n,
+      enrich_hits[i * 2 + 1], bkg_n);
+    order[i] = &pvalues[i];
+  }
+  qsort(order, motif_info.n, sizeof(double *), cmp_pvalues_desc);
+  double qvalue_min = 1.0;
+  for (size_t i = 0; i < motif_info.n; i++) {
+    const size_t rank = motif_info.n - i;
+    qvalue_min = MIN(qvalue_min, *order[i] * motif_info.n / rank);
+    qvalues[order[i] - pvalues] = qvalue_min;
+  }
+  fprintf(files.o, "##motif\ttarget_hits\ttarget_seqs\ttarget_pct\tbkg_hits\t"
+    "bkg_seqs\tbkg_pct\tlog2_enrichment\tpvalue\tqvalue\n");
+  for (size_t i = 0; i < motif_info.n; i++) {
+    const size_t target_hits = enrich_hits[i * 2], bkg_hits = enrich_hits[i * 2 + 1];
+    fprintf(files.o, "%s\t%zu\t%zu\t%.2f\t%zu\t%zu\t%.2f\t%.3f\t%.9g\t%.9g\n",
+      motifs[i]->name,
+      target_hits, target_n, 100.0 * target_hits / target_n,
+      bkg_hits, bkg_n, 100.0 * bkg_hits / bkg_n,
+      log2((100.0 * target_hits / target_n + 1.0) / (100.0 * bkg_hits / bkg_n + 1.0)),
+      pvalues[i], qvalues[i]);
+  }
+  free(order);
+  free(qvalues);
+  free(pvalues);
+}
+
+/* For --shuffle, the real sequences are scanned first as usual (one motif per
+ * thread) to set the thresholds and count the real hits. Afterwards every
+ * thread takes whole sequences, shuffles each one and scans the copy with all
+ * motifs, so that every shuffle is only made once. Shuffles preserving k-mer
+ * counts are made by picking a random Eulerian path through the graph of
+ * (k-1)-mers (Altschul and Erickson 1985; Kandel et al. 1996).
+ */
+size_t *shuffle_hits;                    /* Real and shuffled hits per motif */
+pthread_mutex_t shuffle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct shuffle_buf_t {
+  unsigned char *seq;                    /* The shuffled copy */
+  unsigned char *codes;
+  unsigned char *edges;                  /* Letters following each (k-1)-mer */
+  size_t        *starts;
+  size_t        *next;
+  size_t        *last;                   /* Edge to leave each (k-1)-mer by */
+  unsigned char *in_tree;
+} shuffle_buf_t;
+
+static inline uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static inline size_t rand_below(uint64_t *state, const size_t n) {
+  return (size_t) (((unsigned __int128) splitmix64(state) * n) >> 64);
+}
+
+static inline size_t kmer_vertices(void) {
+  return (size_t) 1 << (2 * (args.kmer - 1));
+}
+
+int alloc_shuffle_buf(shuffle_buf_t *buf, const size_t max_size) {
+  const size_t n = kmer_vertices();
+  buf->seq = malloc(max_size + 1);
+  buf->codes = malloc(max_size + 1);
+  buf->edges = malloc(max_size + 1);
+  buf->starts = malloc(sizeof(size_t) * (n + 1));
+  buf->next = malloc(sizeof(size_t) * n);
+  buf->last = malloc(sizeof(size_t) * n);
+  buf->in_tree = malloc(n);
+  if (buf->seq == NULL || buf->codes == NULL || buf->edges == NULL || buf->starts == NULL ||
+      buf->next == NULL || buf->last == NULL || buf->in_tree == NULL) {
+    note_error("Error: Failed to allocate memory for shuffling.");
+    return 1;
+  }
+  return 0;
+}
+
+void free_shuffle_buf(shuffle_buf_t *buf) {
+  free(buf->seq);
+  free(buf->codes);
+  free(buf->edges);
+  free(buf->starts);
+  free(buf->next);
+  free(buf->last);
+  free(buf->in_tree);
+}
+
+static inline void shuffle_letters(unsigned char *letters, const size_t n, uint64_t *state) {
+  for (size_t i = n; i > 1; i--) {
+    const size_t j = rand_below(state, i);
+    const unsigned char tmp = letters[i - 1];
+    letters[i - 1] = letters[j];
+    letters[j] = tmp;
+  }
+}
+
+/* Shuffles a stretch of standard letters (as 0-3) into out. */
+void shuffle_segment(shuffle_buf_t *buf, const unsigned char *in, unsigned char *out, const size_t len, uint64_t *state) {
+  const size_t k = args.kmer;
+  if (k == 1) {
+    memcpy(out, in, len);
+    shuffle_letters(out, len, state);
+    return;
+  } else if (len <= k) {
+    memcpy(out, in, len);
+    return;
+  }
+  const size_t n = kmer_vertices(), mask = n - 1;
+  size_t first = 0, v;
+  for (size_t i = 0; i < k - 1; i++) first = (first << 2) | in[i];
+  memset(buf->starts, 0, sizeof(size_t) * (n + 1));
+  v = first;
+  for (size_t i = k - 1; i < len; i++) {
+    buf->starts[v + 1]++;
+    v = ((v << 2) | in[i]) & mask;
+  }
+  const size_t end = v;
+  for (size_t i = 0; i < n; i++) buf->starts[i + 1] += buf->starts[i];
+  memcpy(buf->next, buf->starts, sizeof(size_t) * n);
+  v = first;
+  for (size_t i = k - 1; i < len; i++) {
+    buf->edges[buf->next[v]++] = in[i];
+    v = ((v << 2) | in[i]) & mask;
+  }
+  /* Random last exits forming a tree towards the end (Wilson's algorithm) */
+  memset(buf->in_tree, 0, n);
+  buf->in_tree[end] = 1;
+  for (size_t u = 0; u < n; u++) {
+    if (buf->in_tree[u] || buf->starts[u] == buf->starts[u + 1]) continue;
+    for (v = u; !buf->in_tree[v]; ) {
+      buf->last[v] = rand_below(state, buf->starts[v + 1] - buf->starts[v]);
+      v = ((v << 2) | buf->edges[buf->starts[v] + buf->last[v]]) & mask;
+    }
+    for (v = u; !buf->in_tree[v]; ) {
+      buf->in_tree[v] = 1;
+      v = ((v << 2) | buf->edges[buf->starts[v] + buf->last[v]]) & mask;
+    }
+  }
+  for (v = 0; v < n; v++) {
+    unsigned char *edges = buf->edges + buf->starts[v];
+    size_t deg = buf->starts[v + 1] - buf->starts[v];
+    if (!deg) continue;
+    if (v != end) {
+      const unsigned char tmp = edges[deg - 1];
+      edges[deg - 1] = edges[buf->last[v]];
+      edges[buf->last[v]] = tmp;
+      deg--;
+    }
+    shuffle_letters(edges, deg, state);
+  }
+  memcpy(out, in, k - 1);
+  memcpy(buf->next, buf->starts, sizeof(size_t) * n);
+  v = first;
+  for (size_t i = k - 1; i < len; i++) {
+    out[i] = buf->edges[buf->next[v]++];
+    v = ((v << 2) | out[i]) & mask;
+  }
+}
+
+/* The shuffles only depend on the seed, sequence and shuffle number. */
+void shuffle_seq(shuffle_buf_t *buf, const size_t seq_i, const size_t shuffle_i) {
+  const unsigned char *seq = seqs[seq_i];
+  const size_t seq_size = seq_sizes[seq_i];
+  uint64_t state = args.seed;
+  state ^= splitmix64(&state) + seq_i;
+  state ^= splitmix64(&state) + shuffle_i;
+  for (size_t i = 0; i < seq_size; ) {
+    if (char2index[seq[i]] > 3) {
+      buf->seq[i] = seq[i];
+      i++;
+      continue;
+    }
+    size_t j = i;
+    for (; j < seq_size && char2index[seq[j]] < 4; j++) {
+      buf->codes[j] = char2index[seq[j]];
+    }
+    shuffle_segment(buf, buf->codes + i, buf->seq + i, j - i, &state);
+    for (; i < j; i++) buf->seq[i] = "ACGT"[buf->seq[i]];
+  }
+}
+
+size_t count_seq_hits(const motif_t *motif, const unsigned char *seq, const size_t seq_size) {
+  if (seq_size < motif->size || motif->threshold == INT_MAX) return 0;
+  const int threshold = motif->threshold - 1;
+  int score = INT_MIN, score_rc = INT_MIN;
+  size_t n = 0;
+  if (args.scan_rc) {
+    for (size_t i = 0; i <= seq_size - motif->size; i++) {
+      score_subseq_rc(motif, seq, i, &score, &score_rc);
+      n += (score > threshold) + (score_rc > threshold);
+    }
+  } else {
+    for (size_t i = 0; i <= seq_size - motif->size; i++) {
+      score_subseq(motif, seq, i, &score);
+      n += score > threshold;
+    }
+  }
+  return n;
+}
+
+/* For --track, every motif gets one memory-mapped .npy file per strand which
+ * scores are written straight into, at the offset of the sequence in the
+ * joined sequences. Only the files of the motifs currently being scanned are
+ * kept mapped (one per thread).
+ */
+typedef struct track_t {
+  unsigned char *map[2];
+  size_t         map_size;
+  void          *scores[2];
+} track_t;
+
+track_t *tracks;
+size_t  *seq_offsets;
+
+static inline size_t track_el_size(void) {
+  return args.track_int ? sizeof(int32_t) : sizeof(uint16_t);
+}
+
+int alloc_tracks(void) {
+  tracks = calloc(args.nthreads, sizeof(track_t));
+  seq_offsets = malloc(sizeof(size_t) * (seq_info.n + 1));
+  if (tracks == NULL || seq_offsets == NULL) {
+    note_error("Error: Failed to allocate memory for score tracks.");
+    return 1;
+  }
+  seq_offsets[0] = 0;
+  for (size_t i = 0; i < seq_info.n; i++) {
+    seq_offsets[i + 1] = seq_offsets[i] + seq_sizes[i];
+  }
+  return 0;
+}
+
+void free_tracks(void) {
+  free(tracks);
+  free(seq_offsets);
+}
+
+void print_track_offsets(void) {
+  fprintf(files.o, "##seqname\toffset\tsize\n");
+  for (size_t i = 0; i < seq_info.n; i++) {
+    fprintf(files.o, "%s\t%zu\t%zu\n", seq_names[i], seq_offsets[i], seq_sizes[i]);
+  }
+}
+
+static inline char track_name_char(const unsigned char c) {
+  return isalnum(c) || c == '-' || c == '.' ? c : '_';
+}
+
+/* Whether another motif's name gives the same file name. */
+int track_name_clashes(const motif_t *motif) {
+  for (size_t i = 0; i < motif_info.n; i++) {
+    if (i == motif->index) continue;
+    const char *a = motif->name, *b = motifs[i]->name;
+    while (*a != '\0' && *b != '\0' && track_name_char(*a) == track_name_char(*b)) {
+      a++;
+      b++;
+    }
+    if (*a == '\0' && *b == '\0') return 1;
+  }
+  return 0;
+}
+
+int open_track(const motif_t *motif) {
+  track_t *track = &tracks[motif->thread];
+  const size_t n_bases = seq_offsets[seq_info.n];
+  const int clashes = track_name_clashes(motif);
+  char file_name[4096];
+  for (size_t s = 0; s < (args.scan_rc ? 2 : 1); s++) {
+    int len = snprintf(file_name, sizeof(file_name), "%s", args.track);
+    for (size_t i = 0; motif->name[i] != '\0' && len < sizeof(file_name) - 32; i++) {
+      file_name[len++] = track_name_char(motif->name[i]);
+    }
+    if (clashes) len += snprintf(file_name + len, sizeof(file_name) - len, "_%zu", motif->index + 1);
+    snprintf(file_name + len, sizeof(file_name) - len, s ? ".rev.npy" : ".fwd.npy");
+    FILE *f = fopen(file_name, "w+b");
+    if (f == NULL) {
+      note_error("Error: Failed to create track file: %s", file_name);
+      return 1;
+    }
+    if (write_npy_header(f, args.track_int ? "i4" : "f2", &n_bases, 1) || fflush(f)) {
+      note_error("Error: Failed to write track file: %s", file_name);
+      fclose(f);
+      return 1;
+    }
+    const size_t header_size = ftell(f);
+    track->map_size = header_size + n_bases * track_el_size();
+    if (ftruncate(fileno(f), track->map_size)) {
+      note_error("Error: Failed to resize track file: %s", file_name);
+      fclose(f);
+      return 1;
+    }
+    track->map[s] = mmap(NULL, track->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(f), 0);
+    fclose(f);
+    if (track->map[s] == MAP_FAILED) {
+      note_error("Error: Failed to map track file: %s", file_name);
+      return 1;
+    }
+    track->scores[s] = track->map[s] + header_size;
+  }
+  return 0;
+}
+
+void close_track(const motif_t *motif) {
+  track_t *track = &tracks[motif->thread];
+  for (size_t s = 0; s < (args.scan_rc ? 2 : 1); s++) {
+    munmap(track->map[s], track->map_size);
+  }
+}
+
+/* Round to nearest even, with overflow to infinity. Scores are never NaN. */
+static inline uint16_t score2half(const int score) {
+  const float x = score / PWM_INT_MULTIPLIER;
+  uint32_t f;
+  memcpy(&f, &x, sizeof(f));
+  const uint16_t sign = (f >> 16) & 0x8000;
+  const int exponent = ((f >> 23) & 0xFF) - 127 + 15;
+  uint32_t mantissa = f & 0x7FFFFF;
+  if (exponent >= 31) return sign | 0x7C00;
+  if (exponent <= 0) {
+    if (exponent < -10) return sign;
+    mantissa |= 0x800000;
+    const int shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1U << shift) - 1), mid = 1U << (shift - 1);
+    if (rest > mid || (rest == mid && (half & 1))) half++;
+    return sign | half;
+  }
+  uint32_t half = ((uint32_t) exponent << 10) | (mantissa >> 13);
+  const uint32_t rest = mantissa & 0x1FFF;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+  return half >= 0x7C00 ? sign | 0x7C00 : sign | half;
+}
+
+#define TRACK_MISSING_F16                 0x7E00
+#define TRACK_MISSING_I32              INT32_MIN
+
+void score_seq_track(const motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+  const track_t *track = &tracks[motif->thread];
+  const unsigned char *seq = seqs[seq_loc];
+  const size_t seq_size = seq_sizes[seq_i], offset = seq_offsets[seq_i];
+  const size_t n_windows = seq_size >= motif->size ? seq_size - motif->size + 1 : 0;
+  int score, score_rc;
+  if (args.track_int) {
+    int32_t *fwd = (int32_t *) track->scores[0] + offset;
+    int32_t *rev = args.scan_rc ? (int32_t *) track->scores[1] + offset : NULL;
+    for (size_t i = 0; i < n_windows; i++) {
+      if (args.scan_rc) {
+        score_subseq_rc(motif, seq, i, &score, &score_rc);
+        rev[i] = score_rc;
+      } else {
+        score_subseq(motif, seq, i, &score);
+      }
+      fwd[i] = score;
+    }
+    for (size_t i = n_windows; i < seq_size; i++) {
+      fwd[i] = TRACK_MISSING_I32;
+      if (args.scan_rc) rev[i] = TRACK_MISSING_I32;
+    }
+  } else {
+    uint16_t *fwd = (uint16_t *) track->scores[0] + offset;
+    uint16_t *rev = args.scan_rc ? (uint16_t *) track->scores[1] + offset : NULL;
+    for (size_t i = 0; i < n_windows; i++) {
+      if (args.scan_rc) {
+        score_subseq_rc(motif, seq, i, &score, &score_rc);
+        rev[i] = score2half(score_rc);
+      } else {
+        score_subseq(motif, seq, i, &score);
+      }
+      fwd[i] = score2half(score);
+    }
+    for (size_t i = n_windows; i < seq_size; i++) {
+      fwd[i] = TRACK_MISSING_F16;
+      if (args.scan_rc) rev[i] = TRACK_MISSING_F16;
+    }
+  }
+}
+
+/* For --bins, every thread has an array for the bins of one sequence, which
+ * is written out as soon as the sequence has been scanned. With multiple
+ * threads every thread writes to its own temporary file, which are copied to
+ * the output in motif order at the end.
+ */
+double **bin_values;
+FILE   **bin_files;
+long    *bin_spans;                      /* Start and size of each motif */
+
+static inline size_t seq_bin_count(const size_t seq_size) {
+  return (seq_size + args.bin_size - 1) / args.bin_size;
+}
+
+size_t count_bins(void) {
+  size_t n = 0;
+  for (size_t i = 0; i < seq_info.n; i++) n += seq_bin_count(seq_sizes[i]);
+  return n;
+}
+
+int alloc_bins(void) {
+  size_t max_bins = 1;
+  for (size_t i = 0; i < seq_info.n; i++) {
+    max_bins = MAX(max_bins, seq_bin_count(seq_sizes[i]));
+  }
+  bin_values = calloc(args.nthreads, sizeof(double *));
+  bin_files = calloc(args.nthreads, sizeof(FILE *));
+  bin_spans = calloc(motif_info.n * 2, sizeof(long));
+  if (bin_values == NULL || bin_files == NULL || bin_spans == NULL) {
+    note_error("Error: Failed to allocate memory for bins.");
+    return 1;
+  }
+  for (size_t i = 0; i < args.nthreads; i++) {
+    bin_values[i] = malloc(sizeof(double) * max_bins);
+    if (bin_values[i] == NULL) {
+      note_error("Error: Failed to allocate memory for bins.");
+      return 1;
+    }
+    if (args.nthreads == 1) {
+      bin_files[i] = files.o;
+    } else {
+      bin_files[i] = open_tmp_file();
+      if (bin_files[i] == NULL) {
+        note_error("Error: Failed to create temporary file for bins.");
+        return 1;
+      }
+    }
+  }
+  if (args.binary) {
+    const size_t shape[2] = { motif_info.n, count_bins() };
+    if (write_npy_header(files.o, "f4", shape, 2)) {
+      note_error("Error: Failed to write bins.");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void free_bins(void) {
+  for (size_t i = 0; i < args.nthreads; i++) {
+    free(bin_values[i]);
+    if (args.nthreads > 1) fclose(bin_files[i]);
+  }
+  free(bin_values);
+  free(bin_files);
+  free(bin_spans);
+}
+
+void start_bins(const motif_t *motif) {
+  FILE *out = bin_files[motif->thread];
+  bin_spans[motif->index * 2] = ftell(out);
+  if (!args.binary) {
+    fprintf(out, "track type=bedGraph name=\"%s\"\n", motif->name);
+  }
+}
+
+void finish_bins(const motif_t *motif) {
+  bin_spans[motif->index * 2 + 1] = ftell(bin_files[motif->thread]) -
+    bin_spans[motif->index * 2];
+}
+
+void print_bins(void) {
+  char buf[65536];
+  if (args.nthreads == 1) return;
+  for (size_t i = 0; i < motif_info.n; i++) {
+    FILE *in = bin_files[motifs[i]->thread];
+    long left = bin_spans[i * 2 + 1];
+    fseek(in, bin_spans[i * 2], SEEK_SET);
+    while (left > 0) {
+      const size_t n = fread(buf, 1, MIN(left, (long) sizeof(buf)), in);
+      if (!n) badexit("Error: Failed to read temporary bin file.");
+      fwrite(buf, 1, n, files.o);
+      left -= n;
+    }
+  }
+}
+
+void write_seq_bins(const motif_t *motif, const size_t seq_i, const double *values, const size_t n_bins) {
+  FILE *out = bin_files[motif->thread];
+  if (args.binary) {
+    for (size_t i = 0; i < n_bins; i++) {
+      const float value = values[i] == -INFINITY ? NAN : values[i];
+      fwrite(&value, sizeof(float), 1, out);
+    }
+    return;
+  }
+  const size_t seq_size = seq_sizes[seq_i];
+  for (size_t i = 0; i < n_bins; i++) {
+    if ((args.bin_stat == BIN_COUNT && values[i] == 0.0) || values[i] == -INFINITY) {
+      continue;
+    }
+    fprintf(out, "%s\t%zu\t%zu\t", seq_names[seq_i], i * args.bin_size,
+      MIN((i + 1) * args.bin_size, seq_size));
+    switch (args.bin_stat) {
+      case BIN_COUNT:     fprintf(out, "%.0f\n", values[i]); break;
+      case BIN_MAX:       fprintf(out, "%.3f\n", values[i]); break;
+      case BIN_OCCUPANCY: fprintf(out, "%.6g\n", values[i]); break;
+    }
+  }
+}
+
+static inline void add_to_bin(double *value, const int score, const int threshold) {
+  switch (args.bin_stat) {
+    case BIN_COUNT:
+      *value += score > threshold;
+      break;
+    case BIN_MAX:
+      *value = MAX(*value, score / PWM_INT_MULTIPLIER);
+      break;
+    case BIN_OCCUPANCY:
+      *value += score2odds(score);
+      break;
+  }
+}
+
+void score_seq_bins(const motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+  const unsigned char *seq = seqs[seq_loc];
+  const size_t seq_size = seq_sizes[seq_i], n_bins = seq_bin_count(seq_size);
+  double *values = bin_values[motif->thread];
+  const int threshold = motif->threshold == INT_MAX ? INT_MAX : motif->threshold - 1;
+  int score, score_rc;
+  for (size_t i = 0; i < n_bins; i++) {
+    values[i] = args.bin_stat == BIN_MAX ? -INFINITY : 0.0;
+  }
+  if (seq_size >= motif->size) {
+    for (size_t i = 0; i <= seq_size - motif->size; i++) {
+      double *value = &values[i / args.bin_size];
+      if (args.scan_rc) {
+        score_subseq_rc(motif, seq, i, &score, &score_rc);
+        add_to_bin(value, score_rc, threshold);
+      } else {
+        score_subseq(motif, seq, i, &score);
+      }
+      add_to_bin(value, score, threshold);
+    }
+  }
+  write_seq_bins(motif, seq_i, values, n_bins);
+}
+
+/* Scans the windows starting from first to last (inclusive). */
+void score_seq_range(motif_t *motif, overlap_buf_t *overlaps, const size_t seq_i, const unsigned char *seq, const size_t first, const size_t last) {
+  const int threshold = motif->threshold - 1;
+  int score = INT_MIN, score_rc = INT_MIN;
+  if (motif->bounded && args.scan_rc) {
+    for (size_t i = first; i <= last; i++) {
+      score_subseq_rc_bound(motif, seq, i, threshold, &score, &score_rc);
+      if (__builtin_expect(score > threshold, 0)) {
+        found_hit(motif, overlaps, seq_i, seq, i, score, '+');
+      }
+      if (__builtin_expect(score_rc > threshold, 0)) {
+        found_hit(motif, overlaps, seq_i, seq, i, score_rc, '-');
+      }
+    }
+  } else if (motif->bounded) {
+    for (size_t i = first; i <= last; i++) {
+      score_subseq_bound(motif, seq, i, threshold, &score);
+      if (__builtin_expect(score > threshold, 0)) {
+        found_hit(motif, overlaps, seq_i, seq, i, score, '+');
+      }
+    }
+  } else if (args.scan_rc) {
+    for (size_t i = first; i <= last; i++) {
+      score_subseq_rc(motif, seq, i, &score, &score_rc);
+      if (__builtin_expect(score > threshold, 0)) {
+        found_hit(motif, overlaps, seq_i, seq, i, score, '+');
+      }
+      if (__builtin_expect(score_rc > threshold, 0)) {
+        found_hit(motif, overlaps, seq_i, seq, i, score_rc, '-');
+      }
+    }
+  } else {
+    for (size_t i = first; i <= last; i++) {
+      score_subseq(motif, seq, i, &score);
+      if (__builtin_expect(score > threshold, 0)) {
+        found_hit(motif, overlaps, seq_i, seq, i, score, '+');
+      }
+    }
+  }
+}
+
+/* For --vcf, variants are sorted by sequence so that score_seq() can simply
+ * score those of the current sequence. Only the flanks needed by windows
+ * overlapping a variant are ever scored.
+ */
+typedef struct variant_t {
+  size_t  seq_i;
+  size_t  pos;                           /* 0-based */
+  char   *id;
+  char   *ref;
+  char   *alt;
+  size_t  ref_size;
+  size_t  alt_size;
+} variant_t;
+
+variant_t *variants;
+size_t     n_variants;
+size_t    *seq_variants;                 /* First variant of every sequence */
+size_t     max_allele_size;
+
+int cmp_seq_name_indices(const void *a, const void *b) {
+  return strcmp(seq_names[*((const size_t *) a)], seq_names[*((const size_t *) b)]);
+}
+
+size_t find_seq_index(const size_t *sorted, const char *name) {
+  size_t lo = 0, hi = seq_info.n;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const int cmp = strcmp(seq_names[sorted[mid]], name);
+    if (!cmp) return sorted[mid];
+    if (cmp < 0) lo = mid + 1; else hi = mid;
+  }
+  return seq_info.n;
+}
+
+int cmp_variants(const void *a, const void *b) {
+  const variant_t *va = (const variant_t *) a, *vb = (const variant_t *) b;
+  if (va->seq_i != vb->seq_i) return (va->seq_i > vb->seq_i) - (va->seq_i < vb->seq_i);
+  return (va->pos > vb->pos) - (va->pos < vb->pos);
+}
+
+int ref_allele_matches(const variant_t *variant) {
+  const unsigned char *seq = seqs[variant->seq_i];
+  if (variant->pos + variant->ref_size > seq_sizes[variant->seq_i]) return 0;
+  for (size_t i = 0; i < variant->ref_size; i++) {
+    if (toupper(seq[variant->pos + i]) != toupper(variant->ref[i])) return 0;
+  }
+  return 1;
+}
+
+int add_variant(const variant_t *variant) {
+  if (n_variants % ALLOC_CHUNK_SIZE == 0) {
+    variant_t *tmp = realloc(variants, sizeof(variant_t) * (n_variants + ALLOC_CHUNK_SIZE));
+    if (tmp == NULL) return 1;
+    variants = tmp;
+  }
+  variants[n_variants] = *variant;
+  variants[n_variants].id = strdup(variant->id);
+  variants[n_variants].ref = strdup(variant->ref);
+  variants[n_variants].alt = strdup(variant->alt);
+  n_variants++;
+  return 0;
+}
+
+void load_variants(void) {
+  size_t skipped_seq = 0, skipped_ref = 0, skipped_alt = 0, line_num = 0;
+  size_t *sorted = malloc(sizeof(size_t) * seq_info.n);
+  if (sorted == NULL) badexit("Error: Failed to allocate memory for variants.");
+  for (size_t i = 0; i < seq_info.n; i++) sorted[i] = i;
+  qsort(sorted, seq_info.n, sizeof(size_t), cmp_seq_name_indices);
+  kstream_t *ks = ks_init(files.v);
+  kstring_t line = { 0, 0, NULL };
+  int dret;
+  while (ks_getuntil(ks, KS_SEP_LINE, &line, &dret) >= 0) {
+    line_num++;
+    if (!line.l || line.s[0] == '#') continue;
+    char *fields[5], *save = NULL;
+    size_t n_fields = 0;
+    for (char *f = strtok_r(line.s, "\t", &save); f != NULL && n_fields < 5; f = strtok_r(NULL, "\t", &save)) {
+      fields[n_fields++] = f;
+    }
+    if (n_fields < 5 || atol(fields[1]) < 1) {
+      badexitf("Error: Failed to parse VCF line #%zu.", line_num);
+    }
+    variant_t variant;
+    variant.seq_i = find_seq_index(sorted, fields[0]);
+    variant.pos = atol(fields[1]) - 1;
+    variant.id = fields[2];
+    variant.ref = fields[3];
+    variant.ref_size = strlen(fields[3]);
+    if (variant.seq_i == seq_info.n) {
+      skipped_seq++;
+      continue;
+    } else if (!ref_allele_matches(&variant)) {
+      skipped_ref++;
+      continue;
+    }
+    char *alt_save = NULL;
+    for (char *alt = strtok_r(fields[4], ",", &alt_save); alt != NULL; alt = strtok_r(NULL, ",", &alt_save)) {
+      if (strpbrk(alt, "<>[]*.") != NULL) {
+        skipped_alt++;
+        continue;
+      }
+      variant.alt = alt;
+      variant.alt_size = strlen(alt);
+      if (add_variant(&variant)) badexit("Error: Failed to allocate memory for variants.");
+      max_allele_size = MAX(max_allele_size, MAX(variant.ref_size, variant.alt_size));
+    }
+  }
+  free(line.s);
+  ks_destroy(ks);
+  free(sorted);
+  qsort(variants, n_variants, sizeof(variant_t), cmp_variants);
+  seq_variants = malloc(sizeof(size_t) * (seq_info.n + 1));
+  if (seq_variants == NULL) badexit("Error: Failed to allocate memory for variants.");
+  for (size_t i = 0, j = 0; i <= seq_info.n; i++) {
+    while (j < n_variants && variants[j].seq_i < i) j++;
+    seq_variants[i] = j;
+  }
+  if (args.v) {
+    fprintf(stderr, "Loaded %'zu variant(s).\n", n_variants);
+    if (skipped_seq) {
+      fprintf(stderr, "    Skipped %'zu on unknown sequences.\n", skipped_seq);
+    }
+    if (skipped_ref) {
+      fprintf(stderr, "    Skipped %'zu not matching the reference.\n", skipped_ref);
+    }
+    if (skipped_alt) {
+      fprintf(stderr, "    Skipped %'zu symbolic/missing alleles.\n", skipped_alt);
+    }
+  }
+}
+
+void free_variants(void) {
+  for (size_t i = 0; i < n_variants; i++) {
+    free(variants[i].id);
+    free(variants[i].ref);
+    free(variants[i].alt);
+  }
+  free(variants);
+  free(seq_variants);
+}
+
+/* Best score of any window in the context (INT_MIN if too short). */
+int best_window_score(const motif_t *motif, const unsigned char *context, const size_t size) {
+  int best = INT_MIN, score, score_rc;
+  if (size < motif->size) return best;
+  for (size_t i = 0; i <= size - motif->size; i++) {
+    if (args.scan_rc) {
+      score_subseq_rc(motif, context, i, &score, &score_rc);
+      best = MAX(best, score_rc);
+    } else {
+      score_subseq(motif, context, i, &score);
+    }
+    best = MAX(best, score);
+  }
+  return best;
+}
+
+static inline double score2pval_any(const motif_t *motif, const int score) {
+  return score <= motif->cdf_offset ? 1.0 : score2pval(motif, score);
+}
+
+void score_seq_variants(const motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+  const unsigned char *seq = seqs[seq_loc];
+  const size_t seq_size = seq_sizes[seq_i], flank = motif->size - 1;
+  if (motif->threshold == INT_MAX || seq_variants[seq_i] == seq_variants[seq_i + 1]) return;
+  const int threshold = motif->threshold - 1;
+  unsigned char *context = malloc(flank * 2 + max_allele_size);
+  if (context == NULL) badexit("Error: Failed to allocate memory for variant scanning.");
+  for (size_t i = seq_variants[seq_i]; i < seq_variants[seq_i + 1]; i++) {
+    const variant_t *variant = &variants[i];
+    const size_t left = variant->pos >= flank ? variant->pos - flank : 0;
+    const size_t right = MIN(variant->pos + variant->ref_size + flank, seq_size);
+    const size_t left_size = variant->pos - left;
+    const size_t right_size = right - variant->pos - variant->ref_size;
+    const int ref_score = best_window_score(motif, seq + left, right - left);
+    memcpy(context, seq + left, left_size);
+    memcpy(context + left_size, variant->alt, variant->alt_size);
+    memcpy(context + left_size + variant->alt_size,
+      seq + variant->pos + variant->ref_size, right_size);
+    const int alt_score = best_window_score(motif, context,
+      left_size + variant->alt_size + right_size);
+    if (ref_score <= threshold && alt_score <= threshold) continue;
+    const double ref_pvalue = score2pval_any(motif, ref_score);
+    const double alt_pvalue = score2pval_any(motif, alt_score);
+    fprintf(files.o, "%s\t%zu\t%s\t%s\t%s\t%s\t%.3f\t%.3f\t%.3f\t%.9g\t%.9g\t%.3f\n",
+      seq_names[seq_i], variant->pos + 1, variant->id, variant->ref, variant->alt,
+      motif->name, ref_score / PWM_INT_MULTIPLIER, alt_score / PWM_INT_MULTIPLIER,
+      (alt_score - ref_score) / PWM_INT_MULTIPLIER, ref_pvalue, alt_pvalue,
+      log10(alt_pvalue) - log10(ref_pvalue));
+  }
+  free(context);
+}
+
+/* Windows starting in a block which fit in the sequence (per strand). */
+static inline size_t block_windows(const motif_t *motif, const size_t seq_i, const size_t start) {
+  if (seq_sizes[seq_i] < motif->size || start > seq_sizes[seq_i] - motif->size) return 0;
+  return MIN(start + SAMPLE_BLOCK_SIZE, seq_sizes[seq_i] - motif->size + 1) - start;
+}
+
+void score_seq_sample(motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+  const unsigned char *seq = seqs[seq_loc];
+  const sample_blocks_t *blocks = &sample_blocks[seq_i];
+  if (motif->threshold == INT_MAX) return;
+  overlap_buf_t *overlaps = get_overlap_buf(motif);
+  for (size_t i = 0; i < blocks->n; i++) {
+    const size_t n_windows = block_windows(motif, seq_i, blocks->starts[i]);
+    if (!n_windows) continue;
+    sample_block_i[motif->thread] = blocks->first + i;
+    score_seq_range(motif, overlaps, seq_i, seq, blocks->starts[i],
+      blocks->starts[i] + n_windows - 1);
+    if (args.no_overlap) overlap_buf_flush(motif, overlaps, seq_i, seq, SIZE_MAX);
+  }
+}
+
+/* The next range of starts to scan at for --anchor, from the i-th window on:
+ * the union of the starts at which the motif fits within a window. Returns
+ * where to continue from, with first > last once there are no more.
+ */
+size_t next_anchor_range(const motif_t *motif, const size_t seq_i, size_t i, size_t *first, size_t *last) {
+  const regions_t *regions = &anchor_regions[seq_i];
+  *first = 1;
+  *last = 0;
+  for (; i < regions->n; i++) {
+    const region_t *region = &regions->regions[i];
+    if (region->end - region->start < motif->size) continue;
+    if (*first > *last) {
+      *first = region->start;
+      *last = region->end - motif->size;
+    } else if (region->start <= *last + 1) {
+      *last = MAX(*last, region->end - motif->size);
+    } else {
+      break;
+    }
+  }
+  return i;
+}
+
+void score_seq_hits(motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+  const unsigned char *seq = seqs[seq_loc];
+  const size_t seq_size = seq_sizes[seq_i];
+  if (seq_size < motif->size || motif->threshold == INT_MAX) return;
+  overlap_buf_t *overlaps = get_overlap_buf(motif);
+  if (anchor_regions != NULL && !motif->anchor) {
+    size_t first, last;
+    for (size_t i = next_anchor_range(motif, seq_i, 0, &first, &last); first <= last;
+        i = next_anchor_range(motif, seq_i, i, &first, &last)) {
+      score_seq_range(motif, overlaps, seq_i, seq, first, last);
+    }
+  } else {
+    score_seq_range(motif, overlaps, seq_i, seq, 0, seq_size - motif->size);
+  }
+  if (args.no_overlap) overlap_buf_flush(motif, overlaps, seq_i, seq, SIZE_MAX);
+}
+
+/* Either replays the hits from the cache, or scans and adds them to it. */
+uint64_t get_seq_hash(const size_t seq_i, const size_t seq_loc) {
+  uint64_t seq_hash = __atomic_load_n(&seq_hashes[seq_i], __ATOMIC_RELAXED);
+  if (!seq_hash) {
+    seq_hash = hash_seq(seqs[seq_loc], seq_sizes[seq_i]);
+    __atomic_store_n(&seq_hashes[seq_i], seq_hash, __ATOMIC_RELAXED);
+  }
+  return seq_hash;
+}
+
+void score_seq_cached(motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+  cache_t *cache = &caches[motif->thread];
+  const unsigned char *seq = seqs[seq_loc];
+  const uint64_t seq_hash = get_seq_hash(seq_i, seq_loc);
+  const cache_entry_t *entry = find_cache_entry(cache, seq_hash, seq_sizes[seq_i]);
+  if (entry != NULL) {
+    const size_t n_hits = entry->n_hits;
+    reserve_cached_hits(cache, n_hits);
+    fseek(cache->file, entry->offset, SEEK_SET);
+    if (fread(cache->hits, sizeof(cached_hit_t), n_hits, cache->file) != n_hits) {
+      badexit("Error: Failed to read from cache file.");
+    }
+    for (size_t i = 0; i < n_hits; i++) {
+      report_hit(motif, seq_i, seq, cache->hits[i].start, cache->hits[i].score,
+        cache->hits[i].strand);
+    }
+    __atomic_fetch_add(&cache_reused, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  cache->n_hits = 0;
+  cache->recording = 1;
+  if (args.best) {
+    score_seq_best(motif, seq_i, seq_loc);
+  } else {
+    score_seq_hits(motif, seq_i, seq_loc);
+  }
+  save_recorded_hits(motif, seq_hash, seq_sizes[seq_i]);
+  __atomic_fetch_add(&cache_scanned, 1, __ATOMIC_RELAXED);
+}
+
+void score_seq(motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+  if (caches != NULL && caches[motif->thread].file != NULL) {
+    score_seq_cached(motif, seq_i, seq_loc);
+    return;
+  } else if (args.sample > 0.0) {
+    score_seq_sample(motif, seq_i, seq_loc);
+    return;
+  } else if (files.v_open) {
+    score_seq_variants(motif, seq_i, seq_loc);
+    return;
+  } else if (args.cooccur) {
+    return;
+  } else if (args.occupancy) {
+    score_seq_occupancy(motif, seq_i, seq_loc);
+    return;
+  } else if (args.bin_size) {
+    score_seq_bins(motif, seq_i, seq_loc);
+    return;
+  } else if (args.track != NULL) {
+    score_seq_track(motif, seq_i, seq_loc);
+    return;
+  } else if (args.shuffle) {
+    shuffle_hits[motif->index * 2] += count_seq_hits(motif, seqs[seq_loc], seq_sizes[seq_i]);
+    return;
+  } else if (args.enrich) {
+    if (seq_has_hit(motif, seq_i, seq_loc)) {
+      enrich_hits[motif->index * 2 + (seq_i >= seq_info.n_target)]++;
+    }
+    return;
+  } else if (args.best) {
+    score_seq_best(motif, seq_i, seq_loc);
+    return;
+  } else if (args.top) {
+    score_seq_top(motif, seq_i, seq_loc);
+    return;
+  }
+  score_seq_hits(motif, seq_i, seq_loc);
+}
+
+int init_score_bins(motif_t *motif) {
+  if (motif->threshold == INT_MAX || motif->threshold > motif->max_score) return 0;
+  const size_t n_bins = motif->max_score - motif->threshold + 1;
+  motif->bins = malloc(sizeof(score_bin_t) * n_bins);
+  if (motif->bins == NULL) {
+    note_error("Error: Failed to allocate memory for [%s] Q-value table.",
+      motif->name);
+    return 1;
+  }
+  for (size_t i = 0; i < n_bins; i++) {
+    motif->bins[i].count = 0;
+    motif->bins[i].pvalue = score2pval(motif, motif->threshold + i);
+    motif->bins[i].qvalue = 1.0;
+  }
+  return 0;
+}
+
+/* Each scanned window (per strand) counts as a test, whether or not the motif
+ * could actually score high enough for a hit there.
+ */
+size_t count_motif_tests(const motif_t *motif) {
+  size_t n_tests = 0;
+  if (!motif->size) return 0;
+  for (size_t i = 0; i < seq_info.n; i++) {
+    if (seq_sizes[i] >= motif->size) n_tests += seq_sizes[i] - motif->size + 1;
+  }
+  return args.scan_rc ? n_tests * 2 : n_tests;
+}
+
+/* Benjamini-Hochberg, with bins going from the largest score (smallest
+ * P-value) down. Different scores can share the same P-value, which is why
+ * the cumulative min is taken afterwards in the other direction.
+ */
+void calc_motif_qvalues(motif_t *motif) {
+  if (motif->bins == NULL) return;
+  const size_t n_bins = motif->max_score - motif->threshold + 1;
+  const double n_tests = count_motif_tests(motif);
+  size_t rank = 0;
+  for (size_t i = n_bins - 1; i < n_bins; i--) {
+    if (!motif->bins[i].count) continue;
+    rank += motif->bins[i].count;
+    motif->bins[i].qvalue = motif->bins[i].pvalue * n_tests / rank;
+  }
+  double qvalue_min = 1.0;
+  for (size_t i = 0; i < n_bins; i++) {
+    if (!motif->bins[i].count) continue;
+    qvalue_min = MIN(qvalue_min, motif->bins[i].qvalue);
+    motif->bins[i].qvalue = qvalue_min;
+  }
+}
+
+/* The empirical FDR is the mean number of hits in a shuffled copy over the
+ * number of real hits.
+ */
+void print_shuffle_stats(void) {
+  fprintf(files.o,
+    "##motif\thits\thit_rate\tshuffled_hits\tshuffled_hit_rate\tfdr\n");
+  for (size_t i = 0; i < motif_info.n; i++) {
+    const size_t n_tests = count_motif_tests(motifs[i]);
+    const double real_hits = shuffle_hits[i * 2];
+    const double shuffled_hits = (double) shuffle_hits[i * 2 + 1] / args.shuffle;
+    double fdr = 0.0;
+    if (shuffled_hits > 0.0) fdr = real_hits > 0.0 ? MIN(1.0, shuffled_hits / real_hits) : 1.0;
+    fprintf(files.o, "%s\t%zu\t%.6g\t%.2f\t%.6g\t%.6g\n", motifs[i]->name,
+      shuffle_hits[i * 2], n_tests ? real_hits / n_tests : 0.0,
+      shuffled_hits, n_tests ? shuffled_hits / n_tests : 0.0, fdr);
+  }
+}
+
+int cmp_bin_pvalues(const void *a, const void *b) {
+  const double pa = (*((const score_bin_t **) a))->pvalue;
+  const double pb = (*((const score_bin_t **) b))->pvalue;
+  return (pa > pb) - (pa < pb);
+}
+
+/* Same as above, but pooling the bins of all motifs. Only bins with at least
+ * one hit are needed, so memory use is bound by the range of scores above the
+ * thresholds and not by the number of hits.
+ */
+void calc_global_qvalues(void) {
+  size_t n_filled = 0, n_tests = 0, rank = 0;
+  for (size_t i = 0; i < motif_info.n; i++) {
+    n_tests += count_motif_tests(motifs[i]);
+    if (motifs[i]->bins == NULL) continue;
+    for (int j = 0; j <= motifs[i]->max_score - motifs[i]->threshold; j++) {
+      if (motifs[i]->bins[j].count) n_filled++;
+    }
+  }
+  if (!n_filled) return;
+  score_bin_t **filled = malloc(sizeof(score_bin_t *) * n_filled);
+  if (filled == NULL) {
+    badexit("Error: Failed to allocate memory for global Q-value table.");
+  }
+  n_filled = 0;
+  for (size_t i = 0; i < motif_info.n; i++) {
+    if (motifs[i]->bins == NULL) continue;
+    for (int j = 0; j <= motifs[i]->max_score - motifs[i]->threshold; j++) {
+      if (motifs[i]->bins[j].count) filled[n_filled++] = &motifs[i]->bins[j];
+    }
+  }
+  qsort(filled, n_filled, sizeof(score_bin_t *), cmp_bin_pvalues);
+  for (size_t i = 0; i < n_filled; i++) {
+    rank += filled[i]->count;
+    filled[i]->qvalue = filled[i]->pvalue * ((double) n_tests) / rank;
+  }
+  double qvalue_min = 1.0;
+  for (size_t i = n_filled - 1; i < n_filled; i--) {
+    qvalue_min = MIN(qvalue_min, filled[i]->qvalue);
+    filled[i]->qvalue = qvalue_min;
+  }
+  free(filled);
+}
+
+void print_spilled_hits(void) {
+  spill_hit_t hit;
+  unsigned char match[MAX_MOTIF_SIZE / 5];
+  if (fflush(files.q) || fseek(files.q, 0, SEEK_SET)) {
+    badexit("Error: Failed to rewind temporary hit file.");
+  }
+  while (fread(&hit, sizeof(spill_hit_t), 1, files.q) == 1) {
+    const motif_t *motif = motifs[hit.motif_i];
+    if (fread(match, 1, motif->size, files.q) != motif->size) {
+      badexit("Error: Failed to read back temporary hit file.");
+    }
+    const score_bin_t *bin = &motif->bins[hit.score - motif->threshold];
+    print_hit_q(motif, seq_names[hit.seq_i], hit.start, hit.strand, hit.score,
+      bin->pvalue, bin->qvalue, match);
+  }
+  if (ferror(files.q)) badexit("Error: Failed to read back temporary hit file.");
+}
+
+void print_seq_stats_single(FILE *whereto, const size_t seq_i, const size_t seq_j) {
+  ERASE_ARRAY(char_counts, 256);
+  count_bases_single(seqs[seq_i], seq_sizes[seq_j]);
+  fprintf(whereto, "%zu\t%s\t", seq_j + 1, seq_names[seq_j]);
+  fprintf(whereto, "%zu\t", seq_sizes[seq_j]);
+  if (!seq_sizes[seq_j]) {
+    fprintf(whereto, "nan\t");
+  } else {
+    fprintf(whereto, "%.2f\t", calc_gc() * 100.0);
+  }
+  fprintf(whereto, "%zu\n", seq_sizes[seq_j] - standard_base_count());
+}
+
+void print_seq_stats(FILE *whereto) {
+  for (size_t i = 0; i < seq_info.n; i++) {
+    ERASE_ARRAY(char_counts, 256);
+    count_bases_single(seqs[i], seq_sizes[i]);
+    fprintf(whereto, "%zu\t%s\t", i + 1, seq_names[i]);
+    fprintf(whereto, "%zu\t", seq_sizes[i]);
+    if (!seq_sizes[i]) {
+      fprintf(whereto, "nan\t");
+    } else {
+      fprintf(whereto, "%.2f\t", calc_gc() * 100.0);
+    }
+    fprintf(whereto, "%zu\n", seq_sizes[i] - standard_base_count());
+  }
+}
+
+void add_consensus_motif(const char *consensus) {
+  if (add_motif()) badexit("");
+  ERASE_ARRAY(motifs[0]->name, MAX_NAME_SIZE);
+  size_t i = 0;
+  for (;;) {
+    motifs[0]->name[i] = consensus[i];
+    if (consensus[i] == '\0') {
+      motifs[0]->size = i;
+      break;
+    }
+    i++;
+  }
+  motifs[0]->name[i] = '\0';
+  if (motifs[0]->size > MAX_MOTIF_SIZE / 5) {
+    note_error("Error: Consensus sequence is too large (%zu>max=%zu).",
+      motifs[0]->size, MAX_MOTIF_SIZE / 5);
+  }
+  size_t let_i;
+  for (size_t pos = 0; pos < motifs[0]->size; pos++) {
+    let_i = consensus2index[(unsigned char) consensus[pos]];
+    if (let_i == -1) {
+      badexitf("Error: Encountered unknown letter in consensus (%c).",
+        consensus[pos]);
+    }
+    set_score(motifs[0], 'A', pos,
+      calc_score(consensus2probs[let_i * 4 + 0], args.bkg[0]));
+    set_score(motifs[0], 'C', pos,
+      calc_score(consensus2probs[let_i * 4 + 1], args.bkg[1]));
+    set_score(motifs[0], 'G', pos,
+      calc_score(consensus2probs[let_i * 4 + 2], args.bkg[2]));
+    set_score(motifs[0], 'T', pos,
+      calc_score(consensus2probs[let_i * 4 + 3], args.bkg[3]));
+  }
+  complete_motifs();
+}
+
+void print_pb(const double prog) {
+  const int left = prog * PROGRESS_BAR_WIDTH;
+  const int right = PROGRESS_BAR_WIDTH - left;
+  fprintf(stderr, "\r[%.*s%*s] %3d%%", left, PROGRESS_BAR_STRING, right, "",
+      (int) (prog * 100.0));
+  fflush(stderr);
+}
+
+static inline double get_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline double block_draw(const size_t seq_i, const size_t block_i) {
+  uint64_t state = args.seed;
+  state ^= splitmix64(&state) + seq_i;
+  state ^= splitmix64(&state) + block_i;
+  return (splitmix64(&state) >> 11) * 0x1.0p-53;
+}
+
+int pick_sample_blocks(void) {
+  size_t best_seq = 0, best_block = 0;
+  double best_draw = 2.0;
+  sample_blocks = calloc(seq_info.n, sizeof(sample_blocks_t));
+  if (sample_blocks == NULL) goto fail;
+  for (size_t i = 0; i < seq_info.n; i++) {
+    const size_t n = (seq_sizes[i] + SAMPLE_BLOCK_SIZE - 1) / SAMPLE_BLOCK_SIZE;
+    sample_blocks[i].first = n_sample_blocks;
+    n_total_blocks += n;
+    for (size_t j = 0; j < n; j++) {
+      const double draw = block_draw(i, j);
+      if (draw < best_draw) {
+        best_draw = draw;
+        best_seq = i;
+        best_block = j;
+      }
+      if (draw >= args.sample) continue;
+      if (sample_blocks[i].n % ALLOC_CHUNK_SIZE == 0) {
+        size_t *tmp = realloc(sample_blocks[i].starts,
+          sizeof(size_t) * (sample_blocks[i].n + ALLOC_CHUNK_SIZE));
+        if (tmp == NULL) goto fail;
+        sample_blocks[i].starts = tmp;
+      }
+      sample_blocks[i].starts[sample_blocks[i].n++] = j * SAMPLE_BLOCK_SIZE;
+      n_sample_blocks++;
+    }
+  }
+  /* Always scan at least one block */
+  if (!n_sample_blocks && n_total_blocks) {
+    sample_blocks[best_seq].starts = malloc(sizeof(size_t) * ALLOC_CHUNK_SIZE);
+    if (sample_blocks[best_seq].starts == NULL) goto fail;
+    sample_blocks[best_seq].starts[0] = best_block * SAMPLE_BLOCK_SIZE;
+    sample_blocks[best_seq].n = 1;
+    for (size_t i = best_seq + 1; i < seq_info.n; i++) sample_blocks[i].first = 1;
+    n_sample_blocks = 1;
+  }
+  sample_block_hits = calloc(args.nthreads, sizeof(size_t *));
+  sample_block_i = calloc(args.nthreads, sizeof(size_t));
+  sample_stats = calloc(motif_info.n, sizeof(sample_stats_t));
+  if (sample_block_hits == NULL || sample_block_i == NULL || sample_stats == NULL) goto fail;
+  for (size_t i = 0; i < args.nthreads; i++) {
+    sample_block_hits[i] = malloc(sizeof(size_t) * MAX(n_sample_blocks, 1));
+    if (sample_block_hits[i] == NULL) goto fail;
+  }
+  return 0;
+fail:
+  note_error("Error: Failed to allocate memory for sampling.");
+  return 1;
+}
+
+void free_sample_blocks(void) {
+  for (size_t i = 0; i < seq_info.n; i++) free(sample_blocks[i].starts);
+  for (size_t i = 0; i < args.nthreads; i++) free(sample_block_hits[i]);
+  free(sample_blocks);
+  free(sample_block_hits);
+  free(sample_block_i);
+  free(sample_stats);
+}
+
+void start_sample(const motif_t *motif) {
+  memset(sample_block_hits[motif->thread], 0, sizeof(size_t) * n_sample_blocks);
+}
+
+/* Ratio estimator for cluster samples, with the finite population correction. */
+void finish_sample(const motif_t *motif) {
+  sample_stats_t *stats = &sample_stats[motif->index];
+  const size_t *hits = sample_block_hits[motif->thread];
+  const double strands = args.scan_rc ? 2.0 : 1.0;
+  const double total_windows = count_motif_tests(motif);
+  const double n = n_sample_blocks;
+  double windows = 0.0, sum_hits = 0.0;
+  for (size_t i = 0; i < seq_info.n; i++) {
+    for (size_t j = 0; j < sample_blocks[i].n; j++) {
+      windows += strands * block_windows(motif, i, sample_blocks[i].starts[j]);
+      sum_hits += hits[sample_blocks[i].first + j];
+    }
+  }
+  stats->hits = sum_hits;
+  stats->windows = windows;
+  if (windows == 0.0) return;
+  const double ratio = sum_hits / windows;
+  double sum_sq = 0.0;
+  for (size_t i = 0; i < seq_info.n; i++) {
+    for (size_t j = 0; j < sample_blocks[i].n; j++) {
+      const double e = hits[sample_blocks[i].first + j] -
+        ratio * strands * block_windows(motif, i, sample_blocks[i].starts[j]);
+      sum_sq += e * e;
+    }
+  }
+  const double mean_windows = windows / n;
+  const double fpc = 1.0 - n / n_total_blocks;
+  const double var = n > 1 ? fpc * sum_sq / (n * (n - 1) * mean_windows * mean_windows) : 0.0;
+  stats->est_hits = ratio * total_windows;
+  stats->ci = 1.96 * sqrt(var) * total_windows;
+  stats->bytes *= total_windows / windows;
+}
+
+void print_sample_stats(void) {
+  double windows = 0.0, scan_time = 0.0, bytes = 0.0, projected_time = 0.0;
+  size_t sampled_bases = 0;
+  double *thread_time = calloc(args.nthreads, sizeof(double));
+  if (thread_time == NULL) badexit("Error: Failed to allocate memory for sampling.");
+  for (size_t i = 0; i < seq_info.n; i++) {
+    for (size_t j = 0; j < sample_blocks[i].n; j++) {
+      sampled_bases += MIN(SAMPLE_BLOCK_SIZE, seq_sizes[i] - sample_blocks[i].starts[j]);
+    }
+  }
+  fprintf(files.o, "##Sample=%g Seed=%llu BlockSize=%zu Blocks=%zu/%zu Bases=%zu/%zu\n",
+    args.sample, (unsigned long long) args.seed, SAMPLE_BLOCK_SIZE,
+    n_sample_blocks, n_total_blocks, sampled_bases, seq_info.total_bases);
+  fprintf(files.o, "##motif\tsampled_hits\testimated_hits\tci_low\tci_high\n");
+  for (size_t i = 0; i < motif_info.n; i++) {
+    const sample_stats_t *stats = &sample_stats[i];
+    fprintf(files.o, "%s\t%zu\t%.0f\t%.0f\t%.0f\n", motifs[i]->name, stats->hits,
+      stats->est_hits, MAX(stats->est_hits - stats->ci, (double) stats->hits),
+      stats->est_hits + stats->ci);
+    windows += stats->windows;
+    scan_time += stats->scan_time;
+    bytes += stats->bytes;
+    const double full_windows = count_motif_tests(motifs[i]);
+    thread_time[motifs[i]->thread] += stats->cdf_time +
+      (stats->windows > 0.0 ? stats->scan_time * full_windows / stats->windows : 0.0);
+  }
+  for (size_t i = 0; i < args.nthreads; i++) {
+    projected_time = MAX(projected_time, thread_time[i]);
+  }
+  fprintf(files.o, "##Throughput=%.4g windows/s per thread\n",
+    scan_time > 0.0 ? windows / scan_time : 0.0);
+  fprintf(files.o, "##ProjectedTime=%.1f s (%d thread(s)) ProjectedOutput=%.2f MB\n",
+    projected_time, args.nthreads, b2mb(bytes));
+  free(thread_time);
+}
+
+/* With --auto, the number of threads, low-mem mode and the spread of motifs
+ * across threads are picked from a cost model once the sequences have been
+ * peeked at (or loaded). Its constants come from timing the scanning and CDF
+ * loops on a short random sequence drawn from the background. Thresholds are
+ * only known once the CDF of a motif is ready, so whether the early-exit
+ * kernel pays off is decided for every motif in start_motif_scan().
+ */
+#define CALIB_SEQ_SIZE            ((size_t) 4096)
+#define CALIB_MIN_TIME                      0.002    /* Seconds per loop */
+#define CALIB_MOTIF_TIME                   0.0002    /* Same, per motif kernel */
+#define CALIB_REPEATS                           3    /* Fastest one is kept */
+#define PLAN_THREAD_SLACK                    1.05    /* Fewer threads if within 5% */
+
+typedef struct plan_t {
+  double   col_time;                     /* Seconds per motif position scanned      */
+  double   cdf_time;                     /* Seconds per step of the CDF convolution */
+  double   read_time;                    /* Seconds per pass over the sequences      */
+  double   mem_budget;
+  double  *costs;                        /* Per motif, in seconds */
+  size_t   n_bounded;
+} plan_t;
+
+plan_t plan;
+unsigned char *calib_seq;
+volatile int calib_sink;
+
+int fill_calib_seq(void) {
+  uint64_t state = args.seed;
+  calib_seq = malloc(CALIB_SEQ_SIZE);
+  if (calib_seq == NULL) return 1;
+  for (size_t i = 0; i < CALIB_SEQ_SIZE; i++) {
+    const double u = (splitmix64(&state) >> 11) * 0x1.0p-53;
+    double cum = 0.0;
+    int letter = 0;
+    while (letter < 3 && u >= (cum += args.bkg[letter])) letter++;
+    calib_seq[i] = "ACGT"[letter];
+  }
+  return 0;
+}
+
+/* Seconds per motif position, for both strands if scanning them. Since
+ * how often the early-exit kernel gives up (and mispredicts doing so) depends
+ * on the threshold, it is timed with the real one.
+ */
+double time_scan_kernel(const motif_t *motif, const int bounded, const int threshold, const double min_time) {
+  const size_t n = CALIB_SEQ_SIZE - motif->size + 1;
+  int score = 0, score_rc = 0, sum = 0;
+  double best = INFINITY;
+  for (int r = 0; r < CALIB_REPEATS; r++) {
+    size_t reps = 0;
+    double elapsed;
+    const double time1 = get_time();
+    do {
+      if (bounded && args.scan_rc) {
+        for (size_t i = 0; i < n; i++) {
+          score_subseq_rc_bound(motif, calib_seq, i, threshold, &score, &score_rc);
+          sum += score + score_rc;
+        }
+      } else if (bounded) {
+        for (size_t i = 0; i < n; i++) {
+          score_subseq_bound(motif, calib_seq, i, threshold, &score);
+          sum += score;
+        }
+      } else if (args.scan_rc) {
+        for (size_t i = 0; i < n; i++) {
+          score_subseq_rc(motif, calib_seq, i, &score, &score_rc);
+          sum += score + score_rc;
+        }
+      } else {
+        for (size_t i = 0; i < n; i++) {
+          score_subseq(motif, calib_seq, i, &score);
+          sum += score;
+        }
+      }
+      reps++;
+      elapsed = get_time() - time1;
+    } while (elapsed < min_time);
+    best = MIN(best, elapsed / (reps * n * motif->size));
+  }
+  calib_sink = sum;
+  return best;
+}
+
+/* Seconds per step of the innermost loop of fill_cdf(). */
+double time_cdf_loop(void) {
+  const size_t n = CALIB_SEQ_SIZE;
+  double *pdf = calloc(n * 2, sizeof(double));
+  if (pdf == NULL) return 0.0;
+  double *cdf_tmp = pdf + n;
+  for (size_t i = 0; i < n; i++) pdf[i] = 1.0 / n;
+  double best = INFINITY;
+  for (int r = 0; r < CALIB_REPEATS; r++) {
+    size_t reps = 0;
+    double elapsed;
+    const double time1 = get_time();
+    do {
+      for (int j = 0; j < 4; j++) {
+        for (size_t k = 0; k < n - 4; k++) {
+          cdf_tmp[k + j] += pdf[k] * args.bkg[j];
+        }
+      }
+      reps++;
+      elapsed = get_time() - time1;
+    } while (elapsed < CALIB_MIN_TIME);
+    best = MIN(best, elapsed / (reps * (n - 4) * 4));
+  }
+  calib_sink = cdf_tmp[n / 2] > 0.0;
+  free(pdf);
+  return best;
+}
+
+/* fill_cdf() does 4 * (i * cdf_max + 1) steps for every motif position i. */
+static inline double motif_cdf_cost(const motif_t *motif) {
+  return 2.0 * motif->size * motif->size * motif->cdf_max * plan.cdf_time;
+}
+
+static inline double motif_scan_cost(const motif_t *motif) {
+  const double windows = count_motif_tests(motif) / (args.scan_rc ? 2.0 : 1.0);
+  return windows * motif->size * plan.col_time;
+}
+
+int cmp_plan_costs(const void *a, const void *b) {
+  const double cost_a = plan.costs[*((const size_t *) a)];
+  const double cost_b = plan.costs[*((const size_t *) b)];
+  if (cost_a != cost_b) return cost_a < cost_b ? 1 : -1;
+  return *((const size_t *) a) < *((const size_t *) b) ? -1 : 1;
+}
+
+/* Longest processing time first: the most expensive motif goes to the least
+ * busy thread. Returns the time needed by the busiest thread.
+ */
+double spread_motifs(const size_t *order, const int nthreads, const int apply) {
+  double *loads = calloc(nthreads, sizeof(double));
+  if (loads == NULL) badexit("Error: Failed to allocate memory for scan plan.");
+  for (size_t i = 0; i < motif_info.n; i++) {
+    int t_min = 0;
+    for (int t = 1; t < nthreads; t++) {
+      if (loads[t] < loads[t_min]) t_min = t;
+    }
+    loads[t_min] += plan.costs[order[i]];
+    if (apply) motifs[order[i]]->thread = t_min;
+  }
+  double busiest = 0.0;
+  for (int t = 0; t < nthreads; t++) busiest = MAX(busiest, loads[t]);
+  free(loads);
+  return busiest;
+}
+
+void plan_scan(const double read_time, const int can_stream) {
+  const motif_t *widest = motifs[0];
+  for (size_t i = 1; i < motif_info.n; i++) {
+    if (motifs[i]->size > widest->size) widest = motifs[i];
+  }
+  if (fill_calib_seq()) badexit("Error: Failed to allocate memory for scan plan.");
+  plan.col_time = time_scan_kernel(widest, 0, 0, CALIB_MIN_TIME);
+  plan.cdf_time = time_cdf_loop();
+  plan.read_time = read_time;
+  plan.mem_budget = args.mem ? args.mem : 0.5 * sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  plan.costs = malloc(sizeof(double) * motif_info.n);
+  size_t *order = malloc(sizeof(size_t) * motif_info.n);
+  if (plan.costs == NULL || order == NULL) {
+    badexit("Error: Failed to allocate memory for scan plan.");
+  }
+  double total_cost = 0.0;
+  for (size_t i = 0; i < motif_info.n; i++) {
+    plan.costs[i] = motif_cdf_cost(motifs[i]) + motif_scan_cost(motifs[i]);
+    total_cost += plan.costs[i];
+    order[i] = i;
+  }
+  qsort(order, motif_info.n, sizeof(size_t), cmp_plan_costs);
+
+  const int max_threads = MIN((size_t) args.nthreads, motif_info.n);
+  double *load_times = malloc(sizeof(double) * max_threads);
+  if (load_times == NULL) badexit("Error: Failed to allocate memory for scan plan.");
+  double fastest = INFINITY;
+  for (int t = 0; t < max_threads; t++) {
+    load_times[t] = (can_stream ? read_time : 0.0) + spread_motifs(order, t + 1, 0);
+    fastest = MIN(fastest, load_times[t]);
+  }
+  int nthreads = 1;
+  while (load_times[nthreads - 1] > fastest * PLAN_THREAD_SLACK) nthreads++;
+
+  size_t max_seq_size = 0, names_size = 0;
+  for (size_t i = 0; i < seq_info.n; i++) {
+    max_seq_size = MAX(max_seq_size, seq_sizes[i]);
+    names_size += strlen(seq_names[i]) + 1;
+  }
+  const double stream_mem = max_seq_size + sizeof(size_t) * seq_info.n + names_size;
+  const double load_mem = seq_info.total_bases + sizeof(size_t) * seq_info.n * 2 + names_size;
+  const double stream_time = motif_info.n * read_time + total_cost;
+  const char *reason;
+  if (args.mem) {
+    reason = "in batches within --mem";
+  } else if (!can_stream) {
+    args.low_mem = 0;
+    reason = "sequences already loaded";
+  } else if (load_mem > plan.mem_budget) {
+    args.low_mem = 1;
+    reason = "sequences too large for memory budget";
+  } else {
+    args.low_mem = stream_time <= load_times[nthreads - 1];
+    reason = "fastest";
+  }
+  if (args.low_mem && !args.mem) nthreads = 1;
+
+  if (args.v) {
+    fprintf(stderr, "Planning scan (--auto):\n");
+    fprintf(stderr, "    Calibration: %.3g ns per motif position, %.3g ns per CDF step\n",
+      plan.col_time * 1e9, plan.cdf_time * 1e9);
+    fprintf(stderr, "    Reading sequences: %.3g s    Memory budget: %'.2f MB\n",
+      read_time, b2mb(plan.mem_budget));
+    if (can_stream && !args.mem) {
+      fprintf(stderr, "    Low-mem, 1 thread:    ~%.3g s, %'.2f MB\n",
+        stream_time, b2mb(stream_mem));
+    }
+    fprintf(stderr, "    Loaded, 1 thread:     ~%.3g s, %'.2f MB\n",
+      load_times[0], b2mb(load_mem));
+    if (max_threads > 1) {
+      fprintf(stderr, "    Loaded, %d thread(s): ~%.3g s, %'.2f MB\n",
+        nthreads, load_times[nthreads - 1], b2mb(load_mem));
+    }
+    fprintf(stderr, "    Plan: %s, %d thread(s) (%s)\n",
+      args.low_mem && !args.mem ? "low-mem" : "loaded", nthreads, reason);
+  }
+
+  args.nthreads = nthreads;
+  pthread_t *tmp_threads = realloc(threads, sizeof(pthread_t) * args.nthreads);
+  if (tmp_threads == NULL) {
+    badexit("Error: Failed to re-allocate memory for threads.");
+  }
+  threads = tmp_threads;
+  spread_motifs(order, args.nthreads, 1);
+  free(load_times);
+  free(order);
+}
+
+/* The early-exit kernel only pays off for thresholds close to the best
+ * score, so both kernels are timed on the calibration sequence.
+ */
+void pick_scan_kernel(motif_t *motif) {
+  motif->bounded = 0;
+  if (motif->threshold == INT_MAX || motif->size > CALIB_SEQ_SIZE) return;
+  const double full = time_scan_kernel(motif, 0, 0, CALIB_MOTIF_TIME);
+  const double bounded = time_scan_kernel(motif, 1, motif->threshold - 1, CALIB_MOTIF_TIME);
+  motif->bounded = bounded < full;
+  if (motif->bounded) __atomic_fetch_add(&plan.n_bounded, 1, __ATOMIC_RELAXED);
+  if (args.w && !args.progress) {
+    fprintf(stderr, "        Kernel for [%s]: %s (%.3g vs %.3g ns per position)\n",
+      motif->name, motif->bounded ? "early exit" : "full", bounded * 1e9, full * 1e9);
+  }
+}
+
+void finish_plan(void) {
+  if (args.v) {
+    fprintf(stderr, "Used the early-exit kernel for %zu/%zu motif(s).\n",
+      plan.n_bounded, motif_info.n);
+  }
+  free(plan.costs);
+  free(calib_seq);
+}
+
+void forget_seqs(void) {
+  for (size_t i = 0; i < seq_info.n; i++) free(seq_names[i]);
+  seq_info.n = 0;
+  seq_info.hash = 0;
+}
+
+/* With --mem, sequences are loaded in batches which fit in the budget along
+ * with everything that is kept for the whole run. Motif CDFs are only made
+ * once: after setting the threshold, only the part of the CDF that hits can
+ * reach is kept, so the per-thread CDF buffers are freed before any
+ * sequences are loaded.
+ */
+#define MEM_IO_SIZE               ((size_t) 1048576)    /* zlib, kseq and stdio buffers */
+
+size_t  mem_used, mem_peak;
+size_t  cdf_tail_bytes;
+size_t  batch_first, batch_last;         /* Sequences of the current batch */
+size_t  n_batches = 1;
+int     motifs_ready;                    /* CDFs and thresholds done */
+
+int parse_mem_size(const char *str, size_t *bytes) {
+  char *end;
+  const double size = strtod(str, &end);
+  int shift = 0;
+  switch (*end) {
+    case 'K': case 'k': shift = 10; break;
+    case 'M': case 'm': shift = 20; break;
+    case 'G': case 'g': shift = 30; break;
+    case 'T': case 't': shift = 40; break;
+  }
+  if (shift) end++;
+  if (end == str || (*end != '\0' && strcmp(end, "B") && strcmp(end, "b")) ||
+      size <= 0.0) {
+    return 1;
+  }
+  *bytes = ldexp(size, shift);
+  return 0;
+}
+
+static inline void mem_add(const size_t bytes) {
+  mem_used += bytes;
+  mem_peak = MAX(mem_peak, mem_used);
+}
+
+static inline void mem_sub(const size_t bytes) {
+  mem_used -= bytes;
+}
+
+void keep_cdf_tail(motif_t *motif) {
+  if (motif->threshold == INT_MAX) return;
+  const int lowest = MAX(motif->threshold, motif->cdf_offset);
+  const size_t skip = lowest - motif->cdf_offset, n = motif->cdf_size - skip;
+  double *tail = malloc(sizeof(double) * n);
+  if (tail == NULL) badexit("Error: Failed to allocate memory for CDF.");
+  memcpy(tail, motif->cdf + skip, sizeof(double) * n);
+  motif->cdf = tail;
+  motif->cdf_offset = lowest;
+  __atomic_fetch_add(&cdf_tail_bytes, sizeof(double) * n, __ATOMIC_RELAXED);
+}
+
+void free_cdf_tails(void) {
+  for (size_t i = 0; i < motif_info.n; i++) {
+    if (motifs[i]->threshold != INT_MAX) free(motifs[i]->cdf);
+  }
+}
+
+/* What needs to happen for every motif before and after scanning all
+ * sequences, in both the low-mem and threaded loops.
+ */
+void start_motif_scan(motif_t *motif) {
+  if (motif_is_done(motif)) return;
+  const double time1 = args.sample > 0.0 ? get_time() : 0.0;
+  fill_cdf(motif);
+  set_threshold(motif);
+  if (args.cache != NULL) open_motif_cache(motif);
+  if (args.auto_plan) pick_scan_kernel(motif);
+  if (args.qvalues && init_score_bins(motif)) badexit("");
+  if (args.track != NULL && open_track(motif)) badexit("");
+  if (args.bin_size) start_bins(motif);
+  if (args.mem || args.manifest != NULL || args.serve != NULL || IS_LIB) keep_cdf_tail(motif);
+  if (args.sample > 0.0) {
+    start_sample(motif);
+    sample_stats[motif->index].scan_time = get_time();
+    sample_stats[motif->index].cdf_time = sample_stats[motif->index].scan_time - time1;
+  }
+}
+
+void finish_motif_scan(motif_t *motif) {
+  if (caches != NULL && caches[motif->thread].file != NULL) close_motif_cache(motif);
+  if (args.track != NULL) close_track(motif);
+  if (args.bin_size) finish_bins(motif);
+  if (args.sample > 0.0) {
+    sample_stats[motif->index].scan_time = get_time() - sample_stats[motif->index].scan_time;
+    finish_sample(motif);
+  }
+}
+
+/* For --numa, every thread is pinned to the CPUs of a NUMA node (threads are
+ * spread over the nodes in equal blocks), and the sequences are copied by a
+ * thread pinned to each node, so that the pages are placed on that node when
+ * first touched. If there is enough free memory, every node gets a copy of
+ * all sequences, and as the threads scan all sequences with their motifs,
+ * they then only ever read local memory. Otherwise the sequences are dealt
+ * out to the nodes in turn, so at least the load is spread over all of them.
+ * Node copies live in seqs[] after the regular ones: seqs[node * n + i].
+ */
+#define NUMA_MAX_NODES                         64
+#define NUMA_REPLICATE_MEM_PCT               50.0    /* Of MemAvailable */
+
+typedef struct numa_node_t {
+  cpu_set_t cpus;
+  size_t    n_threads;
+  size_t    bases;                       /* Scanned, summed over motifs */
+  double    time;                        /* Of the slowest thread */
+} numa_node_t;
+
+numa_node_t    *numa_nodes;
+size_t          numa_n_nodes;
+int             numa_replicated;
+unsigned char **numa_originals;          /* While copying */
+size_t         *numa_thread_bases;       /* Per thread */
+double         *numa_thread_time;        /* Per thread */
+
+int parse_cpulist(const char *list, cpu_set_t *cpus) {
+  CPU_ZERO(cpus);
+  const char *c = list;
+  while (*c != '\0' && *c != '\n') {
+    char *end;
+    const long first = strtol(c, &end, 10);
+    long last = first;
+    if (end == c || first < 0) return 1;
+    if (*end == '-') {
+      c = end + 1;
+      last = strtol(c, &end, 10);
+      if (end == c || last < first) return 1;
+    }
+    for (long i = first; i <= last && i < CPU_SETSIZE; i++) CPU_SET(i, cpus);
+    c = *end == ',' ? end + 1 : end;
+  }
+  return !CPU_COUNT(cpus);
+}
+
+/* Nodes without CPUs (memory only) are skipped. */
+size_t read_numa_nodes(void) {
+  numa_nodes = calloc(NUMA_MAX_NODES, sizeof(numa_node_t));
+  if (numa_nodes == NULL) badexit("Error: Failed to allocate memory for NUMA nodes.");
+  char path[256], *line = NULL;
+  size_t len = 0;
+  for (size_t i = 0; i < NUMA_MAX_NODES; i++) {
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", i);
+    FILE *in = fopen(path, "r");
+    if (in == NULL) continue;
+    if (getline(&line, &len, in) != -1 && !parse_cpulist(line, &numa_nodes[numa_n_nodes].cpus)) {
+      numa_n_nodes++;
+    }
+    fclose(in);
+  }
+  free(line);
+  return numa_n_nodes;
+}
+
+size_t mem_available(void) {
+  char *line = NULL;
+  size_t len = 0, kb = 0;
+  FILE *in = fopen("/proc/meminfo", "r");
+  if (in == NULL) return 0;
+  while (getline(&line, &len, in) != -1) {
+    if (sscanf(line, "MemAvailable: %zu kB", &kb) == 1) break;
+  }
+  free(line);
+  fclose(in);
+  return kb * 1024;
+}
+
+static inline size_t numa_thread_node(const size_t thread_i) {
+  return thread_i * numa_n_nodes / args.nthreads;
+}
+
+static inline size_t numa_seq_base(const size_t thread_i) {
+  return numa_replicated ? numa_thread_node(thread_i) * seq_info.n : 0;
+}
+
+void pin_thread(const size_t node_i) {
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &numa_nodes[node_i].cpus);
+}
+
+void *numa_copy_sub_process(void *node_i) {
+  const size_t node = *((size_t *) node_i), n = seq_info.n;
+  const size_t step = numa_replicated ? 1 : numa_n_nodes;
+  pin_thread(node);
+  for (size_t i = numa_replicated ? 0 : node; i < n; i += step) {
+    unsigned char *copy = malloc(seq_sizes[i] + 1);
+    if (copy == NULL) badexit("Error: Failed to allocate memory for NUMA sequence copies.");
+    memcpy(copy, numa_originals[i], seq_sizes[i] + 1);
+    seqs[numa_replicated ? node * n + i : i] = copy;
+  }
+  return NULL;
+}
+
+/* Nodes past the number of threads would only hold unused copies. */
+void place_seqs(void) {
+  if (read_numa_nodes() < 2 || args.nthreads < 2) {
+    if (args.v) fprintf(stderr, "Note: Found a single NUMA node or thread, --numa has no effect.\n");
+    free(numa_nodes);
+    numa_nodes = NULL;
+    return;
+  }
+  numa_n_nodes = MIN(numa_n_nodes, (size_t) args.nthreads);
+  const size_t n = seq_info.n;
+  numa_replicated = (double) seq_info.total_bases * (numa_n_nodes - 1) <=
+    mem_available() * (NUMA_REPLICATE_MEM_PCT / 100.0);
+  numa_originals = malloc(sizeof(*seqs) * n);
+  unsigned char **tmp_seqs = realloc(seqs, sizeof(*seqs) * n * (numa_replicated ? numa_n_nodes : 1));
+  numa_thread_bases = calloc(args.nthreads, sizeof(size_t));
+  numa_thread_time = calloc(args.nthreads, sizeof(double));
+  pthread_t *copiers = malloc(sizeof(pthread_t) * numa_n_nodes);
+  size_t *node_i = malloc(sizeof(size_t) * numa_n_nodes);
+  if (numa_originals == NULL || tmp_seqs == NULL || numa_thread_bases == NULL ||
+      numa_thread_time == NULL || copiers == NULL || node_i == NULL) {
+    badexit("Error: Failed to allocate memory for NUMA placement.");
+  }
+  seqs = tmp_seqs;
+  memcpy(numa_originals, seqs, sizeof(*seqs) * n);
+  for (size_t i = 0; i < numa_n_nodes; i++) {
+    node_i[i] = i;
+    pthread_create(&copiers[i], NULL, numa_copy_sub_process, &node_i[i]);
+  }
+  for (size_t i = 0; i < numa_n_nodes; i++) pthread_join(copiers[i], NULL);
+  for (size_t i = 0; i < n; i++) free(numa_originals[i]);
+  free(numa_originals);
+  free(copiers);
+  free(node_i);
+  for (size_t t = 0; t < args.nthreads; t++) numa_nodes[numa_thread_node(t)].n_threads++;
+  if (args.v) {
+    fprintf(stderr, "Spread %'d threads over %'zu NUMA nodes, %s.\n", args.nthreads,
+      numa_n_nodes, numa_replicated ? "with a copy of the sequences on every node" :
+      "with the sequences dealt out to the nodes");
+  }
+}
+
+/* The bases a motif is about to scan in a sequence, for the throughput of
+ * every node: nothing if score_seq() skips the sequence, or replays it from
+ * the cache, and only the anchor ranges with --anchor.
+ */
+size_t numa_scan_size(const motif_t *motif, const size_t seq_i, const size_t seq_loc) {
+  if (seq_sizes[seq_i] < motif->size || args.cooccur) return 0;
+  if (motif->threshold == INT_MAX && !args.occupancy && !args.bin_size && args.track == NULL) {
+    return 0;
+  }
+  if (caches != NULL &&
+      find_cache_entry(&caches[motif->thread], get_seq_hash(seq_i, seq_loc), seq_sizes[seq_i]) != NULL) {
+    return 0;
+  }
+  if (anchor_regions != NULL && !motif->anchor) {
+    size_t bases = 0, first, last;
+    for (size_t i = next_anchor_range(motif, seq_i, 0, &first, &last); first <= last;
+        i = next_anchor_range(motif, seq_i, i, &first, &last)) {
+      bases += last - first + motif->size;
+    }
+    return bases;
+  }
+  return seq_sizes[seq_i];
+}
+
+/* Called by every thread as it finishes its part of a scan. */
+void numa_thread_done(const size_t thread_i, const size_t bases, const double time) {
+  numa_thread_bases[thread_i] += bases;
+  numa_thread_time[thread_i] += time;
+}
+
+void finish_numa(void) {
+  for (size_t t = 0; t < args.nthreads; t++) {
+    numa_node_t *node = &numa_nodes[numa_thread_node(t)];
+    node->bases += numa_thread_bases[t];
+    node->time = MAX(node->time, numa_thread_time[t]);
+  }
+  if (args.v) {
+    for (size_t i = 0; i < numa_n_nodes; i++) {
+      fprintf(stderr, "    NUMA node %zu: %'zu threads, %'.1f motif-Mb scanned at %'.1f motif-Mb/s\n",
+        i, numa_nodes[i].n_threads, numa_nodes[i].bases / 1e6,
+        numa_nodes[i].time > 0.0 ? numa_nodes[i].bases / 1e6 / numa_nodes[i].time : 0.0);
+    }
+  }
+  if (numa_replicated) {
+    for (size_t i = seq_info.n; i < seq_info.n * numa_n_nodes; i++) free(seqs[i]);
+  }
+  free(numa_thread_bases);
+  free(numa_thread_time);
+  free(numa_nodes);
+  numa_nodes = NULL;
+}
+
+void *scan_sub_process(void *thread_i) {
+  const size_t first = args.mem ? batch_first : 0;
+  const size_t last = args.mem || args.serve != NULL ? batch_last : seq_info.n;
+  const size_t seq_base = numa_nodes != NULL ? numa_seq_base(*((int *) thread_i)) : 0;
+  const double time1 = numa_nodes != NULL ? get_time() : 0.0;
+  size_t bases = 0;
+  if (numa_nodes != NULL) pin_thread(numa_thread_node(*((int *) thread_i)));
+  for (size_t i = 0; i < motif_info.n && !stop_requested; i++) {
+    motif_t *motif = motifs[i];
+    if (*((int *) thread_i) == motif->thread && in_scan_round(motif)) {
+      if (args.w && !args.progress) {
+        fprintf(stderr, "    Scanning motif: %s\n", motif->name);
+      }
+      if (!motifs_ready) start_motif_scan(motif);
+      start_task(motif, first);
+      size_t j = first;
+      for (; j < last && !stop_requested; j++) {
+        if (seq_is_done(motif, j)) {
+          skip_done_seq(motif, j);
+          continue;
+        }
+        if (numa_nodes != NULL) bases += numa_scan_size(motif, j, seq_base + j - first);
+        score_seq(motif, j, seq_base + j - first);
+        task_seq_done(motif, j);
+      }
+      if (shm_ring != NULL) shm_flush(motif->thread);
+      commit_task(motif, j);
+      if (!motifs_ready) finish_motif_scan(motif);
+      if (args.progress && last > first) {        /* Not just computing CDFs */
+        pthread_mutex_lock(&pb_lock);
+        pb_counter++;
+        print_pb((double) pb_counter / (motif_info.n * n_batches));
+        pthread_mutex_unlock(&pb_lock);
+      }
+    }
+  }
+  if (numa_nodes != NULL) numa_thread_done(*((int *) thread_i), bases, get_time() - time1);
+  free(thread_i);
+  return NULL;
+}
+
+void run_motif_threads(void) {
+  for (size_t t = 0; t < args.nthreads; t++) {
+    size_t *thread_i = malloc(sizeof(size_t *));
+    if (thread_i == NULL) {
+      badexit("Error: Failed to allocate memory for thread index.");
+    }
+    *thread_i = t;
+    pthread_create(&threads[t], NULL, scan_sub_process, thread_i);
+  }
+  for (size_t t = 0; t < args.nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+}
+
+/* Memory needed for the whole run no matter the batch size. */
+size_t mem_fixed(void) {
+  size_t bytes = MEM_IO_SIZE + sizeof(motif_t) * motif_info.n +
+    (sizeof(char *) + sizeof(size_t) + sizeof(unsigned char *)) * seq_info.n_alloc;
+  for (size_t i = 0; i < seq_info.n; i++) bytes += strlen(seq_names[i]) + 1;
+  if (args.count) bytes += sizeof(unsigned int) * seq_info.n * hit_count_cols();
+  if (args.occupancy) bytes += sizeof(double) * seq_info.n * motif_info.n;
+  if (args.top) bytes += sizeof(top_hit_t) * args.top * motif_info.n;
+  if (args.best) bytes += sizeof(hit_t) * args.best * args.nthreads;
+  return bytes;
+}
+
+size_t qvalue_bins_bytes(void) {
+  size_t bytes = 0;
+  if (!args.qvalues) return 0;
+  for (size_t i = 0; i < motif_info.n; i++) {
+    const motif_t *motif = motifs[i];
+    if (motif->threshold == INT_MAX || motif->threshold > motif->max_score) continue;
+    bytes += sizeof(score_bin_t) * (motif->max_score - motif->threshold + 1);
+  }
+  return bytes;
+}
+
+/* kseq grows its buffer by doubling as it reads, so reading a sequence can
+ * briefly need its old buffer plus the new one twice the size.
+ */
+static inline size_t read_peak_size(const size_t seq_size) {
+  size_t m = 256;
+  while (m < seq_size + 2) m *= 2;
+  return m + m / 2;
+}
+
+void shrink_cdf(void) {
+  for (size_t i = 0; i < args.nthreads; i++) {
+    free(cdf[i]);
+    free(tmp_pdf[i]);
+    cdf[i] = malloc(sizeof(double));
+    tmp_pdf[i] = malloc(sizeof(double));
+    if (cdf[i] == NULL || tmp_pdf[i] == NULL) {
+      badexit("Error: Failed to allocate memory for CDF.");
+    }
+    cdf_real_size[i] = 1;
+  }
+}
+
+void mem_too_small(void) {
+  badexitf(
+    "Error: --mem is too small, %'.2f MB are needed before loading any sequences.",
+    b2mb(mem_used));
+}
+
+void scan_batches(kseq_t *kseq) {
+  const int is_fastq = kseq->qual.m > 0;
+  size_t max_seq_size = 0, max_cdf_size = 0;
+  for (size_t i = 0; i < seq_info.n; i++) {
+    max_seq_size = MAX(max_seq_size, seq_sizes[i]);
+  }
+  for (size_t i = 0; i < motif_info.n; i++) {
+    max_cdf_size = MAX(max_cdf_size, motifs[i]->cdf_size);
+  }
+  free(kseq->seq.s); kseq->seq.s = NULL; kseq->seq.m = 0;
+  free(kseq->qual.s); kseq->qual.s = NULL; kseq->qual.m = 0;
+  unsigned char **tmp_seqs = realloc(seqs, sizeof(*seqs) * seq_info.n_alloc);
+  if (tmp_seqs == NULL) badexit("Error: Failed to allocate memory for sequences.");
+  seqs = tmp_seqs;
+
+  /* FASTQ qualities stay in a kseq buffer as large as the largest sequence. */
+  mem_add(mem_fixed() + (is_fastq ? read_peak_size(max_seq_size) : 0));
+  const size_t cdf_bytes = sizeof(double) * 2 * max_cdf_size * args.nthreads;
+  mem_add(cdf_bytes);
+  if (mem_used > args.mem) mem_too_small();
+  motifs_ready = 0;
+  batch_first = batch_last = 0;
+  run_motif_threads();
+  motifs_ready = 1;
+  mem_add(cdf_tail_bytes + qvalue_bins_bytes());
+  if (mem_used > args.mem) mem_too_small();
+  shrink_cdf();
+  mem_sub(cdf_bytes);
+
+  size_t *batch_ends = malloc(sizeof(size_t) * seq_info.n);
+  if (batch_ends == NULL) badexit("Error: Failed to allocate memory for batches.");
+  n_batches = 0;
+  for (size_t i = 0, batch_size = 0; i < seq_info.n; i++) {
+    if (mem_used + batch_size + read_peak_size(seq_sizes[i]) > args.mem) {
+      if (!batch_size) {
+        badexitf(
+          "Error: --mem is too small to load [%s] (%'.2f MB needed, %'.2f MB left).",
+          seq_names[i], b2mb(read_peak_size(seq_sizes[i])),
+          b2mb(args.mem > mem_used ? args.mem - mem_used : 0));
+      }
+      batch_ends[n_batches++] = i;
+      batch_size = 0;
+    }
+    batch_size += seq_sizes[i] + 1;
+  }
+  batch_ends[n_batches++] = seq_info.n;
+  if (args.v) fprintf(stderr, "Scanning in %'zu batch(es) ...\n", n_batches);
+
+  pb_counter = 0;
+  if (args.progress) print_pb(0.0);
+  for (size_t b = 0; b < n_batches && !stop_requested; b++) {
+    batch_first = batch_last;
+    batch_last = batch_ends[b];
+    size_t batch_size = 0;
+    for (size_t i = batch_first; i < batch_last; i++) {
+      if (kseq_read(kseq) < 0 || kseq->seq.l != seq_sizes[i]) {
+        badexit("Error: Failed to re-read input file.");
+      }
+      mem_add(read_peak_size(seq_sizes[i]));   /* Only while reading */
+      mem_sub(read_peak_size(seq_sizes[i]));
+      unsigned char *seq = realloc(kseq->seq.s, kseq->seq.l + 1);
+      seqs[i - batch_first] = seq != NULL ? seq : (unsigned char *) kseq->seq.s;
+      kseq->seq.s = NULL; kseq->seq.m = 0;
+      mem_add(seq_sizes[i] + 1);
+      batch_size += seq_sizes[i] + 1;
+    }
+    if (args.w && !args.progress) {
+      fprintf(stderr, "    Batch %'zu: %'zu sequence(s), %'.2f MB\n", b + 1,
+        batch_last - batch_first, b2mb(batch_size));
+    }
+    run_motif_threads();
+    for (size_t i = batch_first; i < batch_last; i++) free(seqs[i - batch_first]);
+    mem_sub(batch_size);
+  }
+  if (args.progress) fprintf(stderr, "\n");
+  kseq_destroy(kseq);
+  free(batch_ends);
+  free_cdf_tails();
+}
+
+void print_mem_peak(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(stderr, "Peak memory: %'.2f MB accounted for (--mem %'.2f MB), %'.2f MB max RSS.\n",
+    b2mb(mem_peak), b2mb(args.mem), b2mb(usage.ru_maxrss * 1024.0));
+}
+
+/* With --manifest, the line listing the options shows the current input in
+ * place of the manifest, as if it had been scanned on its own.
+ */
+void print_scan_header(const int argc, char **argv, const char *manifest_input) {
+  if (!args.binary) {
+    fprintf(files.o, "##minimotif v%s [ ", MINIMOTIF_VERSION);
+    for (int i = 1; i < argc; i++) {
+      if (args.shard_n && skip_fingerprint_arg(argv, i, 1)) {
+        i += skip_fingerprint_arg(argv, i, 1) - 1;   /* Same line for every shard */
+        continue;
+      }
+      if (manifest_input != NULL && !strcmp(argv[i], "--manifest")) {
+        fprintf(files.o, "-s %s ", manifest_input);
+        i++;
+        continue;
+      } else if (manifest_input != NULL && !strncmp(argv[i], "--manifest=", 11)) {
+        fprintf(files.o, "-s %s ", manifest_input);
+        continue;
+      }
+      fprintf(files.o, "%s ", argv[i]);
+    }
+    fprintf(files.o, "]\n");
+    size_t motif_size = 0;
+    for (size_t i = 0; i < motif_info.n; i++) motif_size += motifs[i]->size;
+    fprintf(files.o,
+      "##MotifCount=%zu MotifSize=%zu SeqCount=%zu SeqSize=%zu GC=%.2f%% Ns=%zu\n",
+      motif_info.n, motif_size, seq_info.n, seq_info.total_bases, seq_info.gc_pct,
+      seq_info.unknowns);
+    if (args.shard_n) print_shard_header(run_fingerprint(argc, argv, 1));
+  }
+  if (!args.count && !args.enrich && !args.shuffle && args.track == NULL &&
+      !args.bin_size && !args.occupancy && !args.cooccur && !files.v_open &&
+      args.sample == 0.0) {
+    fprintf(files.o, 
+      "##seqname\tstart\tend\tstrand\tmotif\tpvalue\tscore\tscore_pct\tmatch%s\n",
+      args.qvalues ? "\tqvalue" : "");
+  }
+}
+
+/* For --manifest, the CDF of every motif is computed once up front and only
+ * the part needed for the P-values of hits is kept, like with --mem. The
+ * sequences of a file are shared by all threads, so the files are scanned one
+ * after the other, each with the motifs spread over the threads as usual.
+ * With fewer motifs than threads, that would leave threads idle, so instead
+ * up to -j worker processes are forked once the motifs are ready, and each
+ * scans its share of the files one after the other with a single thread.
+ */
+typedef struct manifest_entry_t {
+  char     *input;
+  char     *output;
+} manifest_entry_t;
+
+manifest_entry_t *manifest;
+size_t            manifest_n;
+int               manifest_pb_fd = -1;  /* Written to after every file by workers */
+
+void read_manifest(void) {
+  char *line = NULL;
+  size_t len = 0, line_num = 0, n_alloc = 0;
+  ssize_t read;
+  FILE *in = fopen(args.manifest, "r");
+  if (in == NULL) {
+    badexitf("Error: Failed to open manifest: %s", args.manifest);
+  }
+  while ((read = getline(&line, &len, in)) != -1) {
+    line_num++;
+    while (read && (line[read - 1] == '\n' || line[read - 1] == '\r')) {
+      line[--read] = '\0';
+    }
+    if (!read || line[0] == '#') continue;
+    char *tab = strchr(line, '\t');
+    if (tab == NULL || tab == line || tab[1] == '\0' || strchr(tab + 1, '\t') != NULL) {
+      badexitf(
+        "Error: Line %zu of manifest should be an input and output filename separated by a tab.",
+        line_num);
+    }
+    *tab = '\0';
+    if (access(line, R_OK)) {
+      badexitf("Error: Failed to open sequence file: %s (manifest line %zu)",
+        line, line_num);
+    }
+    if (manifest_n == n_alloc) {
+      n_alloc += ALLOC_CHUNK_SIZE;
+      manifest_entry_t *tmp = realloc(manifest, sizeof(manifest_entry_t) * n_alloc);
+      if (tmp == NULL) badexit("Error: Failed to allocate memory for manifest.");
+      manifest = tmp;
+    }
+    manifest[manifest_n].input = strdup(line);
+    manifest[manifest_n].output = strdup(tab + 1);
+    if (manifest[manifest_n].input == NULL || manifest[manifest_n].output == NULL) {
+      badexit("Error: Failed to allocate memory for manifest.");
+    }
+    manifest_n++;
+  }
+  free(line);
+  fclose(in);
+  if (!manifest_n) {
+    badexitf("Error: No files listed in manifest: %s", args.manifest);
+  }
+}
+
+void free_manifest(void) {
+  for (size_t i = 0; i < manifest_n; i++) {
+    free(manifest[i].input);
+    free(manifest[i].output);
+  }
+  free(manifest);
+}
+
+void scan_manifest_file(const int argc, char **argv, const size_t i) {
+  if (args.v && !args.progress) {
+    fprintf(stderr, "Scanning %s -> %s ...\n", manifest[i].input, manifest[i].output);
+  }
+  files.s = gzopen(manifest[i].input, "r");
+  if (files.s == NULL) {
+    badexitf("Error: Failed to open sequence file: %s", manifest[i].input);
+  }
+  files.s_open = 1;
+  load_seqs(kseq_init(files.s));
+  find_seq_dupes();
+  gzclose(files.s);
+  files.s_open = 0;
+  files.o = fopen(manifest[i].output, "w");
+  if (files.o == NULL) {
+    badexitf("Error: Failed to create output file: %s", manifest[i].output);
+  }
+  files.o_open = 1;
+  print_scan_header(argc, argv, manifest[i].input);
+  if (args.count && alloc_hit_counts()) badexit("");
+  if (args.occupancy && alloc_occupancy()) badexit("");
+  run_motif_threads();
+  if (args.count) {
+    print_hit_counts();
+    free(hit_counts);
+  }
+  if (args.occupancy) {
+    print_occupancy();
+    free(occupancy);
+  }
+  fclose(files.o);
+  files.o_open = 0;
+  for (size_t j = 0; j < seq_info.n; j++) free(seqs[j]);
+  forget_seqs();
+}
+
+void scan_manifest_files(const int argc, char **argv, const size_t first, const size_t step) {
+  if (args.best && alloc_best_hits()) badexit("");
+  if (args.no_overlap && alloc_overlap_bufs()) badexit("");
+  for (size_t i = first; i < manifest_n; i += step) {
+    scan_manifest_file(argc, argv, i);
+    if (manifest_pb_fd != -1 && write(manifest_pb_fd, "", 1) != 1) {
+      close(manifest_pb_fd);             /* Only the progress bar stops */
+      manifest_pb_fd = -1;
+    }
+  }
+  if (args.best) free_best_hits();
+  free_overlap_bufs();
+}
+
+/* Each worker gets every n_workers-th file and a single thread. */
+void fork_manifest_workers(const int argc, char **argv, const size_t n_workers) {
+  int pb_pipe[2] = {-1, -1};
+  pid_t *pids = malloc(sizeof(pid_t) * n_workers);
+  if (pids == NULL) badexit("Error: Failed to allocate memory for --manifest workers.");
+  if (args.progress && pipe(pb_pipe)) {
+    badexit("Error: Failed to create pipe for --manifest progress.");
+  }
+  if (args.v) {
+    fprintf(stderr, "Scanning %'zu files at a time, one thread each ...\n", n_workers);
+  }
+  fflush(stdout);
+  fflush(stderr);
+  for (size_t w = 0; w < n_workers; w++) {
+    pids[w] = fork();
+    if (pids[w] == 0) {
+      if (pb_pipe[0] != -1) close(pb_pipe[0]);
+      manifest_pb_fd = pb_pipe[1];
+      args.progress = 0;
+      args.nthreads = 1;
+      for (size_t i = 0; i < motif_info.n; i++) motifs[i]->thread = 0;
+      scan_manifest_files(argc, argv, w, n_workers);
+      close_files();
+      exit(EXIT_SUCCESS);
+    } else if (pids[w] == -1) {
+      for (size_t i = 0; i < w; i++) kill(pids[i], SIGTERM);
+      badexit("Error: Failed to fork for --manifest.");
+    }
+  }
+  if (pb_pipe[1] != -1) close(pb_pipe[1]);
+  if (pb_pipe[0] != -1) {
+    char c;
+    size_t done = 0;
+    print_pb(0.0);
+    while (read(pb_pipe[0], &c, 1) == 1) print_pb((double) ++done / manifest_n);
+    close(pb_pipe[0]);
+  }
+  int failed = 0;
+  for (size_t w = 0; w < n_workers; w++) {
+    int status = 0;
+    while (waitpid(pids[w], &status, 0) == -1 && errno == EINTR);
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+  }
+  free(pids);
+  if (failed) badexit("Error: Failed to scan every file in the manifest.");
+}
+
+void scan_manifest(const int argc, char **argv) {
+  read_manifest();
+  if (args.v) fprintf(stderr, "Preparing motifs for %'zu file(s) ...\n", manifest_n);
+  if (alloc_cdf()) badexit("");
+  motifs_ready = 0;
+  run_motif_threads();
+  motifs_ready = 1;
+  free_cdf();
+  if (args.occupancy) fill_odds_lut();
+
+  n_batches = manifest_n;
+  pb_counter = 0;
+  const size_t n_workers = motif_info.n < args.nthreads ? MIN(args.nthreads, manifest_n) : 1;
+  if (n_workers > 1) {
+    fork_manifest_workers(argc, argv, n_workers);
+  } else {
+    if (args.progress) print_pb(0.0);
+    scan_manifest_files(argc, argv, 0, 1);
+  }
+  if (args.progress) fprintf(stderr, "\n");
+  free_cdf_tails();
+  free_manifest();
+}
+
+/* Passes over whole sequences with all motifs at once (after the thresholds
+ * have been set by the usual per-motif scan), with threads taking the next
+ * sequence as they go.
+ */
+size_t next_seq_i;
+
+static inline size_t get_next_seq(void) {
+  return __atomic_fetch_add(&next_seq_i, 1, __ATOMIC_RELAXED);
+}
+
+static inline void finish_seq(const size_t seq_i) {
+  if (args.w && !args.progress) {
+    fprintf(stderr, "    Scanned sequence: %s\n", seq_names[seq_i]);
+  }
+  if (args.progress) {
+    pthread_mutex_lock(&pb_lock);
+    pb_counter++;
+    print_pb((double) pb_counter / seq_info.n);
+    pthread_mutex_unlock(&pb_lock);
+  }
+}
+
+void run_seq_threads(void *(*sub_process)(void *), void *arg) {
+  next_seq_i = 0;
+  pb_counter = 0;
+  if (args.progress) print_pb(0.0);
+  for (size_t t = 0; t < args.nthreads; t++) {
+    pthread_create(&threads[t], NULL, sub_process, arg);
+  }
+  for (size_t t = 0; t < args.nthreads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  if (args.progress) fprintf(stderr, "\n");
+}
+
+/* For --serve, the sequences (and any -m motifs, as a library) are loaded
+ * once, then scan requests are taken over a Unix socket. Every request is
+ * handled by a forked copy of the server, which shares the loaded sequences
+ * with it and is free to swap out the motifs, threshold and regions, or to
+ * bail out with an error, without affecting later requests. The CDFs of the
+ * library motifs are computed before the first request, keeping the tail up
+ * to SERVE_CDF_PVALUE (or -t, if larger), so that a request for them with a
+ * smaller P-value only needs to find its thresholds. Up to
+ * SERVE_MAX_CHILDREN requests are served at the same time, each using all
+ * threads; finished ones are reaped as the server gets SIGCHLD, and a client
+ * which sends or reads nothing for SERVE_TIMEOUT seconds is dropped. A
+ * request is made up of these lines, ending with "scan":
+ *
+ *   pvalue <dbl>                  Threshold P-value (default: -t)
+ *   motif <str>                   Use this motif from the library
+ *   motifs                        Use these motifs (in any supported format)
+ *   ...                           instead of the library, up to a line with
+ *   end                           just "end"
+ *   region <str>[:<int>-<int>]    Only scan this (1-based, inclusive)
+ *   scan
+ *
+ * The reply is the usual output (with the hits of the sequences in the order
+ * they were scanned), then a "##done" line. Errors are sent instead.
+ */
+#define SERVE_BACKLOG                 16
+#define SERVE_MAX_CHILDREN             4
+#define SERVE_TIMEOUT                 30    /* Seconds */
+#define SERVE_CDF_PVALUE            0.01
+
+double serve_cdf_pvalue;
+
+typedef struct serve_child_t {
+  pid_t     pid;
+  size_t    request;
+  double    start;
+} serve_child_t;
+
+void *serve_sub_process(void *arg) {
+  seq_thread_i = __atomic_fetch_add((int *) arg, 1, __ATOMIC_RELAXED);
+  for (size_t seq_i = get_next_seq(); seq_i < seq_info.n; seq_i = get_next_seq()) {
+    if (anchor_regions != NULL && !anchor_regions[seq_i].n) continue;
+    for (size_t i = 0; i < motif_info.n; i++) score_seq(motifs[i], seq_i, seq_i);
+  }
+  return NULL;
+}
+
+size_t find_request_seq(const char *name) {
+  size_t i = 0;
+  while (i < seq_info.n && strcmp(seq_names[i], name)) i++;
+  return i;
+}
+
+void add_request_region(char *region) {
+  size_t seq_i = find_request_seq(region), start = 1, end = SIZE_MAX;
+  char *colon = strrchr(region, ':');
+  if (seq_i == seq_info.n && colon != NULL) {
+    int used = 0;
+    if (sscanf(colon + 1, "%zu-%zu%n", &start, &end, &used) != 2 ||
+        colon[1 + used] != '\0' || !start || start > end) {
+      badexitf("Error: Failed to parse region: %s", region);
+    }
+    *colon = '\0';
+    seq_i = find_request_seq(region);
+    *colon = ':';
+  }
+  if (seq_i == seq_info.n) {
+    badexitf("Error: Failed to find sequence of region: %s", region);
+  }
+  if (anchor_regions == NULL) {
+    anchor_regions = calloc(seq_info.n, sizeof(regions_t));
+    if (anchor_regions == NULL) badexit("Error: Failed to allocate memory for regions.");
+  }
+  if (start <= seq_sizes[seq_i]) {
+    add_region(&anchor_regions[seq_i], start - 1, MIN(end, seq_sizes[seq_i]));
+  }
+}
+
+int pick_request_motif(const char *name, const size_t n_picked) {
+  size_t i = 0;
+  while (i < motif_info.n && strcmp(motifs[i]->name, name)) i++;
+  if (i == motif_info.n) {
+    badexitf("Error: Failed to find motif in library: %s", name);
+  }
+  if (i < n_picked) return 0;            /* Already picked */
+  motif_t *tmp = motifs[n_picked];
+  motifs[n_picked] = motifs[i];
+  motifs[i] = tmp;
+  return 1;
+}
+
+/* Returns 1 if the request came with its own motifs. */
+int read_request(FILE *in) {
+  char *line = NULL, *text = NULL;
+  size_t len = 0, text_size = 0, n_picked = 0;
+  ssize_t read;
+  FILE *text_file = NULL;
+  int in_motifs = 0, complete = 0;
+  while (!complete && (read = getline(&line, &len, in)) != -1) {
+    while (read && (line[read - 1] == '\n' || line[read - 1] == '\r')) {
+      line[--read] = '\0';
+    }
+    if (in_motifs) {
+      if (!strcmp(line, "end")) {
+        in_motifs = 0;
+      } else {
+        fprintf(text_file, "%s\n", line);
+      }
+    } else if (!read || line[0] == '#') {
+      continue;
+    } else if (!strcmp(line, "scan")) {
+      complete = 1;
+    } else if (!strncmp(line, "pvalue ", 7)) {
+      args.pvalue = atof(line + 7);
+      if (args.pvalue <= 0.0 || args.pvalue > 1.0) {
+        badexit("Error: Request P-value must be greater than 0 and at most 1.");
+      }
+    } else if (!strncmp(line, "motif ", 6)) {
+      n_picked += pick_request_motif(line + 6, n_picked);
+    } else if (!strcmp(line, "motifs")) {
+      if (text_file == NULL) text_file = open_memstream(&text, &text_size);
+      if (text_file == NULL) badexit("Error: Failed to allocate memory for motifs.");
+      in_motifs = 1;
+    } else if (!strncmp(line, "region ", 7)) {
+      add_request_region(line + 7);
+    } else {
+      badexitf("Error: Unknown request line: %s", line);
+    }
+  }
+  free(line);
+  if (!complete) badexit("Error: Request ended without a scan line.");
+  if (n_picked) {
+    for (size_t i = n_picked; i < motif_info.n; i++) {
+      free(motifs[i]->bins);
+      free(motifs[i]);
+    }
+    motif_info.n = n_picked;
+  }
+  if (text_file != NULL) {
+    fclose(text_file);
+    if (n_picked) badexit("Error: Requests can't have both motif and motifs lines.");
+    if (!text_size) badexit("Error: Found no motifs between motifs and end lines.");
+    free_motifs();
+    motifs = NULL;
+    motif_info.n = motif_info.n_alloc = 0;
+    files.m = fmemopen(text, text_size, "r");
+    if (files.m == NULL) badexit("Error: Failed to read request motifs.");
+    files.m_open = 1;
+    load_motifs();
+    find_motif_dupes();
+  }
+  if (!motif_info.n) badexit("Error: Found no motifs for request.");
+  if (anchor_regions != NULL) {
+    for (size_t i = 0; i < seq_info.n; i++) merge_regions(&anchor_regions[i]);
+  }
+  return text_file != NULL;
+}
+
+void prepare_serve_motifs(void) {
+  if (alloc_cdf()) badexit("");
+  motifs_ready = 0;
+  run_motif_threads();
+  motifs_ready = 1;
+  free_cdf();
+}
+
+/* Like set_threshold(), from a CDF tail kept by the server. */
+void set_request_threshold(motif_t *motif) {
+  if (motif->threshold == INT_MAX) return;   /* Out of reach already */
+  const size_t n = motif->cdf_size - (motif->cdf_offset - motif->min * (int) motif->size);
+  size_t i = 0;
+  while (i < n && motif->cdf[i] >= args.pvalue) i++;
+  motif->threshold = motif->cdf_offset + i;
+  if (score2pval(motif, motif->max_score) / args.pvalue > 1.0001) {
+    motif->threshold = INT_MAX;
+  } else if (args.thresh0) {
+    motif->threshold = 0;
+  } else if (motif_info.is_consensus) {
+    motif->threshold = motif->max_score;
+  }
+}
+
+void serve_request(const int argc, char **argv, const int client) {
+  FILE *in = fdopen(dup(client), "r");
+  files.o = fdopen(client, "w");
+  if (in == NULL || files.o == NULL || dup2(client, STDERR_FILENO) == -1) {
+    badexit("Error: Failed to open request.");
+  }
+  files.o_open = 1;
+  args.v = 0;
+  args.w = 0;
+  args.progress = 0;
+  const int own_motifs = read_request(in);
+  fclose(in);
+  for (size_t i = 0; i < motif_info.n; i++) {
+    motifs[i]->index = i;
+    motifs[i]->thread = ((double) i / motif_info.n) * args.nthreads;
+  }
+  if (!own_motifs && args.pvalue <= serve_cdf_pvalue) {
+    for (size_t i = 0; i < motif_info.n; i++) set_request_threshold(motifs[i]);
+  } else {
+    for (size_t i = 0; i < motif_info.n && !own_motifs; i++) {
+      motifs[i]->threshold = motifs[i]->max_score = motifs[i]->min_score = 0;
+      motifs[i]->cdf_offset = motifs[i]->min * motifs[i]->size;
+    }
+    prepare_serve_motifs();
+  }
+  print_scan_header(argc, argv, NULL);
+  int n_started = 0;
+  run_seq_threads(serve_sub_process, &n_started);
+  fprintf(files.o, "##done\n");
+}
+
+/* Only there so that accept() returns when a request is done. */
+void note_child_exit(int sig) {
+  (void) sig;
+}
+
+/* Removes finished requests from the list, waiting for one if asked to. */
+void reap_requests(serve_child_t *children, size_t *n_children, const int wait) {
+  int status, options = wait ? 0 : WNOHANG;
+  while (*n_children) {
+    const pid_t pid = waitpid(-1, &status, options);
+    if (pid == 0) break;
+    if (pid == -1) {
+      if (errno == EINTR) continue;
+      *n_children = 0;                   /* ECHILD, none left after all */
+      break;
+    }
+    size_t i = 0;
+    while (i < *n_children && children[i].pid != pid) i++;
+    if (i == *n_children) continue;
+    if (args.v) {
+      fprintf(stderr, "Request %zu %s after %.3f seconds.\n", children[i].request,
+        WIFEXITED(status) && !WEXITSTATUS(status) ? "done" : "failed",
+        get_time() - children[i].start);
+    }
+    children[i] = children[--*n_children];
+    options = WNOHANG;
+  }
+}
+
+void serve(const int argc, char **argv) {
+  struct sockaddr_un addr;
+  struct stat st;
+  if (strlen(args.serve) >= sizeof(addr.sun_path)) {
+    badexit("Error: --serve socket path is too long.");
+  }
+  if (!stat(args.serve, &st)) {
+    if (!S_ISSOCK(st.st_mode)) {
+      badexitf("Error: File exists and is not a socket: %s", args.serve);
+    }
+    unlink(args.serve);                  /* Left behind by an earlier server */
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, args.serve);
+  const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server == -1 || bind(server, (struct sockaddr *) &addr, sizeof(addr)) ||
+      listen(server, SERVE_BACKLOG)) {
+    badexitf("Error: Failed to listen on socket: %s", args.serve);
+  }
+
+  /* No SA_RESTART, so that accept() returns once a stop has been requested
+   * or a request is done.
+   */
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = request_stop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+  action.sa_handler = note_child_exit;
+  sigaction(SIGCHLD, &action, NULL);
+
+  const double pvalue = args.pvalue;
+  serve_cdf_pvalue = args.pvalue = MAX(args.pvalue, SERVE_CDF_PVALUE);
+  if (motif_info.n) {
+    if (args.v) fprintf(stderr, "Preparing %'zu library motif(s) ...\n", motif_info.n);
+    prepare_serve_motifs();
+  }
+  args.pvalue = pvalue;
+  if (args.no_overlap && alloc_overlap_bufs()) badexit("");
+  if (args.v) fprintf(stderr, "Listening on %s ...\n", args.serve);
+  serve_child_t children[SERVE_MAX_CHILDREN];
+  size_t n_requests = 0, n_children = 0;
+  int failed = 0;
+  const struct timeval timeout = { .tv_sec = SERVE_TIMEOUT, .tv_usec = 0 };
+  while (!stop_requested && !failed) {
+    reap_requests(children, &n_children, n_children == SERVE_MAX_CHILDREN);
+    const int client = accept(server, NULL, NULL);
+    if (client == -1) {
+      failed = errno != EINTR && errno != ECONNABORTED;
+      continue;
+    }
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    const double time1 = get_time();
+    n_requests++;
+    fflush(stdout);
+    fflush(stderr);
+    const pid_t pid = fork();
+    if (pid == 0) {
+      close(server);
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGCHLD, SIG_DFL);
+      serve_request(argc, argv, client);
+      close_files();
+      exit(EXIT_SUCCESS);
+    }
+    close(client);
+    if (pid == -1) {
+      fprintf(stderr, "Warning: Failed to fork for request %zu.\n", n_requests);
+      continue;
+    }
+    children[n_children].pid = pid;
+    children[n_children].request = n_requests;
+    children[n_children].start = time1;
+    n_children++;
+  }
+  close(server);
+  unlink(args.serve);
+  while (n_children) reap_requests(children, &n_children, 1);
+  free_cdf_tails();
+  if (failed) {
+    badexitf("Error: Failed to accept connection on socket: %s", args.serve);
+  }
+  if (args.v) fprintf(stderr, "Stopped after %'zu requests.\n", n_requests);
+}
+
+/* For --cooccur, every sequence is scanned one position at a time with all
+ * motifs, while keeping the hits of the last <window> bases. Every new hit is
+ * paired with those, so pairs are counted without ever storing all hits.
+ */
+typedef struct cooccur_hit_t {
+  size_t   start;
+  unsigned motif_i;
+  char     strand;
+} cooccur_hit_t;
+
+typedef struct cooccur_buf_t {
+  cooccur_hit_t *hits;
+  size_t         first;
+  size_t         n;
+  size_t         n_alloc;
+} cooccur_buf_t;
+
+#define COOCCUR_MAX_MEM          ((size_t) 4 * 1024 * 1024 * 1024)
+
+size_t *cooccur_counts;                  /* Left x right motif */
+size_t *cooccur_hists;                   /* Pair x orientation x spacing */
+long   *cooccur_pairs;                   /* Histogram of each pair, or -1 */
+size_t  cooccur_n_pairs;
+
+static inline size_t cooccur_hist_size(void) {
+  return 4 * (args.cooccur + 1);
+}
+
+int set_cooccur_pairs(void) {
+  const size_t n = motif_info.n;
+  cooccur_pairs = malloc(sizeof(long) * n * n);
+  if (cooccur_pairs == NULL) {
+    note_error("Error: Failed to allocate memory for motif pairs.");
+    return 1;
+  }
+  if (args.pairs == NULL) {
+    for (size_t i = 0; i < n * n; i++) cooccur_pairs[i] = i;
+    cooccur_n_pairs = n * n;
+    return 0;
+  }
+  for (size_t i = 0; i < n * n; i++) cooccur_pairs[i] = -1;
+  cooccur_n_pairs = 0;
+  char *pairs = strdup(args.pairs), *save = NULL;
+  for (char *pair = strtok_r(pairs, ",", &save); pair != NULL; pair = strtok_r(NULL, ",", &save)) {
+    char *right = strchr(pair, ':');
+    size_t left_i = n, right_i = n;
+    if (right != NULL) {
+      *right++ = '\0';
+      for (size_t i = 0; i < n; i++) {
+        if (strcmp(motifs[i]->name, pair) == 0) left_i = i;
+        if (strcmp(motifs[i]->name, right) == 0) right_i = i;
+      }
+    }
+    if (left_i == n || right_i == n) {
+      note_error("Error: Failed to find motif pair: %s%s%s", pair,
+        right == NULL ? "" : ":", right == NULL ? "" : right);
+      free(pairs);
+      return 1;
+    }
+    if (cooccur_pairs[left_i * n + right_i] == -1) {
+      cooccur_pairs[left_i * n + right_i] = cooccur_n_pairs++;
+    }
+  }
+  free(pairs);
+  return 0;
+}
+
+int alloc_cooccur(void) {
+  if (set_cooccur_pairs()) return 1;
+  const size_t size = sizeof(size_t) * (motif_info.n * motif_info.n +
+    cooccur_n_pairs * cooccur_hist_size());
+  if (args.v) {
+    fprintf(stderr, "Approx. memory usage by co-occurrences: %'.2f MB\n", b2mb(size));
+  }
+  if (size > COOCCUR_MAX_MEM) {
+    note_error("Error: --cooccur would need %'.2f MB for its histograms (max %'.2f MB);\n",
+      b2mb(size), b2mb(COOCCUR_MAX_MEM));
+    note_error("       use --pairs to pick fewer motif pairs, or a smaller distance.");
+    return 1;
+  }
+  cooccur_counts = calloc(motif_info.n * motif_info.n, sizeof(size_t));
+  cooccur_hists = calloc(cooccur_n_pairs * cooccur_hist_size(), sizeof(size_t));
+  if (cooccur_counts == NULL || cooccur_hists == NULL) {
+    note_error("Error: Failed to allocate memory for co-occurrences (%'.2f MB).",
+      b2mb(size));
+    return 1;
+  }
+  return 0;
+}
+
+void free_cooccur(void) {
+  free(cooccur_counts);
+  free(cooccur_hists);
+  free(cooccur_pairs);
+}
+
+void add_cooccur_hit(cooccur_buf_t *buf, const size_t start, const unsigned motif_i, const char strand) {
+  for (size_t i = buf->first; i < buf->n; i++) {
+    const cooccur_hit_t *left = &buf->hits[i];
+    const size_t pair_i = left->motif_i * motif_info.n + motif_i;
+    __atomic_fetch_add(&cooccur_counts[pair_i], 1, __ATOMIC_RELAXED);
+    if (cooccur_pairs[pair_i] != -1) {
+      const size_t orientation = (left->strand == '-') * 2 + (strand == '-');
+      __atomic_fetch_add(&cooccur_hists[cooccur_pairs[pair_i] * cooccur_hist_size() +
+        orientation * (args.cooccur + 1) + start - left->start], 1, __ATOMIC_RELAXED);
+    }
+  }
+  if (buf->n == buf->n_alloc) {
+    if (buf->first) {
+      memmove(buf->hits, buf->hits + buf->first, sizeof(cooccur_hit_t) * (buf->n - buf->first));
+      buf->n -= buf->first;
+      buf->first = 0;
+    } else {
+      cooccur_hit_t *tmp = realloc(buf->hits, sizeof(cooccur_hit_t) * buf->n_alloc * 2);
+      if (tmp == NULL) badexit("Error: Failed to allocate memory for co-occurrences.");
+      buf->hits = tmp;
+      buf->n_alloc *= 2;
+    }
+  }
+  buf->hits[buf->n].start = start;
+  buf->hits[buf->n].motif_i = motif_i;
+  buf->hits[buf->n].strand = strand;
+  buf->n++;
+}
+
+void cooccur_seq(cooccur_buf_t *buf, const size_t seq_i) {
+  const unsigned char *seq = seqs[seq_i];
+  const size_t seq_size = seq_sizes[seq_i];
+  int score, score_rc;
+  buf->first = 0;
+  buf->n = 0;
+  for (size_t i = 0; i < seq_size; i++) {
+    while (buf->first < buf->n && buf->hits[buf->first].start + args.cooccur < i) {
+      buf->first++;
+    }
+    for (size_t j = 0; j < motif_info.n; j++) {
+      const motif_t *motif = motifs[j];
+      if (motif->threshold == INT_MAX || i + motif->size > seq_size) continue;
+      const int threshold = motif->threshold - 1;
+      if (args.scan_rc) {
+        score_subseq_rc(motif, seq, i, &score, &score_rc);
+        if (score > threshold) add_cooccur_hit(buf, i, j, '+');
+        if (score_rc > threshold) add_cooccur_hit(buf, i, j, '-');
+      } else {
+        score_subseq(motif, seq, i, &score);
+        if (score > threshold) add_cooccur_hit(buf, i, j, '+');
+      }
+    }
+  }
+}
+
+void *cooccur_sub_process(void *arg) {
+  (void) arg;
+  cooccur_buf_t buf;
+  buf.n_alloc = ALLOC_CHUNK_SIZE;
+  buf.hits = malloc(sizeof(cooccur_hit_t) * buf.n_alloc);
+  if (buf.hits == NULL) badexit("Error: Failed to allocate memory for co-occurrences.");
+  for (size_t seq_i = get_next_seq(); seq_i < seq_info.n; seq_i = get_next_seq()) {
+    cooccur_seq(&buf, seq_i);
+    finish_seq(seq_i);
+  }
+  free(buf.hits);
+  return NULL;
+}
+
+void print_cooccur(void) {
+  const char *orientations[] = { "++", "+-", "-+", "--" };
+  const size_t n = motif_info.n;
+  fprintf(files.o, "##motif");
+  for (size_t i = 0; i < n; i++) fprintf(files.o, "\t%s", motifs[i]->name);
+  fprintf(files.o, "\n");
+  for (size_t i = 0; i < n; i++) {
+    fprintf(files.o, "%s", motifs[i]->name);
+    for (size_t j = 0; j < n; j++) {
+      fprintf(files.o, "\t%zu", cooccur_counts[i * n + j]);
+    }
+    fprintf(files.o, "\n");
+  }
+  fprintf(files.o, "##left\tright\torientation");
+  for (size_t i = 0; i <= args.cooccur; i++) fprintf(files.o, "\t%zu", i);
+  fprintf(files.o, "\n");
+  for (size_t i = 0; i < n * n; i++) {
+    if (cooccur_pairs[i] == -1) continue;
+    const size_t *hist = cooccur_hists + cooccur_pairs[i] * cooccur_hist_size();
+    for (size_t j = 0; j < (args.scan_rc ? 4 : 1); j++) {
+      fprintf(files.o, "%s\t%s\t%s", motifs[i / n]->name, motifs[i % n]->name,
+        orientations[j]);
+      for (size_t k = 0; k <= args.cooccur; k++) {
+        fprintf(files.o, "\t%zu", hist[j * (args.cooccur + 1) + k]);
+      }
+      fprintf(files.o, "\n");
+    }
+  }
+}
+
+void *shuffle_sub_process(void *max_size) {
+  shuffle_buf_t buf;
+  size_t *hits = calloc(motif_info.n, sizeof(size_t));
+  if (hits == NULL || alloc_shuffle_buf(&buf, *((size_t *) max_size))) {
+    badexit("");
+  }
+  for (size_t seq_i = get_next_seq(); seq_i < seq_info.n; seq_i = get_next_seq()) {
+    for (size_t i = 0; i < args.shuffle; i++) {
+      shuffle_seq(&buf, seq_i, i);
+      for (size_t j = 0; j < motif_info.n; j++) {
+        hits[j] += count_seq_hits(motifs[j], buf.seq, seq_sizes[seq_i]);
+      }
+    }
+    finish_seq(seq_i);
+  }
+  pthread_mutex_lock(&shuffle_lock);
+  for (size_t i = 0; i < motif_info.n; i++) shuffle_hits[i * 2 + 1] += hits[i];
+  pthread_mutex_unlock(&shuffle_lock);
+  free_shuffle_buf(&buf);
+  free(hits);
+  return NULL;
+}
+
+void scan_shuffles(void) {
+  size_t max_size = 0;
+  for (size_t i = 0; i < seq_info.n; i++) max_size = MAX(max_size, seq_sizes[i]);
+  run_seq_threads(shuffle_sub_process, &max_size);
+}
+
+#ifdef MINIMOTIF_LIB
+
+/* The library API (see minimotif.h). A context holds the options and motifs
+ * of a scan. Every API call copies its context into the thread-local globals
+ * (lib_enter) and, if it changed anything, back out again (lib_leave), and
+ * sets up lib_jmp for badexit() before doing anything else. Sequences are
+ * scanned in place, using a single slot in seqs[], seq_names[] and
+ * seq_sizes[] which only exists during mm_scan(). Nothing in a context is
+ * changed by scanning, so any number of threads can scan with it at once.
+ *
+ * This is not a rewrite of the scanner around contexts: the CLI still keeps
+ * its state in plain globals and exits on errors. The library never starts
+ * threads of its own (args.nthreads stays at 1, and motifs are loaded one
+ * at a time), so callers wanting more speed scan from several threads. Since
+ * badexit() jumps straight back here, every API function must free whatever
+ * the code it called may have allocated before returning -1.
+ */
+struct mm_ctx_t {
+  args_t        args;
+  motif_t     **motifs;
+  motif_info_t  motif_info;
+  size_t        n_ready;                 /* How many have CDF tails */
+};
+
+void lib_enter(const mm_ctx_t *ctx) {
+  args = ctx->args;
+  motifs = ctx->motifs;
+  motif_info = ctx->motif_info;
+  lib_error_note[0] = '\0';
+}
+
+void lib_leave(mm_ctx_t *ctx) {
+  ctx->args = args;
+  ctx->motifs = motifs;
+  ctx->motif_info = motif_info;
+  motifs = NULL;
+  motif_info.n = 0;
+}
+
+void lib_unload_motifs(mm_ctx_t *ctx) {
+  if (files.m_open) fclose(files.m);
+  files.m_open = 0;
+  for (size_t i = 0; i < ctx->n_ready; i++) {
+    if (motifs[i]->threshold != INT_MAX) free(motifs[i]->cdf);
+  }
+  ctx->n_ready = 0;
+  free_motifs();
+  motifs = NULL;
+  motif_info.n = 0;
+  motif_info.n_alloc = 0;
+}
+
+void mm_default_options(mm_options_t *options) {
+  for (int i = 0; i < 4; i++) options->bkg[i] = default_args.bkg[i];
+  options->use_bkg = default_args.use_user_bkg;
+  options->nsites = default_args.nsites;
+  options->pseudocount = default_args.pseudocount;
+  options->forward_only = !default_args.scan_rc;
+  options->no_overlap = default_args.no_overlap;
+  options->dedup = default_args.dedup;
+}
+
+mm_ctx_t *mm_new(void) {
+  mm_ctx_t *ctx = calloc(1, sizeof(mm_ctx_t));
+  if (ctx == NULL) {
+    snprintf(lib_error, sizeof(lib_error), "Error: Failed to allocate memory for context.");
+    return NULL;
+  }
+  ctx->args = default_args;
+  return ctx;
+}
+
+int mm_set_options(mm_ctx_t *ctx, const mm_options_t *options) {
+  lib_enter(ctx);
+  if (setjmp(lib_jmp)) {
+    lib_enter(ctx);                      /* Leave the options as they were */
+    lib_leave(ctx);
+    return -1;
+  }
+  double bkg[4];
+  for (int i = 0; i < 4; i++) bkg[i] = options->use_bkg ? options->bkg[i] : default_args.bkg[i];
+  if (check_and_load_bkg(bkg)) {
+    badexit("Error: Background values must all be given.");
+  } else if (options->nsites < 1) {
+    badexit("Error: nsites must be greater than 0.");
+  } else if (options->pseudocount < 0) {
+    badexit("Error: pseudocount must be a positive integer.");
+  }
+  args.use_user_bkg = options->use_bkg != 0;
+  args.nsites = options->nsites;
+  args.pseudocount = options->pseudocount;
+  args.scan_rc = !options->forward_only;
+  args.no_overlap = options->no_overlap;
+  args.dedup = options->dedup;
+  lib_leave(ctx);
+  return 0;
+}
+
+int mm_load_motifs(mm_ctx_t *ctx, const char *text, size_t size, double pvalue) {
+  lib_enter(ctx);
+  if (setjmp(lib_jmp)) {
+    free_cdf();
+    lib_unload_motifs(ctx);
+    lib_leave(ctx);
+    return -1;
+  }
+  lib_unload_motifs(ctx);
+  if (!size) badexit("Error: No motifs given.");
+  if (pvalue <= 0.0 || pvalue > 1.0) {
+    badexit("Error: P-value must be greater than 0 and at most 1.");
+  }
+  args.pvalue = pvalue;
+  /* Like for the CLI, a MEME background only applies to its own motifs. */
+  if (!args.use_user_bkg) memcpy(args.bkg, default_args.bkg, sizeof(args.bkg));
+  files.m = fmemopen((void *) text, size, "r");
+  if (files.m == NULL) badexit("Error: Failed to read motifs.");
+  files.m_open = 1;
+  load_motifs();
+  fclose(files.m);
+  files.m_open = 0;
+  find_motif_dupes();
+  if (alloc_cdf()) badexit("");
+  for (size_t i = 0; i < motif_info.n; i++) {
+    motifs[i]->index = i;
+    motifs[i]->thread = 0;
+    start_motif_scan(motifs[i]);
+    ctx->n_ready++;
+  }
+  free_cdf();
+  lib_leave(ctx);
+  return ctx->n_ready;
+}
+
+size_t mm_motif_count(const mm_ctx_t *ctx) {
+  return ctx->n_ready;
+}
+
+const char *mm_motif_name(const mm_ctx_t *ctx, size_t motif_i) {
+  return motif_i < ctx->n_ready ? ctx->motifs[motif_i]->name : NULL;
+}
+
+size_t mm_motif_size(const mm_ctx_t *ctx, size_t motif_i) {
+  return motif_i < ctx->n_ready ? ctx->motifs[motif_i]->size : 0;
+}
+
+double mm_motif_threshold(const mm_ctx_t *ctx, size_t motif_i) {
+  if (motif_i >= ctx->n_ready || ctx->motifs[motif_i]->threshold == INT_MAX) return NAN;
+  return ctx->motifs[motif_i]->threshold / PWM_INT_MULTIPLIER;
+}
+
+int mm_scan(const mm_ctx_t *ctx, const char *seq_name, const char *seq, size_t size,
+  mm_hit_fn fn, void *data) {
+  unsigned char *seq_slot = (unsigned char *) seq;
+  char *name_slot = (char *) seq_name;
+  size_t size_slot = size;
+  lib_enter(ctx);
+  if (setjmp(lib_jmp)) {
+    seqs = NULL; seq_names = NULL; seq_sizes = NULL; seq_info.n = 0;
+    motifs = NULL; motif_info.n = 0;
+    free_overlap_bufs();
+    return -1;
+  }
+  if (!ctx->n_ready) badexit("Error: No motifs loaded.");
+  if (args.no_overlap && alloc_overlap_bufs()) badexit("");
+  seqs = &seq_slot;
+  seq_names = &name_slot;
+  seq_sizes = &size_slot;
+  seq_info.n = 1;
+  lib_hit_fn = fn;
+  lib_hit_data = data;
+  for (size_t i = 0; i < ctx->n_ready; i++) score_seq(motifs[i], 0, 0);
+  free_overlap_bufs();
+  seqs = NULL; seq_names = NULL; seq_sizes = NULL; seq_info.n = 0;
+  motifs = NULL; motif_info.n = 0;
+  return 0;
+}
+
+void lib_add_hit(const mm_hit_t *hit, void *hits_ptr) {
+  mm_hits_t *hits = (mm_hits_t *) hits_ptr;
+  if (hits->n == hits->n_alloc) {
+    hits->n_alloc += ALLOC_CHUNK_SIZE;
+    mm_hit_t *tmp = realloc(hits->hits, sizeof(mm_hit_t) * hits->n_alloc);
+    if (tmp == NULL) badexit("Error: Failed to allocate memory for hits.");
+    hits->hits = tmp;
+  }
+  hits->hits[hits->n++] = *hit;
+}
+
+int mm_scan_hits(const mm_ctx_t *ctx, const char *seq_name, const char *seq, size_t size,
+  mm_hits_t *hits) {
+  return mm_scan(ctx, seq_name, seq, size, lib_add_hit, hits);
+}
+
+void mm_free_hits(mm_hits_t *hits) {
+  free(hits->hits);
+  hits->hits = NULL;
+  hits->n = 0;
+  hits->n_alloc = 0;
+}
+
+const char *mm_error(void) {
+  return lib_error;
+}
+
+void mm_free(mm_ctx_t *ctx) {
+  if (ctx == NULL) return;
+  lib_enter(ctx);
+  lib_unload_motifs(ctx);
+  motif_info.n_alloc = 0;
+  free(ctx);
+}
+
+#else
+
+/* Options without a short version.
+ */
+enum LONG_OPTS {
+  OPT_NO_OVERLAP = 256,
+  OPT_BEST,
+  OPT_TOP,
+  OPT_COUNT,
+  OPT_BINARY,
+  OPT_SHUFFLE,
+  OPT_KMER,
+  OPT_SEED,
+  OPT_TRACK,
+  OPT_TRACK_INT,
+  OPT_BINS,
+  OPT_BIN_STAT,
+  OPT_OCCUPANCY,
+  OPT_COOCCUR,
+  OPT_PAIRS,
+  OPT_ANCHOR,
+  OPT_ANCHOR_WINDOW,
+  OPT_VCF,
+  OPT_SAMPLE,
+  OPT_AUTO,
+  OPT_MEM,
+  OPT_CHECKPOINT,
+  OPT_RESUME,
+  OPT_SHARD,
+  OPT_MERGE,
+  OPT_MANIFEST,
+  OPT_CACHE,
+  OPT_SERVE,
+  OPT_SHM,
+  OPT_NUMA
+};
+
+static const struct option long_opts[] = {
+  {"no-overlap",    optional_argument,  NULL,  OPT_NO_OVERLAP},
+  {"best",          required_argument,  NULL,  OPT_BEST},
+  {"top",           required_argument,  NULL,  OPT_TOP},
+  {"count",         optional_argument,  NULL,  OPT_COUNT},
+  {"binary",        no_argument,        NULL,  OPT_BINARY},
+  {"shuffle",       required_argument,  NULL,  OPT_SHUFFLE},
+  {"kmer",          required_argument,  NULL,  OPT_KMER},
+  {"seed",          required_argument,  NULL,  OPT_SEED},
+  {"track",         required_argument,  NULL,  OPT_TRACK},
+  {"track-int",     no_argument,        NULL,  OPT_TRACK_INT},
+  {"bins",          required_argument,  NULL,  OPT_BINS},
+  {"bin-stat",      required_argument,  NULL,  OPT_BIN_STAT},
+  {"occupancy",     no_argument,        NULL,  OPT_OCCUPANCY},
+  {"cooccur",       required_argument,  NULL,  OPT_COOCCUR},
+  {"pairs",         required_argument,  NULL,  OPT_PAIRS},
+  {"anchor",        required_argument,  NULL,  OPT_ANCHOR},
+  {"anchor-window", required_argument,  NULL,  OPT_ANCHOR_WINDOW},
+  {"vcf",           required_argument,  NULL,  OPT_VCF},
+  {"sample",        required_argument,  NULL,  OPT_SAMPLE},
+  {"auto",          no_argument,        NULL,  OPT_AUTO},
+  {"mem",           required_argument,  NULL,  OPT_MEM},
+  {"checkpoint",    required_argument,  NULL,  OPT_CHECKPOINT},
+  {"resume",        no_argument,        NULL,  OPT_RESUME},
+  {"shard",         required_argument,  NULL,  OPT_SHARD},
+  {"merge",         no_argument,        NULL,  OPT_MERGE},
+  {"manifest",      required_argument,  NULL,  OPT_MANIFEST},
+  {"cache",         required_argument,  NULL,  OPT_CACHE},
+  {"serve",         required_argument,  NULL,  OPT_SERVE},
+  {"shm",           required_argument,  NULL,  OPT_SHM},
+  {"numa",          no_argument,        NULL,  OPT_NUMA},
+  {NULL,            0,                  NULL,  0}
+};
+
+int main(int argc, char **argv) {
+
+  args = default_args;
+
+  if (setlocale(LC_NUMERIC, "en_US") == NULL && args.v) {
+    fprintf(stderr, "Warning: setlocale(LC_NUMERIC, \"en_US\") failed.\n");
+  }
+
+  motifs = malloc(sizeof(*motifs) * ALLOC_CHUNK_SIZE);
+  if (motifs == NULL) {
+    badexit("Error: Failed to allocate memory for motifs.");
+  } else {
+    motif_info.n_alloc = ALLOC_CHUNK_SIZE;
+  }
+  seq_names = malloc(sizeof(*seq_names) * ALLOC_CHUNK_SIZE);
+  if (seq_names == NULL) {
+    badexit("Error: Failed to allocate memory for sequence names.");
+  }
+  seqs = malloc(sizeof(*seqs) * ALLOC_CHUNK_SIZE);
+  if (seqs == NULL) {
+    badexit("Error: Failed to allocate memory for sequences.");
   }
   seq_sizes = malloc(sizeof(*seq_sizes) * ALLOC_CHUNK_SIZE);
   if (seq_sizes == NULL) {
@@ -2182,14 +7422,15 @@ int main(int argc, char **argv) {
   }
 
   kseq_t *kseq;
-  char *user_bkg, *consensus;
+  char *user_bkg, *consensus = NULL, *output_name = NULL;
   int has_motifs = 0, has_seqs = 0, has_consensus = 0;
-  int use_stdout = 1, use_stdin = 0, use_manual_thresh = 0;
+  int use_stdout = 1, use_stdin = 0, use_manual_thresh = 0, has_threads = 0;
   size_t max_seq_size;
 
   int opt;
 
-  while ((opt = getopt(argc, argv, "m:1:s:o:b:flt:p:n:j:dgrvwh0")) != -1) {
+  while ((opt = getopt_long(argc, argv, "m:1:s:B:o:b:flt:p:n:j:dgrvwh0qQ",
+          long_opts, NULL)) != -1) {
     switch (opt) {
       case 'm':
         if (has_consensus) {
@@ -2198,8 +7439,7 @@ int main(int argc, char **argv) {
         has_motifs = 1;
         files.m = fopen(optarg, "r");
         if (files.m == NULL) {
-          fprintf(stderr, "Error: Failed to open motif file: %s", optarg);
-          badexit("");
+          badexitf("Error: Failed to open motif file: %s", optarg);
         }
         files.m_open = 1;
         break;
@@ -2218,20 +7458,22 @@ int main(int argc, char **argv) {
         } else {
           files.s = gzopen(optarg, "r");
           if (files.s == NULL) {
-            fprintf(stderr, "Error: Failed to open sequence file: %s", optarg);
-            badexit("");
+            badexitf("Error: Failed to open sequence file: %s", optarg);
           }
         }
         files.s_open = 1;
         break;
+      case 'B':
+        args.enrich = 1;
+        files.b = gzopen(optarg, "r");
+        if (files.b == NULL) {
+          badexitf("Error: Failed to open background sequence file: %s", optarg);
+        }
+        files.b_open = 1;
+        break;
       case 'o':
         use_stdout = 0;
-        files.o = fopen(optarg, "w");
-        if (files.o == NULL) {
-          fprintf(stderr, "Error: Failed to create output file: %s", optarg);
-          badexit("");
-        }
-        files.o_open = 1;
+        output_name = optarg;
         break;
       case 'b':
         args.use_user_bkg = 1;
@@ -2261,6 +7503,7 @@ int main(int argc, char **argv) {
         if (!args.nthreads) {
           badexit("Error: -j must be a positive integer.");
         }
+        has_threads = 1;
         break;
       case 'd':
         args.dedup = 1;
@@ -2274,6 +7517,155 @@ int main(int argc, char **argv) {
       case '0':
         args.thresh0 = 1;
         break;
+      case 'Q':
+        args.qvalues_global = 1;
+        args.qvalues = 1;
+        break;
+      case 'q':
+        args.qvalues = 1;
+        break;
+      case OPT_NO_OVERLAP:
+        args.no_overlap = 1;
+        if (optarg != NULL) {
+          if (strcmp(optarg, "strand")) {
+            badexit("Error: --no-overlap only accepts 'strand' as an argument.");
+          }
+          args.overlap_strand = 1;
+        }
+        break;
+      case OPT_BEST:
+        if (atol(optarg) < 1) {
+          badexit("Error: --best must be a positive integer.");
+        }
+        args.best = atol(optarg);
+        break;
+      case OPT_TOP:
+        if (atol(optarg) < 1) {
+          badexit("Error: --top must be a positive integer.");
+        }
+        args.top = atol(optarg);
+        break;
+      case OPT_COUNT:
+        args.count = 1;
+        if (optarg != NULL) {
+          if (strcmp(optarg, "strand")) {
+            badexit("Error: --count only accepts 'strand' as an argument.");
+          }
+          args.count_strand = 1;
+        }
+        break;
+      case OPT_BINARY:
+        args.binary = 1;
+        break;
+      case OPT_SHUFFLE:
+        if (atol(optarg) < 1) {
+          badexit("Error: --shuffle must be a positive integer.");
+        }
+        args.shuffle = atol(optarg);
+        break;
+      case OPT_KMER:
+        args.kmer = atoi(optarg);
+        if (args.kmer < 1 || args.kmer > 8) {
+          badexit("Error: --kmer must be between 1 and 8.");
+        }
+        break;
+      case OPT_SEED:
+        args.seed = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_TRACK:
+        args.track = optarg;
+        break;
+      case OPT_TRACK_INT:
+        args.track_int = 1;
+        break;
+      case OPT_BINS:
+        if (atol(optarg) < 1) {
+          badexit("Error: --bins must be a positive integer.");
+        }
+        args.bin_size = atol(optarg);
+        break;
+      case OPT_BIN_STAT:
+        if (strcmp(optarg, "count") == 0) {
+          args.bin_stat = BIN_COUNT;
+        } else if (strcmp(optarg, "max") == 0) {
+          args.bin_stat = BIN_MAX;
+        } else if (strcmp(optarg, "occupancy") == 0) {
+          args.bin_stat = BIN_OCCUPANCY;
+        } else {
+          badexit("Error: --bin-stat must be one of 'count', 'max' or 'occupancy'.");
+        }
+        break;
+      case OPT_OCCUPANCY:
+        args.occupancy = 1;
+        break;
+      case OPT_COOCCUR:
+        if (atol(optarg) < 1) {
+          badexit("Error: --cooccur must be a positive integer.");
+        }
+        args.cooccur = atol(optarg);
+        break;
+      case OPT_PAIRS:
+        args.pairs = optarg;
+        break;
+      case OPT_ANCHOR:
+        args.anchors = optarg;
+        break;
+      case OPT_ANCHOR_WINDOW:
+        if (atol(optarg) < 0) {
+          badexit("Error: --anchor-window must be zero or a positive integer.");
+        }
+        args.anchor_window = atol(optarg);
+        break;
+      case OPT_VCF:
+        files.v = gzopen(optarg, "r");
+        if (files.v == NULL) {
+          badexitf("Error: Failed to open VCF file: %s", optarg);
+        }
+        files.v_open = 1;
+        break;
+      case OPT_SAMPLE:
+        args.sample = atof(optarg);
+        if (args.sample <= 0.0 || args.sample > 1.0) {
+          badexit("Error: --sample must be greater than 0 and at most 1.");
+        }
+        break;
+      case OPT_AUTO:
+        args.auto_plan = 1;
+        break;
+      case OPT_MEM:
+        if (parse_mem_size(optarg, &args.mem)) {
+          badexit("Error: --mem must be a size such as 512M or 8G.");
+        }
+        break;
+      case OPT_CHECKPOINT:
+        args.checkpoint = optarg;
+        break;
+      case OPT_RESUME:
+        args.resume = 1;
+        break;
+      case OPT_SHARD:
+        if (parse_shard(optarg)) {
+          badexit("Error: --shard must be i/N, with i between 1 and N.");
+        }
+        break;
+      case OPT_MERGE:
+        args.merge = 1;
+        break;
+      case OPT_MANIFEST:
+        args.manifest = optarg;
+        break;
+      case OPT_CACHE:
+        args.cache = optarg;
+        break;
+      case OPT_SERVE:
+        args.serve = optarg;
+        break;
+      case OPT_SHM:
+        args.shm = optarg;
+        break;
+      case OPT_NUMA:
+        args.numa = 1;
+        break;
       case 'g':
         args.progress = 1;
         break;
@@ -2290,6 +7682,125 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (args.best && args.no_overlap) {
+    badexit("Error: Cannot use both --best and --no-overlap.");
+  } else if (args.top && (args.best || args.no_overlap)) {
+    badexit("Error: --top cannot be used with --best or --no-overlap.");
+  } else if (args.top && args.qvalues) {
+    badexit("Error: Cannot use both --top and -q/-Q.");
+  } else if (args.count && (args.top || args.qvalues)) {
+    badexit("Error: --count cannot be used with --top or -q/-Q.");
+  } else if (args.binary && !args.count && !args.bin_size && !args.occupancy) {
+    badexit("Error: --binary can only be used with --count, --bins or --occupancy.");
+  } else if (args.enrich && (args.best || args.top || args.count ||
+        args.qvalues || args.no_overlap)) {
+    badexit("Error: -B cannot be used with -q/-Q, --no-overlap, --best, --top or --count.");
+  } else if (args.enrich && (!has_seqs || !has_motifs)) {
+    badexit("Error: -B needs both -s and -m.");
+  } else if (args.shuffle && (args.enrich || args.best || args.top ||
+        args.count || args.qvalues || args.no_overlap)) {
+    badexit("Error: --shuffle cannot be used with -B, -q/-Q, --no-overlap, --best, --top or --count.");
+  } else if (args.track != NULL && (args.shuffle || args.enrich || args.best ||
+        args.top || args.count || args.qvalues || args.no_overlap)) {
+    badexit("Error: --track cannot be used with any other output mode.");
+  } else if (args.track_int && args.track == NULL) {
+    badexit("Error: --track-int can only be used with --track.");
+  } else if (args.bin_size && (args.track != NULL || args.shuffle ||
+        args.enrich || args.best || args.top || args.count || args.qvalues ||
+        args.no_overlap)) {
+    badexit("Error: --bins cannot be used with any other output mode.");
+  } else if (args.occupancy && (args.bin_size || args.track != NULL ||
+        args.shuffle || args.enrich || args.best || args.top || args.count ||
+        args.qvalues || args.no_overlap)) {
+    badexit("Error: --occupancy cannot be used with any other output mode.");
+  } else if (args.cooccur && (args.occupancy || args.bin_size ||
+        args.track != NULL || args.shuffle || args.enrich || args.best ||
+        args.top || args.count || args.qvalues || args.no_overlap)) {
+    badexit("Error: --cooccur cannot be used with any other output mode.");
+  } else if (args.pairs != NULL && !args.cooccur) {
+    badexit("Error: --pairs can only be used with --cooccur.");
+  } else if (args.anchors != NULL && (args.cooccur || args.occupancy ||
+        args.bin_size || args.track != NULL || args.shuffle || args.enrich ||
+        args.best || args.top || args.qvalues)) {
+    badexit("Error: --anchor can only be combined with --no-overlap and --count.");
+  } else if (files.v_open && (args.anchors != NULL || args.cooccur ||
+        args.occupancy || args.bin_size || args.track != NULL || args.shuffle ||
+        args.enrich || args.best || args.top || args.count || args.qvalues ||
+        args.no_overlap)) {
+    badexit("Error: --vcf cannot be used with any other output mode.");
+  } else if (args.sample > 0.0 && (files.v_open || args.anchors != NULL ||
+        args.cooccur || args.occupancy || args.bin_size || args.track != NULL ||
+        args.shuffle || args.enrich || args.best || args.top || args.count ||
+        args.qvalues)) {
+    badexit("Error: --sample can only be combined with --no-overlap.");
+  } else if (args.mem && (args.sample > 0.0 || files.v_open ||
+        args.anchors != NULL || args.cooccur || args.bin_size ||
+        args.track != NULL || args.shuffle || args.enrich)) {
+    badexit("Error: --mem can only be combined with -q/-Q, --no-overlap, --best, --top, --count and --occupancy.");
+  } else if (args.mem && use_stdin) {
+    badexit("Error: --mem cannot be used when reading sequences from stdin.");
+  } else if (args.checkpoint != NULL && (args.qvalues || args.top ||
+        args.count || args.occupancy || args.bin_size || args.track != NULL ||
+        args.shuffle || args.enrich || args.cooccur || files.v_open ||
+        args.anchors != NULL || args.sample > 0.0)) {
+    badexit("Error: --checkpoint can only be combined with --no-overlap, --best and --mem.");
+  } else if (args.checkpoint != NULL && use_stdout) {
+    badexit("Error: --checkpoint needs an output file (-o).");
+  } else if (args.resume && args.checkpoint == NULL) {
+    badexit("Error: --resume needs --checkpoint.");
+  } else if (args.shard_n && (args.qvalues || args.top || args.count ||
+        args.occupancy || args.bin_size || args.track != NULL || args.shuffle ||
+        args.enrich || args.cooccur || files.v_open || args.anchors != NULL ||
+        args.sample > 0.0 || args.binary)) {
+    badexit("Error: --shard can only be combined with --no-overlap, --best, --mem and --checkpoint.");
+  } else if (args.merge && (has_motifs || has_consensus || has_seqs || args.shard_n)) {
+    badexit("Error: --merge cannot be combined with -m, -1, -s or --shard.");
+  } else if (args.manifest != NULL && (has_seqs || !use_stdout)) {
+    badexit("Error: --manifest cannot be combined with -s or -o.");
+  } else if (args.manifest != NULL && !has_motifs && !has_consensus) {
+    badexit("Error: --manifest needs -m or -1.");
+  } else if (args.manifest != NULL && (args.qvalues || args.top || args.bin_size ||
+        args.track != NULL || args.shuffle || args.enrich || args.cooccur ||
+        files.v_open || args.anchors != NULL || args.sample > 0.0 || args.binary ||
+        args.mem || args.auto_plan || args.checkpoint != NULL || args.shard_n ||
+        args.merge)) {
+    badexit("Error: --manifest can only be combined with --no-overlap, --best, --count and --occupancy.");
+  } else if (args.cache != NULL && (args.qvalues || args.top || args.count ||
+        args.occupancy || args.bin_size || args.track != NULL || args.shuffle ||
+        args.enrich || args.cooccur || files.v_open || args.anchors != NULL ||
+        args.sample > 0.0 || args.binary || args.mem || args.manifest != NULL)) {
+    badexit("Error: --cache can only be combined with --no-overlap, --best, --checkpoint and --shard.");
+  } else if (args.serve != NULL && (!has_seqs || use_stdin || !use_stdout)) {
+    badexit("Error: --serve needs -s (not stdin) and cannot be combined with -o.");
+  } else if (args.serve != NULL && (args.qvalues || args.top || args.count ||
+        args.occupancy || args.bin_size || args.track != NULL || args.shuffle ||
+        args.enrich || args.cooccur || files.v_open || args.anchors != NULL ||
+        args.sample > 0.0 || args.binary || args.mem || args.auto_plan ||
+        args.checkpoint != NULL || args.shard_n || args.merge ||
+        args.manifest != NULL || args.cache != NULL || args.best)) {
+    badexit("Error: --serve can only be combined with --no-overlap.");
+  } else if (args.shm != NULL && (!has_seqs || !has_motifs || !use_stdout)) {
+    badexit("Error: --shm needs -s and -m, and cannot be combined with -o.");
+  } else if (args.shm != NULL && (args.qvalues || args.top || args.count ||
+        args.occupancy || args.bin_size || args.track != NULL || args.shuffle ||
+        args.enrich || args.cooccur || files.v_open || args.anchors != NULL ||
+        args.sample > 0.0 || args.binary || args.checkpoint != NULL ||
+        args.shard_n || args.merge || args.manifest != NULL || args.cache != NULL ||
+        args.serve != NULL || args.best)) {
+    badexit("Error: --shm can only be combined with --no-overlap, --mem and --auto.");
+  } else if (args.numa && (args.mem || args.sample > 0.0 || files.v_open)) {
+    badexit("Error: --numa cannot be combined with --mem, --sample or --vcf.");
+  }
+
+  if (output_name != NULL) {
+    /* When resuming, the output is truncated to what the checkpoint covers. */
+    files.o = fopen(output_name, args.resume ? "a" : "w");
+    if (files.o == NULL) {
+      badexitf("Error: Failed to create output file: %s", output_name);
+    }
+    files.o_open = 1;
+  }
+
   if (use_manual_thresh && args.thresh0) {
     badexit("Error: Cannot use both -t and -0.");
   } else if (use_manual_thresh && has_consensus) {
@@ -2301,6 +7812,15 @@ int main(int argc, char **argv) {
     files.o_open = 1;
   }
 
+  if (args.merge) {
+    merge_shards(argv + optind, argc - optind);
+    close_files();
+    free(threads);
+    free_motifs();
+    free_seqs();
+    return EXIT_SUCCESS;
+  }
+
   if (!has_seqs && !has_motifs && !has_consensus) {
     badexit("Error: Missing one of -m, -1, -s args.");
   }
@@ -2320,21 +7840,29 @@ int main(int argc, char **argv) {
     find_motif_dupes();
   }
 
-  if (has_consensus || !has_seqs || !has_motifs || motif_info.n == 1) {
-    if (args.nthreads > 1) {
+  if (args.auto_plan && !has_threads) {
+    const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    args.nthreads = cores > 0 ? cores : 1;
+  }
+
+  if (args.serve == NULL && args.manifest == NULL && (has_consensus || !has_seqs ||
+        !has_motifs || motif_info.n == 1)) {
+    if (args.nthreads > 1 && !args.auto_plan) {
       fprintf(stderr, "Note: Multi-threading not available for current inputs.\n");
     }
     args.nthreads = 1;
   }
 
-  if (use_stdin || args.nthreads > 1) {
+  if (use_stdin || (args.nthreads > 1 && !args.auto_plan && !args.mem) || args.enrich || args.shuffle ||
+      args.cooccur || files.v_open || args.serve != NULL) {
     if (args.low_mem && args.v) {
       fprintf(stderr, "Deactivating low-mem mode.\n");
-      args.low_mem = 0;
     }
+    args.low_mem = 0;
   }
+  if (args.mem) args.low_mem = 1;        /* Peek first, then load in batches */
 
-  if (has_motifs) {
+  if (has_motifs || args.serve != NULL) {
     pthread_t *tmp_threads = realloc(threads, sizeof(pthread_t) * args.nthreads);
     if (tmp_threads == NULL) {
       badexit("Error: Failed to re-allocate memory for threads.");
@@ -2345,6 +7873,21 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (args.manifest != NULL) {
+    time_t time1 = time(NULL);
+    scan_manifest(argc, argv);
+    time_t time2 = time(NULL);
+    time_t time3 = difftime(time2, time1);
+    if (args.v) fprintf(stderr, "Done.\n");
+    if (args.v && time3 > 1) fprintf(stderr, "Needed %'zu seconds to scan.\n",
+        (size_t) time3);
+    close_files();
+    free(threads);
+    free_motifs();
+    free_seqs();
+    return EXIT_SUCCESS;
+  }
+
   if (has_motifs && !has_seqs) {
     if (args.v) {
       fprintf(stderr,
@@ -2373,6 +7916,7 @@ int main(int argc, char **argv) {
   if (has_seqs) {
     kseq = kseq_init(files.s);
     time_t time1 = time(NULL);
+    const double read_time = get_time();
     if (args.v) {
       if (args.low_mem) fprintf(stderr, "Peaking through sequences ...\n");
       else fprintf(stderr, "Reading sequences ...\n");
@@ -2382,7 +7926,31 @@ int main(int argc, char **argv) {
     } else {
       load_seqs(kseq);
     }
-    find_seq_dupes();
+    if (args.enrich) {
+      seq_info.n_target = seq_info.n;
+      if (args.v) fprintf(stderr, "Reading background sequences ...\n");
+      load_seqs(kseq_init(files.b));
+      if (seq_info.n == seq_info.n_target) {
+        badexit("Error: Failed to read any background sequences.");
+      }
+    } else {
+      find_seq_dupes();
+    }
+    if (files.v_open) load_variants();
+    if (args.auto_plan && has_motifs) {
+      const int peeked = args.low_mem;
+      plan_scan(get_time() - read_time, peeked);
+      if (peeked && !args.low_mem && !args.mem) {
+        if (args.v) fprintf(stderr, "Reading sequences ...\n");
+        /* Peeking only grows the names and sizes, load_seqs() expects all three. */
+        unsigned char **tmp_seqs = realloc(seqs, sizeof(*seqs) * seq_info.n_alloc);
+        if (tmp_seqs == NULL) badexit("Error: Failed to allocate memory for sequences.");
+        seqs = tmp_seqs;
+        forget_seqs();
+        load_seqs(kseq);
+        find_seq_dupes();
+      }
+    }
     time_t time2 = time(NULL);
     if (args.v) {
       time_t time3 = difftime(time2, time1);
@@ -2396,6 +7964,14 @@ int main(int argc, char **argv) {
         }
       }
     }
+    if (args.serve != NULL) {
+      serve(argc, argv);
+      close_files();
+      free(threads);
+      free_motifs();
+      free_seqs();
+      return EXIT_SUCCESS;
+    }
     if (!has_motifs) {
       if (args.v) {
         fprintf(stderr, "No motifs provided, printing sequence stats before exit.\n");
@@ -2432,64 +8008,175 @@ int main(int argc, char **argv) {
 
   if (has_seqs && has_motifs) {
 
-    fprintf(files.o, "##minimotif v%s [ ", MINIMOTIF_VERSION);
-    for (size_t i = 1; i < argc; i++) {
-      fprintf(files.o, "%s ", argv[i]);
+    if (args.cooccur && alloc_cooccur()) badexit("");
+    if (args.anchors != NULL && set_anchors()) badexit("");
+
+    uint64_t fingerprint = 0;
+    int resumed = 0;
+    if (args.shard_n) plan_shard();
+    if (args.checkpoint != NULL) {
+      fingerprint = run_fingerprint(argc, argv, 0);
+      resumed = open_checkpoint(fingerprint);
+    }
+
+    if (!resumed && args.shm == NULL) print_scan_header(argc, argv, NULL);
+    if (args.checkpoint != NULL && !resumed) start_checkpoint(fingerprint);
+
+    if (args.qvalues) {
+      files.q = open_tmp_file();
+      if (files.q == NULL) {
+        badexit("Error: Failed to create temporary file for Q-values.");
+      }
+      files.q_open = 1;
     }
-    fprintf(files.o, "]\n");
-    size_t motif_size = 0;
-    for (size_t i = 0; i < motif_info.n; i++) motif_size += motifs[i]->size;
-    fprintf(files.o,
-      "##MotifCount=%zu MotifSize=%zu SeqCount=%zu SeqSize=%zu GC=%.2f%% Ns=%zu\n",
-      motif_info.n, motif_size, seq_info.n, seq_info.total_bases, seq_info.gc_pct,
-      seq_info.unknowns);
-    fprintf(files.o, 
-      "##seqname\tstart\tend\tstrand\tmotif\tpvalue\tscore\tscore_pct\tmatch\n");
 
     if (args.v) fprintf(stderr, "Scanning ...\n");
     time_t time1 = time(NULL);
     if (alloc_cdf()) badexit("");
-    if (args.low_mem) {
+    if (args.no_overlap && alloc_overlap_bufs()) badexit("");
+    if (args.best && alloc_best_hits()) badexit("");
+    if (args.top && alloc_top_hits()) badexit("");
+    if (args.count && alloc_hit_counts()) badexit("");
+    if (args.track != NULL) {
+      if (alloc_tracks()) badexit("");
+      print_track_offsets();
+    }
+    if (args.occupancy || args.bin_stat == BIN_OCCUPANCY) fill_odds_lut();
+    if (args.bin_size && alloc_bins()) badexit("");
+    if (args.sample > 0.0 && pick_sample_blocks()) badexit("");
+    if (args.cache != NULL) alloc_caches();
+    if (args.shm != NULL) open_shm();
+    if (args.numa && !args.low_mem) place_seqs();
+    if (files.v_open) {
+      fprintf(files.o, "##seqname\tpos\tid\tref\talt\tmotif\tref_score\talt_score\t"
+        "score_diff\tref_pvalue\talt_pvalue\tlog10_pvalue_ratio\n");
+    }
+    if (args.occupancy && alloc_occupancy()) badexit("");
+    if (args.enrich) {
+      enrich_hits = calloc(motif_info.n * 2, sizeof(size_t));
+      if (enrich_hits == NULL) {
+        badexit("Error: Failed to allocate memory for enrichment counts.");
+      }
+    }
+    if (args.shuffle) {
+      shuffle_hits = calloc(motif_info.n * 2, sizeof(size_t));
+      if (shuffle_hits == NULL) {
+        badexit("Error: Failed to allocate memory for shuffled hit counts.");
+      }
+    }
+    if (args.mem) {
+      scan_batches(kseq);
+    } else if (args.low_mem) {
       if (args.progress) print_pb(0.0);
-      for (size_t i = 0; i < motif_info.n; i++) {
-        if (args.w && !args.progress) {
-          fprintf(stderr, "    Scanning motif: %s\n", motifs[i]->name);
-        }
-        fill_cdf(motifs[i]);
-        set_threshold(motifs[i]);
-        for (size_t j = 0; j < seq_info.n; j++) {
+      size_t n_done = 0;
+      for (scan_round = 0; scan_round < (args.anchors != NULL ? 2 : 1); scan_round++) {
+        for (size_t i = 0; i < motif_info.n; i++) {
+          if (!in_scan_round(motifs[i]) || motif_is_done(motifs[i])) continue;
           if (args.w && !args.progress) {
-            fprintf(stderr, "        Scanning sequence: %s\n", seq_names[j]);
+            fprintf(stderr, "    Scanning motif: %s\n", motifs[i]->name);
           }
-          if (kseq_read(kseq) < 0) {
-            badexit("Error: Failed to re-read input file.");
-          } else {
-            seqs[0] = (unsigned char *) kseq->seq.s;
+          start_motif_scan(motifs[i]);
+          start_task(motifs[i], 0);
+          size_t j = 0;
+          for (; j < seq_info.n && !stop_requested; j++) {
+            if (args.w && !args.progress) {
+              fprintf(stderr, "        Scanning sequence: %s\n", seq_names[j]);
+            }
+            if (kseq_read(kseq) < 0) {
+              badexit("Error: Failed to re-read input file.");
+            } else {
+              seqs[0] = (unsigned char *) kseq->seq.s;
+            }
+            if (seq_is_done(motifs[i], j)) {
+              skip_done_seq(motifs[i], j);
+              continue;
+            }
+            score_seq(motifs[i], j, 0);
+            task_seq_done(motifs[i], j);
           }
-          score_seq(motifs[i], j, 0);
+          if (shm_ring != NULL) shm_flush(motifs[i]->thread);
+          commit_task(motifs[i], j);
+          finish_motif_scan(motifs[i]);
+          if (stop_requested) break;
+          gzrewind(files.s);
+          kseq_rewind(kseq);
+          if (args.progress) print_pb((double) ++n_done / motif_info.n);
         }
-        gzrewind(files.s);
-        kseq_rewind(kseq);
-        if (args.progress) print_pb((i + 1.0) / motif_info.n);
+        if (args.anchors != NULL && !scan_round) sort_anchor_regions();
       }
       free(seqs[0]);
       if (args.progress) fprintf(stderr, "\n");
     } else {
       if (args.progress) print_pb(0.0);
-      for (size_t t = 0; t < args.nthreads; t++) {
-        size_t *thread_i = malloc(sizeof(size_t *));
-        if (thread_i == NULL) {
-          badexit("Error: Failed to allocate memory for thread index.");
-        }
-        *thread_i = t;
-        pthread_create(&threads[t], NULL, scan_sub_process, thread_i);
-      }
-      for (size_t t = 0; t < args.nthreads; t++) {
-        pthread_join(threads[t], NULL);
+      for (scan_round = 0; scan_round < (args.anchors != NULL ? 2 : 1); scan_round++) {
+        run_motif_threads();
+        if (args.anchors != NULL && !scan_round) sort_anchor_regions();
       }
       if (args.progress) fprintf(stderr, "\n");
     }
+    if (task_files != NULL) finish_tasks();
+    if (args.cache != NULL) free_caches();
+    if (args.shm != NULL) close_shm();
+    if (numa_nodes != NULL) finish_numa();
     free_cdf();
+    if (args.auto_plan) finish_plan();
+    if (args.shuffle) {
+      if (args.v) {
+        fprintf(stderr, "Scanning %'zu shuffled copies of every sequence ...\n",
+          args.shuffle);
+      }
+      scan_shuffles();
+      print_shuffle_stats();
+      free(shuffle_hits);
+    }
+    if (args.cooccur) {
+      if (args.v) fprintf(stderr, "Scanning for co-occurring hits ...\n");
+      run_seq_threads(cooccur_sub_process, NULL);
+      print_cooccur();
+      free_cooccur();
+    }
+    if (args.best) free_best_hits();
+    free_overlap_bufs();
+    if (args.top) {
+      print_top_hits();
+      free_top_hits();
+    }
+    if (args.count) {
+      print_hit_counts();
+      free(hit_counts);
+    }
+    if (args.track != NULL) free_tracks();
+    if (files.v_open) free_variants();
+    if (args.sample > 0.0) {
+      print_sample_stats();
+      free_sample_blocks();
+    }
+    if (args.anchors != NULL) free_anchor_regions();
+    if (args.bin_size) {
+      print_bins();
+      free_bins();
+    }
+    if (args.occupancy) {
+      print_occupancy();
+      free(occupancy);
+    }
+    if (args.enrich) {
+      print_enrichment();
+      free(enrich_hits);
+    }
+    if (args.qvalues) {
+      if (args.v) {
+        fprintf(stderr, "Calculating Q-values (temporary file size: %'.2f MB) ...\n",
+          b2mb(ftell(files.q)));
+      }
+      if (args.qvalues_global) {
+        calc_global_qvalues();
+      } else {
+        for (size_t i = 0; i < motif_info.n; i++) calc_motif_qvalues(motifs[i]);
+      }
+      print_spilled_hits();
+    }
+    if (args.mem && args.v) print_mem_peak();
     time_t time2 = time(NULL);
     time_t time3 = difftime(time2, time1);
     if (args.v) fprintf(stderr, "Done.\n");
@@ -2507,3 +8194,4 @@ int main(int argc, char **argv) {
 
 }
 
+#endif
@@ -0,0 +1,124 @@
+/*
+ *   minimotif: A small super-fast DNA/RNA motif scanner
+ *   Copyright (C) 2022  Benjamin Jean-Marie Tremblay
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/* The libminimotif API. The library is built from the same source as the
+ * CLI (see `make lib`), so motifs are read, thresholded and scanned exactly
+ * as they are by minimotif, with the same results.
+ *
+ * Usage: create a context, set its options (optional), load its motifs once,
+ * then scan as many sequences as needed. Hits are passed to a callback or
+ * collected in an array. Functions returning int return -1 on error, with the
+ * reason given by mm_error(); nothing is ever printed to stderr.
+ *
+ * Contexts are independent of each other, and scanning doesn't change them,
+ * so any number of threads can scan at the same time, with the same or
+ * different contexts. A context must not be scanned while its options or
+ * motifs are being changed (or after it has been freed). The library itself
+ * only ever uses the calling thread.
+ */
+
+#ifndef MINIMOTIF_H
+#define MINIMOTIF_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MM_API __attribute__((visibility("default")))
+
+typedef struct mm_ctx_t mm_ctx_t;
+
+typedef struct mm_options_t {
+  double  bkg[4];                        /* A, C, G, T (default: 0.25)      */
+  int     use_bkg;                       /* Use bkg for all motifs, like -b;
+                                            otherwise it is uniform or from
+                                            the MEME file (default: 0)      */
+  int     nsites;                        /* For PCMs (default: 1000)        */
+  int     pseudocount;                   /* (default: 1)                    */
+  int     forward_only;                  /* Like -f (default: 0)            */
+  int     no_overlap;                    /* Like --no-overlap (default: 0)  */
+  int     dedup;                         /* Like -d (default: 0)            */
+} mm_options_t;
+
+/* Positions are 1-based and inclusive, as in the minimotif output. The names
+ * and match point into the arguments of mm_scan() and the loaded motifs, so
+ * they are only valid as long as those are.
+ */
+typedef struct mm_hit_t {
+  const char *seq_name;
+  const char *motif;
+  size_t      motif_i;                   /* Order of the motif when loaded  */
+  size_t      start;
+  size_t      end;
+  char        strand;
+  double      pvalue;
+  double      score;
+  double      score_pct;
+  const char *match;                     /* Not NUL-terminated              */
+} mm_hit_t;
+
+typedef struct mm_hits_t {
+  mm_hit_t *hits;
+  size_t    n;
+  size_t    n_alloc;
+} mm_hits_t;
+
+typedef void (*mm_hit_fn)(const mm_hit_t *hit, void *data);
+
+/* Returns NULL if out of memory. */
+MM_API mm_ctx_t *mm_new(void);
+MM_API void mm_free(mm_ctx_t *ctx);
+
+/* Fill in the defaults, and set the options of a context. The background,
+ * nsites, pseudocount and dedup options only apply to motifs loaded after.
+ */
+MM_API void mm_default_options(mm_options_t *options);
+MM_API int mm_set_options(mm_ctx_t *ctx, const mm_options_t *options);
+
+/* Read motifs in any format supported by minimotif (MEME, HOMER, JASPAR or
+ * HOCOMOCO) from memory, replacing any already loaded, and compute their
+ * thresholds for the given P-value. Returns the number of motifs.
+ */
+MM_API int mm_load_motifs(mm_ctx_t *ctx, const char *text, size_t size, double pvalue);
+MM_API size_t mm_motif_count(const mm_ctx_t *ctx);
+MM_API const char *mm_motif_name(const mm_ctx_t *ctx, size_t motif_i);
+MM_API size_t mm_motif_size(const mm_ctx_t *ctx, size_t motif_i);
+/* As a score, or NAN if the motif can't reach the P-value. */
+MM_API double mm_motif_threshold(const mm_ctx_t *ctx, size_t motif_i);
+
+/* Scan a sequence (which doesn't need to be NUL-terminated) with all loaded
+ * motifs, one motif at a time. mm_scan_hits() appends to an array, which
+ * should start zeroed and be freed with mm_free_hits().
+ */
+MM_API int mm_scan(const mm_ctx_t *ctx, const char *seq_name, const char *seq,
+  size_t size, mm_hit_fn fn, void *data);
+MM_API int mm_scan_hits(const mm_ctx_t *ctx, const char *seq_name, const char *seq,
+  size_t size, mm_hits_t *hits);
+MM_API void mm_free_hits(mm_hits_t *hits);
+
+/* The last error on the calling thread. */
+MM_API const char *mm_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
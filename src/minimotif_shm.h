@@ -0,0 +1,91 @@
+/*
+ *   minimotif: A small super-fast DNA/RNA motif scanner
+ *   Copyright (C) 2022  Benjamin Jean-Marie Tremblay
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Layout of the POSIX shared memory object written by minimotif --shm, for
+ * consumers (see src/shm_consumer.c for an example). The object is made up
+ * of a header, the sequence and motif tables, their names (NUL-terminated)
+ * and a ring buffer of hit records, at the offsets given in the header.
+ *
+ * minimotif is the single producer and the consumer the single consumer:
+ * records [tail, head) are ready to be read, at index (i % capacity). The
+ * producer only writes head, after the records (release), and waits while
+ * the ring is full. The consumer only writes tail, after reading (release).
+ * Once state is MM_SHM_DONE and tail == head, there are no more hits. Each
+ * side gives up if the other's process disappears. The consumer should
+ * shm_unlink() the object when it is done.
+ */
+
+#ifndef MINIMOTIF_SHM_H
+#define MINIMOTIF_SHM_H
+
+#include <stdint.h>
+
+#define MM_SHM_MAGIC                  "MMSHM001"
+
+enum MM_SHM_STATE {
+  MM_SHM_STARTING = 0,                   /* Tables not written yet */
+  MM_SHM_SCANNING,
+  MM_SHM_DONE
+};
+
+typedef struct mm_shm_header_t {
+  char      magic[8];
+  uint32_t  state;
+  uint32_t  record_size;                 /* sizeof(mm_shm_hit_t) */
+  uint64_t  capacity;                    /* Records, a power of 2 */
+  uint64_t  n_seqs;
+  uint64_t  n_motifs;
+  uint64_t  seqs_offset;                 /* mm_shm_seq_t[n_seqs] */
+  uint64_t  motifs_offset;               /* mm_shm_motif_t[n_motifs] */
+  uint64_t  names_offset;
+  uint64_t  ring_offset;                 /* mm_shm_hit_t[capacity] */
+  int64_t   producer_pid;
+  int64_t   consumer_pid;                /* Set by the consumer, 0 until then */
+  char      pad1[40];
+  uint64_t  head;                        /* Written by the producer */
+  char      pad2[56];
+  uint64_t  tail;                        /* Written by the consumer */
+  char      pad3[56];
+} mm_shm_header_t;
+
+typedef struct mm_shm_seq_t {
+  uint64_t  size;
+  uint64_t  name;                        /* From names_offset */
+} mm_shm_seq_t;
+
+typedef struct mm_shm_motif_t {
+  uint64_t  name;                        /* From names_offset */
+  uint64_t  size;
+} mm_shm_motif_t;
+
+/* The same values as a line of the regular output, but with a 0-based start,
+ * the score multiplied by 1000 and without the match.
+ */
+typedef struct mm_shm_hit_t {
+  uint64_t  start;
+  double    pvalue;
+  double    score_pct;
+  uint32_t  seq_i;
+  uint32_t  motif_i;
+  int32_t   score;
+  char      strand;
+  char      pad[3];
+} mm_shm_hit_t;
+
+#endif
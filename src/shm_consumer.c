@@ -0,0 +1,135 @@
+/*
+ *   minimotif: A small super-fast DNA/RNA motif scanner
+ *   Copyright (C) 2022  Benjamin Jean-Marie Tremblay
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/* An example consumer for minimotif --shm: reads the hits from the ring
+ * buffer as they are written and prints them like minimotif would (minus the
+ * match column), or only counts them with -c. It can be started before or
+ * after minimotif.
+ *
+ *   shm_consumer [-c] /name
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "minimotif_shm.h"
+
+#define WAIT_NS                             50000
+
+static void wait_a_bit(void) {
+  const struct timespec wait = { 0, WAIT_NS };
+  nanosleep(&wait, NULL);
+}
+
+static int producer_is_gone(const mm_shm_header_t *header) {
+  return kill((pid_t) header->producer_pid, 0) && errno == ESRCH;
+}
+
+int main(int argc, char **argv) {
+  const int count_only = argc == 3 && !strcmp(argv[1], "-c");
+  if (argc != 2 + count_only) {
+    fprintf(stderr, "Usage:  shm_consumer [-c] /name\n");
+    return EXIT_FAILURE;
+  }
+  const char *name = argv[1 + count_only];
+
+  /* Wait for minimotif to create the object and fill in the tables. */
+  int fd;
+  while ((fd = shm_open(name, O_RDWR, 0)) == -1) {
+    if (errno != ENOENT) {
+      fprintf(stderr, "Error: Failed to open shared memory object: %s\n", name);
+      return EXIT_FAILURE;
+    }
+    wait_a_bit();
+  }
+  struct stat st;
+  while (!fstat(fd, &st) && (size_t) st.st_size < sizeof(mm_shm_header_t)) wait_a_bit();
+  mm_shm_header_t *header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) {
+    fprintf(stderr, "Error: Failed to map shared memory object: %s\n", name);
+    return EXIT_FAILURE;
+  }
+  while (__atomic_load_n(&header->state, __ATOMIC_ACQUIRE) == MM_SHM_STARTING) {
+    if (header->producer_pid && producer_is_gone(header)) {
+      fprintf(stderr, "Error: minimotif exited before starting its scan.\n");
+      shm_unlink(name);
+      return EXIT_FAILURE;
+    }
+    wait_a_bit();
+  }
+  if (memcmp(header->magic, MM_SHM_MAGIC, 8) || header->record_size != sizeof(mm_shm_hit_t)) {
+    fprintf(stderr, "Error: Not a minimotif --shm object (or a different version): %s\n", name);
+    return EXIT_FAILURE;
+  }
+  __atomic_store_n(&header->consumer_pid, (int64_t) getpid(), __ATOMIC_RELEASE);
+
+  const char *base = (const char *) header;
+  const mm_shm_seq_t *seqs = (const mm_shm_seq_t *) (base + header->seqs_offset);
+  const mm_shm_motif_t *motifs = (const mm_shm_motif_t *) (base + header->motifs_offset);
+  const char *names = base + header->names_offset;
+  const mm_shm_hit_t *ring = (const mm_shm_hit_t *) (base + header->ring_offset);
+  const uint64_t capacity = header->capacity;
+
+  uint64_t tail = header->tail, n_hits = 0;
+  if (!count_only) {
+    printf("##seqname\tstart\tend\tstrand\tmotif\tpvalue\tscore\tscore_pct\n");
+  }
+  for (;;) {
+    const uint32_t state = __atomic_load_n(&header->state, __ATOMIC_ACQUIRE);
+    const uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    if (tail == head) {
+      if (state == MM_SHM_DONE) break;
+      if (producer_is_gone(header)) {
+        fprintf(stderr, "Error: minimotif exited before finishing its scan.\n");
+        shm_unlink(name);
+        return EXIT_FAILURE;
+      }
+      wait_a_bit();
+      continue;
+    }
+    for (; tail < head; tail++) {
+      const mm_shm_hit_t *hit = &ring[tail & (capacity - 1)];
+      if (!count_only) {
+        printf("%s\t%llu\t%llu\t%c\t%s\t%.9g\t%.3f\t%.1f\n",
+          names + seqs[hit->seq_i].name,
+          (unsigned long long) hit->start + 1,
+          (unsigned long long) (hit->start + motifs[hit->motif_i].size),
+          hit->strand,
+          names + motifs[hit->motif_i].name,
+          hit->pvalue,
+          hit->score / 1000.0,
+          hit->score_pct);
+      }
+    }
+    n_hits = tail;
+    __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+  }
+  if (count_only) printf("%llu\n", (unsigned long long) n_hits);
+  munmap(header, st.st_size);
+  shm_unlink(name);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,82 @@
+#!/bin/sh
+# Checks that a scan split over shards, an interrupted and resumed scan, and a
+# scan with a warm --cache all give the same output as a plain scan.
+#
+#   sh test/check_identical.sh [path/to/minimotif]
+
+mm=${1:-bin/minimotif}
+dir=$(dirname "$0")
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+status=0
+
+# Two motifs, so that the resumed scan has a task left to do.
+cat "$dir/motif.jaspar" > "$tmp/motifs.jaspar"
+sed -e 's/^>1-motifA/>2-motifB/' -e 's/^A /X /' -e 's/^T /A /' -e 's/^X /T /' \
+  "$dir/motif.jaspar" >> "$tmp/motifs.jaspar"
+opts="-t 0.05 -m $tmp/motifs.jaspar -s $dir/dna.fa"
+
+# The first line lists the options, which differ between runs.
+check() {
+  if tail -n +2 "$2" | cmp -s - "$tmp/plain.txt"; then
+    echo "ok    $1"
+  else
+    echo "FAIL  $1"
+    status=1
+  fi
+}
+
+$mm $opts > "$tmp/full.txt" || exit 1
+tail -n +2 "$tmp/full.txt" > "$tmp/plain.txt"
+
+for i in 1 2 3; do
+  $mm $opts --shard $i/3 -o "$tmp/shard$i.txt"
+done
+$mm --merge "$tmp/shard1.txt" "$tmp/shard2.txt" "$tmp/shard3.txt" > "$tmp/merged.txt"
+if cmp -s "$tmp/merged.txt" "$tmp/full.txt"; then
+  echo "ok    --shard 1/3 2/3 3/3 + --merge"
+else
+  echo "FAIL  --shard 1/3 2/3 3/3 + --merge"
+  status=1
+fi
+
+# Pretend the run was stopped after the first motif, halfway through writing
+# the hits of the second.
+$mm $opts --checkpoint "$tmp/ck.txt" -o "$tmp/resumed.txt"
+head -n 2 "$tmp/ck.txt" > "$tmp/ck2.txt" && mv "$tmp/ck2.txt" "$tmp/ck.txt"
+printf 'chr_partial\t1' >> "$tmp/resumed.txt"
+$mm $opts --checkpoint "$tmp/ck.txt" --resume -o "$tmp/resumed.txt"
+check "--checkpoint + --resume" "$tmp/resumed.txt"
+
+$mm $opts --cache "$tmp/cache" -o "$tmp/cold.txt"
+check "--cache (cold)" "$tmp/cold.txt"
+$mm $opts --cache "$tmp/cache" -o "$tmp/warm.txt"
+check "--cache (warm)" "$tmp/warm.txt"
+
+# Two motifs with the same PWM share a cache file, while being scanned at
+# the same time by two threads. Every random sequence is there twice, so the
+# hits of the copy are replayed from the file during the first run. Hits come
+# out in any order with -j2.
+sed 's/^>1-motifA/>3-motifA2/' "$dir/motif.jaspar" >> "$tmp/motifs.jaspar"
+awk 'BEGIN {
+  srand(1)
+  for (i = 1; i <= 200; i++) {
+    seq[i] = ""
+    for (j = 0; j < 5000; j++) seq[i] = seq[i] substr("ACGT", int(rand() * 4) + 1, 1)
+  }
+  for (copy = 1; copy <= 2; copy++) {
+    for (i = 1; i <= 200; i++) printf(">r%d_%d\n%s\n", copy, i, seq[i])
+  }
+}' > "$tmp/random.fa"
+opts="-t 0.001 -m $tmp/motifs.jaspar -s $tmp/random.fa"
+$mm $opts | grep -v '^#' | sort > "$tmp/plain.txt"
+for run in cold warm; do
+  if $mm $opts -j2 --cache "$tmp/cache2" | grep -v '^#' | sort | cmp -s - "$tmp/plain.txt"; then
+    echo "ok    --cache ($run, same PWM twice, -j2)"
+  else
+    echo "FAIL  --cache ($run, same PWM twice, -j2)"
+    status=1
+  fi
+done
+
+exit $status